@@ -24,8 +24,11 @@
 #include <stdio.h>
 #include <gio/gio.h>
 
+#include "bluetooth-client.h"
 #include "bluetooth-client-glue.h"
+#include "bluetooth-client-private.h"
 #include "bluetooth-agent.h"
+#include "bluetooth-trace.h"
 
 #define BLUEZ_SERVICE			"org.bluez"
 #define BLUEZ_AGENT_PATH		"/org/bluez/agent/gnome"
@@ -71,6 +74,10 @@ struct _BluetoothAgent {
 	GObject parent;
 
 	GDBusConnection *conn;
+	GCancellable *cancellable;
+	/* Where Device1 proxies come from, see lookup_device() */
+	BluetoothClient *client;
+	GHashTable *devices;
 	gchar *busname;
 	gchar *path;
 	AgentManager1 *agent_manager;
@@ -113,69 +120,35 @@ enum {
 
 static GParamSpec *props[PROP_LAST];
 
-static GDBusProxy *
-get_device_from_path (BluetoothAgent *agent,
-		      const char     *path)
-{
-	Device1 *device;
-
-	device = device1_proxy_new_sync (agent->conn,
-					 G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
-					 BLUEZ_SERVICE,
-					 path,
-					 NULL,
-					 NULL);
-
-	return G_DBUS_PROXY(device);
-}
-
 static gboolean bluetooth_agent_request_pincode(BluetoothAgent *agent,
-			const char *path, GDBusMethodInvocation *invocation)
+			GDBusProxy *device, GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->pincode_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->pincode_func(invocation, device, agent->pincode_data);
 
 	return TRUE;
 }
 
 static gboolean bluetooth_agent_request_passkey(BluetoothAgent *agent,
-			const char *path, GDBusMethodInvocation *invocation)
+			GDBusProxy *device, GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->passkey_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->passkey_func(invocation, device, agent->passkey_data);
 
 	return TRUE;
 }
 
 static gboolean bluetooth_agent_display_passkey(BluetoothAgent *agent,
-			const char *path, guint passkey, guint16 entered,
+			GDBusProxy *device, guint passkey, guint16 entered,
 						GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->display_passkey_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->display_passkey_func(invocation, device, passkey, entered,
 			            agent->display_passkey_data);
 
@@ -183,18 +156,12 @@ static gboolean bluetooth_agent_display_passkey(BluetoothAgent *agent,
 }
 
 static gboolean bluetooth_agent_display_pincode(BluetoothAgent *agent,
-						const char *path, const char *pincode,
+						GDBusProxy *device, const char *pincode,
 						GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->display_pincode_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->display_pincode_func(invocation, device, pincode,
 				    agent->display_pincode_data);
 
@@ -202,53 +169,35 @@ static gboolean bluetooth_agent_display_pincode(BluetoothAgent *agent,
 }
 
 static gboolean bluetooth_agent_request_confirmation(BluetoothAgent *agent,
-					const char *path, guint passkey,
+					GDBusProxy *device, guint passkey,
 						GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->confirm_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->confirm_func(invocation, device, passkey, agent->confirm_data);
 
 	return TRUE;
 }
 
 static gboolean bluetooth_agent_request_authorization(BluetoothAgent *agent,
-					const char *path, GDBusMethodInvocation *invocation)
+					GDBusProxy *device, GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->authorize_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->authorize_func(invocation, device, agent->authorize_data);
 
 	return TRUE;
 }
 
 static gboolean bluetooth_agent_authorize_service(BluetoothAgent *agent,
-					const char *path, const char *uuid,
+					GDBusProxy *device, const char *uuid,
 						GDBusMethodInvocation *invocation)
 {
-	g_autoptr(GDBusProxy) device = NULL;
-
 	if (agent->authorize_service_func == NULL)
 		return FALSE;
 
-	device = get_device_from_path (agent, path);
-	if (device == NULL)
-		return FALSE;
-
 	agent->authorize_service_func(invocation, device, uuid,
 					    agent->authorize_service_data);
 
@@ -264,26 +213,80 @@ static gboolean bluetooth_agent_cancel(BluetoothAgent *agent,
 	return agent->cancel_func(invocation, agent->cancel_data);
 }
 
+static void
+request_default_agent_cb (GObject      *object,
+			  GAsyncResult *res,
+			  gpointer      user_data)
+{
+	g_autoptr(GError) error = NULL;
+
+	if (!agent_manager1_call_request_default_agent_finish (AGENT_MANAGER1 (object), res, &error) &&
+	    !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		g_printerr ("Agent registration as default failed: %s\n", error->message);
+}
+
+static void
+register_agent_cb (GObject      *object,
+		   GAsyncResult *res,
+		   gpointer      user_data)
+{
+	BluetoothAgent *agent;
+	g_autoptr(GError) error = NULL;
+
+	if (!agent_manager1_call_register_agent_finish (AGENT_MANAGER1 (object), res, &error)) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_printerr ("Agent registration failed: %s\n", error->message);
+		return;
+	}
+
+	agent = user_data;
+	if (agent->path == NULL)
+		return;
+
+	agent_manager1_call_request_default_agent (AGENT_MANAGER1 (object),
+						   agent->path,
+						   agent->cancellable,
+						   request_default_agent_cb, NULL);
+}
+
 static void
 register_agent (BluetoothAgent *agent)
 {
+	agent_manager1_call_register_agent (agent->agent_manager,
+					    agent->path,
+					    "DisplayYesNo",
+					    agent->cancellable,
+					    register_agent_cb, agent);
+}
+
+static void
+agent_manager_proxy_new_cb (GObject      *source_object,
+			    GAsyncResult *res,
+			    gpointer      user_data)
+{
+	BluetoothAgent *agent;
+	AgentManager1 *agent_manager;
 	g_autoptr(GError) error = NULL;
-	gboolean ret;
-
-	ret = agent_manager1_call_register_agent_sync (agent->agent_manager,
-						       agent->path,
-						       "DisplayYesNo",
-						       NULL, &error);
-	if (ret == FALSE) {
-		g_printerr ("Agent registration failed: %s\n", error->message);
+
+	agent_manager = agent_manager1_proxy_new_finish (res, &error);
+	if (agent_manager == NULL) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_debug ("Failed to create agent manager proxy: %s", error->message);
 		return;
 	}
 
-	ret = agent_manager1_call_request_default_agent_sync (agent->agent_manager,
-							      agent->path,
-							      NULL, &error);
-	if (ret == FALSE)
-		g_printerr ("Agent registration as default failed: %s\n", error->message);
+	agent = user_data;
+	/* bluetoothd went away in the meantime */
+	if (agent->busname == NULL) {
+		g_object_unref (agent_manager);
+		return;
+	}
+
+	g_clear_object (&agent->agent_manager);
+	agent->agent_manager = agent_manager;
+
+	if (agent->reg_id > 0)
+		register_agent (agent);
 }
 
 static void
@@ -295,15 +298,13 @@ name_appeared_cb (GDBusConnection *connection,
 	g_free (agent->busname);
 	agent->busname = g_strdup (name_owner);
 
-	agent->agent_manager = agent_manager1_proxy_new_sync (agent->conn,
-							      G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
-							      BLUEZ_SERVICE,
-							      "/org/bluez",
-							      NULL,
-							      NULL);
-
-	if (agent->reg_id > 0)
-		register_agent (agent);
+	agent_manager1_proxy_new (agent->conn,
+				  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+				  BLUEZ_SERVICE,
+				  "/org/bluez",
+				  agent->cancellable,
+				  agent_manager_proxy_new_cb,
+				  agent);
 }
 
 static void
@@ -313,6 +314,7 @@ name_vanished_cb (GDBusConnection *connection,
 {
 	g_clear_pointer (&agent->busname, g_free);
 	g_clear_object (&agent->agent_manager);
+	g_hash_table_remove_all (agent->devices);
 }
 
 static void
@@ -353,6 +355,11 @@ static void bluetooth_agent_init(BluetoothAgent *agent)
 {
 	agent->introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
 	g_assert (agent->introspection_data);
+	agent->cancellable = g_cancellable_new ();
+	agent->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+						(GDestroyNotify) g_ref_string_release, g_object_unref);
+	/* Needed right away to export the agent object */
+	_bluetooth_warn_sync_call ("g_bus_get_sync");
 	agent->conn = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
 	agent->watch_id = g_bus_watch_name_on_connection (agent->conn,
 							  BLUEZ_SERVICE,
@@ -369,6 +376,10 @@ static void bluetooth_agent_finalize(GObject *object)
 
 	bluetooth_agent_unregister (agent);
 
+	g_cancellable_cancel (agent->cancellable);
+	g_clear_object (&agent->cancellable);
+	g_clear_object (&agent->client);
+	g_clear_pointer (&agent->devices, g_hash_table_destroy);
 	g_bus_unwatch_name (agent->watch_id);
 	g_free (agent->busname);
 	g_dbus_node_info_unref (agent->introspection_data);
@@ -409,6 +420,119 @@ bluetooth_agent_new (const char *path)
 						      NULL));
 }
 
+static gboolean
+dispatch_method_call (BluetoothAgent        *agent,
+		      GDBusProxy            *device,
+		      GDBusMethodInvocation *invocation)
+{
+	const char *method_name = g_dbus_method_invocation_get_method_name (invocation);
+	GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
+
+	if (g_strcmp0 (method_name, "RequestPinCode") == 0) {
+		return bluetooth_agent_request_pincode (agent, device, invocation);
+	} else if (g_strcmp0 (method_name, "RequestPasskey") == 0) {
+		return bluetooth_agent_request_passkey (agent, device, invocation);
+	} else if (g_strcmp0 (method_name, "DisplayPasskey") == 0) {
+		guint32 passkey;
+		guint16 entered;
+
+		g_variant_get (parameters, "(&ouq)", NULL, &passkey, &entered);
+		return bluetooth_agent_display_passkey (agent, device, passkey, entered, invocation);
+	} else if (g_strcmp0 (method_name, "DisplayPinCode") == 0) {
+		const char *pincode;
+
+		g_variant_get (parameters, "(&o&s)", NULL, &pincode);
+		return bluetooth_agent_display_pincode (agent, device, pincode, invocation);
+	} else if (g_strcmp0 (method_name, "RequestConfirmation") == 0) {
+		guint32 passkey;
+
+		g_variant_get (parameters, "(&ou)", NULL, &passkey);
+		return bluetooth_agent_request_confirmation (agent, device, passkey, invocation);
+	} else if (g_strcmp0 (method_name, "RequestAuthorization") == 0) {
+		return bluetooth_agent_request_authorization (agent, device, invocation);
+	} else if (g_strcmp0 (method_name, "AuthorizeService") == 0) {
+		const char *uuid;
+
+		g_variant_get (parameters, "(&o&s)", NULL, &uuid);
+		return bluetooth_agent_authorize_service (agent, device, uuid, invocation);
+	}
+
+	return FALSE;
+}
+
+static void
+dispatch_or_reject (BluetoothAgent        *agent,
+		    GDBusProxy            *device,
+		    GDBusMethodInvocation *invocation)
+{
+	g_autofree char *method_name = NULL;
+	gint64 begin_time;
+
+	/* The handler might already have replied, and freed the invocation */
+	method_name = g_strdup (g_dbus_method_invocation_get_method_name (invocation));
+	begin_time = *(gint64 *) g_object_get_data (G_OBJECT (invocation), "begin-time");
+
+	if (!dispatch_method_call (agent, device, invocation))
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       BLUETOOTH_AGENT_ERROR,
+							       BLUETOOTH_AGENT_ERROR_REJECT,
+							       "Not handled");
+
+	_bluetooth_trace_mark (begin_time, "Agent", "%s (%s)",
+			       method_name, g_dbus_proxy_get_object_path (device));
+}
+
+static void
+device_proxy_new_cb (GObject      *source_object,
+		     GAsyncResult *res,
+		     gpointer      user_data)
+{
+	GDBusMethodInvocation *invocation = user_data;
+	g_autoptr(Device1) device = NULL;
+	g_autoptr(GError) error = NULL;
+	BluetoothAgent *agent;
+
+	device = device1_proxy_new_finish (res, &error);
+	if (device == NULL) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_debug ("Failed to create device proxy: %s", error->message);
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       BLUETOOTH_AGENT_ERROR,
+							       BLUETOOTH_AGENT_ERROR_REJECT,
+							       "Unknown device");
+		return;
+	}
+
+	/* Still alive, as the proxy creation would have been cancelled */
+	agent = g_dbus_method_invocation_get_user_data (invocation);
+	g_hash_table_insert (agent->devices,
+			     g_ref_string_new_intern (g_dbus_proxy_get_object_path (G_DBUS_PROXY (device))),
+			     g_object_ref (device));
+	dispatch_or_reject (agent, G_DBUS_PROXY (device), invocation);
+}
+
+/* Proxies from the client already have all the properties cached,
+ * and the ones we had to create ourselves are kept for the next
+ * request about the same device, usually during the same pairing */
+static GDBusProxy *
+lookup_device (BluetoothAgent *agent,
+	       const char     *path)
+{
+	GDBusProxy *device;
+
+	if (agent->client != NULL) {
+		device = _bluetooth_client_get_device_proxy (agent->client, path);
+		if (device != NULL)
+			return device;
+	}
+
+	device = g_hash_table_lookup (agent->devices, path);
+	if (device != NULL)
+		return g_object_ref (device);
+
+	return NULL;
+}
+
 static void
 handle_method_call (GDBusConnection       *connection,
 		    const gchar           *sender,
@@ -420,6 +544,9 @@ handle_method_call (GDBusConnection       *connection,
 		    gpointer               user_data)
 {
 	BluetoothAgent *agent = (BluetoothAgent *) user_data;
+	g_autoptr(GDBusProxy) device = NULL;
+	const char *path;
+	gint64 *begin_time;
 
 	if (g_str_equal (sender, agent->busname) == FALSE) {
 		GError *error;
@@ -431,49 +558,34 @@ handle_method_call (GDBusConnection       *connection,
 
 	if (g_strcmp0 (method_name, "Release") == 0) {
 		g_dbus_method_invocation_return_value (invocation, NULL);
-	} else if (g_strcmp0 (method_name, "RequestPinCode") == 0) {
-		const char *path;
-
-		g_variant_get (parameters, "(&o)", &path);
-		bluetooth_agent_request_pincode (agent, path, invocation);
-	} else if (g_strcmp0 (method_name, "RequestPasskey") == 0) {
-		const char *path;
-
-		g_variant_get (parameters, "(&o)", &path);
-		bluetooth_agent_request_passkey (agent, path, invocation);
-	} else if (g_strcmp0 (method_name, "DisplayPasskey") == 0) {
-		const char *path;
-		guint32 passkey;
-		guint16 entered;
-
-		g_variant_get (parameters, "(&ouq)", &path, &passkey, &entered);
-		bluetooth_agent_display_passkey (agent, path, passkey, entered, invocation);
-	} else if (g_strcmp0 (method_name, "DisplayPinCode") == 0) {
-		const char *path;
-		const char *pincode;
-
-		g_variant_get (parameters, "(&o&s)", &path, &pincode);
-		bluetooth_agent_display_pincode (agent, path, pincode, invocation);
-	} else if (g_strcmp0 (method_name, "RequestConfirmation") == 0) {
-		const char *path;
-		guint32 passkey;
-
-		g_variant_get (parameters, "(&ou)", &path, &passkey);
-		bluetooth_agent_request_confirmation (agent, path, passkey, invocation);
-	} else if (g_strcmp0 (method_name, "RequestAuthorization") == 0) {
-		const char *path;
-
-		g_variant_get (parameters, "(&o)", &path);
-		bluetooth_agent_request_authorization (agent, path, invocation);
-	} else if (g_strcmp0 (method_name, "AuthorizeService") == 0) {
-		const char *path;
-		const char *uuid;
-
-		g_variant_get (parameters, "(&o&s)", &path, &uuid);
-		bluetooth_agent_authorize_service (agent, path, uuid, invocation);
+		return;
 	} else if (g_strcmp0 (method_name, "Cancel") == 0) {
 		bluetooth_agent_cancel (agent, invocation);
+		return;
+	}
+
+	/* Until the handler was called, including the proxy creation */
+	begin_time = g_new (gint64, 1);
+	*begin_time = g_get_monotonic_time ();
+	g_object_set_data_full (G_OBJECT (invocation), "begin-time", begin_time, g_free);
+
+	/* All the other methods are about a device, and the
+	 * handlers get a proxy for it, created without blocking
+	 * if we don't already have one */
+	g_variant_get_child (parameters, 0, "&o", &path);
+	device = lookup_device (agent, path);
+	if (device != NULL) {
+		dispatch_or_reject (agent, device, invocation);
+		return;
 	}
+
+	device1_proxy_new (agent->conn,
+			   G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+			   BLUEZ_SERVICE,
+			   path,
+			   agent->cancellable,
+			   device_proxy_new_cb,
+			   invocation);
 }
 
 static const GDBusInterfaceVTable interface_vtable =
@@ -545,6 +657,24 @@ gboolean bluetooth_agent_unregister(BluetoothAgent *agent)
 	return TRUE;
 }
 
+/**
+ * bluetooth_agent_set_client:
+ * @agent: a #BluetoothAgent
+ * @client: (nullable): a #BluetoothClient
+ *
+ * Makes the agent look up devices in @client, so that requests can be
+ * handled without waiting for a new D-Bus proxy to load the device's
+ * properties.
+ **/
+void bluetooth_agent_set_client(BluetoothAgent *agent,
+				BluetoothClient *client)
+{
+	g_return_if_fail (BLUETOOTH_IS_AGENT (agent));
+	g_return_if_fail (client == NULL || BLUETOOTH_IS_CLIENT (client));
+
+	g_set_object (&agent->client, client);
+}
+
 void bluetooth_agent_set_pincode_func(BluetoothAgent *agent,
 				BluetoothAgentPasskeyFunc func, gpointer data)
 {
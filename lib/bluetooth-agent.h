@@ -25,6 +25,7 @@
 
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <bluetooth-client.h>
 
 G_DECLARE_FINAL_TYPE(BluetoothAgent, bluetooth_agent, BLUETOOTH, AGENT, GObject)
 #define BLUETOOTH_TYPE_AGENT (bluetooth_agent_get_type())
@@ -34,6 +35,9 @@ BluetoothAgent *bluetooth_agent_new(const char *path);
 gboolean bluetooth_agent_register(BluetoothAgent *agent);
 gboolean bluetooth_agent_unregister(BluetoothAgent *agent);
 
+void bluetooth_agent_set_client (BluetoothAgent  *agent,
+				 BluetoothClient *client);
+
 typedef void (*BluetoothAgentPasskeyFunc) (GDBusMethodInvocation *invocation,
 					   GDBusProxy            *device,
 					   gpointer               data);
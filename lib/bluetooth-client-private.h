@@ -24,9 +24,11 @@
 #pragma once
 
 #include <glib-object.h>
-#include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <bluetooth-enums.h>
 
+BluetoothClient *bluetooth_client_new_for_connection (GDBusConnection *connection);
+
 typedef void (*BluetoothClientSetupFunc) (BluetoothClient *client,
 					  const GError    *error,
 					  const char      *device_path);
@@ -55,6 +57,11 @@ gboolean bluetooth_client_cancel_setup_device_finish (BluetoothClient *client,
 gboolean bluetooth_client_set_trusted(BluetoothClient *client,
 					const char *device, gboolean trusted);
 
-gboolean bluetooth_client_get_connectable(const char **uuids);
+GVariant *bluetooth_client_get_metrics (BluetoothClient *client);
+void bluetooth_client_reset_metrics (BluetoothClient *client);
 
 GDBusProxy *_bluetooth_client_get_default_adapter (BluetoothClient *client);
+GDBusProxy *_bluetooth_client_get_device_proxy (BluetoothClient *client,
+					      const char      *path);
+
+void _bluetooth_warn_sync_call (const char *call);
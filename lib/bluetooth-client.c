@@ -35,14 +35,17 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <glib/gi18n-lib.h>
-#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
 
 #include "bluetooth-client.h"
 #include "bluetooth-client-private.h"
 #include "bluetooth-client-glue.h"
 #include "bluetooth-device.h"
+#include "bluetooth-trace.h"
 #include "bluetooth-utils.h"
 #include "gnome-bluetooth-enum-types.h"
 #include "pin.h"
@@ -52,18 +55,129 @@
 #define BLUEZ_ADAPTER_INTERFACE		"org.bluez.Adapter1"
 #define BLUEZ_DEVICE_INTERFACE		"org.bluez.Device1"
 
+typedef struct {
+	Adapter1    *proxy;
+	/* Order in which adapters were added, to pick a new default one */
+	guint        serial;
+	GHashTable  *devices; /* key=address, value=DeviceEntry */
+} AdapterEntry;
+
+typedef struct {
+	/* The proxy's property cache is the only copy of the device's
+	 * state until a BluetoothDevice is needed */
+	Device1         *proxy;
+	/* Weak pointer, only set while the device is in use, and kept
+	 * up-to-date whichever adapter the device is on */
+	BluetoothDevice *device;
+	/* Property changes not yet applied to the device */
+	BluetoothDeviceField pending_changes;
+	/* Monotonic time at which the device was last added or changed */
+	gint64           last_seen;
+	/* Hidden from the model by the eviction policy, see evict_devices() */
+	gboolean         evicted;
+	/* Loaded from the cache, without a proxy, and holding a strong
+	 * reference on the device, until bluetoothd's state is loaded */
+	gboolean         cached;
+} DeviceEntry;
+
+/* Durations in bucket i are under 2^i µs, and at least half of that,
+ * except for the last bucket which holds all the longer ones */
+#define HISTOGRAM_NUM_BUCKETS 16
+
+typedef struct {
+	guint64 count;
+	guint64 total; /* µs */
+	guint64 max; /* µs */
+	guint64 buckets[HISTOGRAM_NUM_BUCKETS];
+} Histogram;
+
+/* See bluetooth_client_get_metrics() */
+typedef struct {
+	guint64 adapters_added;
+	guint64 adapters_removed;
+	guint64 adapter_properties_changed;
+	guint64 devices_added;
+	guint64 devices_removed;
+	guint64 device_properties_changed;
+	guint64 model_updates;
+	Histogram device_added_time;
+	Histogram device_notify_time;
+	Histogram add_devices_to_model_time;
+} Metrics;
+
+/* Adds the time elapsed since it was started to the histogram when
+ * going out of scope, with g_auto(HistogramTimer) */
+typedef struct {
+	Histogram *histogram;
+	gint64     start;
+} HistogramTimer;
+
+#define HISTOGRAM_TIMER_START(h) { (h), g_get_monotonic_time () }
+
+static void
+histogram_timer_stop (HistogramTimer *timer)
+{
+	Histogram *histogram = timer->histogram;
+	guint64 elapsed;
+	guint bucket;
+
+	elapsed = MAX (g_get_monotonic_time () - timer->start, 0);
+	bucket = elapsed == 0 ? 0 : MIN (g_bit_storage (elapsed), HISTOGRAM_NUM_BUCKETS - 1);
+
+	histogram->count++;
+	histogram->total += elapsed;
+	histogram->max = MAX (histogram->max, elapsed);
+	histogram->buckets[bucket]++;
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (HistogramTimer, histogram_timer_stop)
+
+#define BLUETOOTH_TYPE_CLIENT_DEVICES (bluetooth_client_devices_get_type ())
+G_DECLARE_FINAL_TYPE (BluetoothClientDevices, bluetooth_client_devices, BLUETOOTH, CLIENT_DEVICES, GObject)
+
 struct _BluetoothClient {
 	GObject parent;
 
-	GListStore *list_store;
+	BluetoothClientDevices *model;
 	Adapter1 *default_adapter;
 	GDBusObjectManager *manager;
+	GDBusConnection *connection; /* NULL for the system bus */
 	GCancellable *cancellable;
-	GtkTreeStore *store;
+	GHashTable *adapters; /* key=object-path, value=AdapterEntry */
+	GHashTable *devices; /* key=object-path, value=DeviceEntry */
+	GHashTable *changed_devices; /* set of DeviceEntry with pending changes */
+	guint changes_id;
+	guint change_interval;
+	/* DeviceEntry gathered while coldplugging, see device_added() */
+	GPtrArray *coldplug_devices;
 	guint num_adapters;
+	guint adapter_serial;
+	/* Eviction policy for discovered devices */
+	guint max_devices;
+	guint max_device_age;
+	gboolean remove_evicted;
+	guint num_evicted;
+	guint evict_id;
+	guint evict_timeout_id;
 	/* Discoverable during discovery? */
 	gboolean disco_during_disco;
 	gboolean discovery_started;
+	/* a{sv} passed to SetDiscoveryFilter, see bluetooth_client_set_discovery_filter() */
+	GVariant *discovery_filter;
+	/* Devices loaded from the cache until bluetoothd's are, see "use-cache" */
+	gboolean use_cache;
+	char *cache_adapter; /* address of the cached default adapter */
+	GHashTable *cached; /* key=address, value=DeviceEntry */
+	guint save_cache_id;
+	GBytes *saved_cache; /* contents of the cache file, to skip identical writes */
+	/* Whether the initial list of adapters and devices was loaded */
+	gboolean ready;
+	GError *init_error;
+	gint64 init_time;
+	GList *init_tasks; /* GTask from g_async_initable_init_async() */
+	FILE *record; /* see record_event() */
+	Metrics metrics;
+	GDBusConnection *metrics_bus;
+	guint metrics_id;
 };
 
 enum {
@@ -73,174 +187,71 @@ enum {
 	PROP_DEFAULT_ADAPTER_POWERED,
 	PROP_DEFAULT_ADAPTER_SETUP_MODE,
 	PROP_DEFAULT_ADAPTER_NAME,
-	PROP_DEFAULT_ADAPTER_ADDRESS
+	PROP_DEFAULT_ADAPTER_ADDRESS,
+	PROP_CHANGE_INTERVAL,
+	PROP_MAX_DISCOVERED_DEVICES,
+	PROP_MAX_DISCOVERED_DEVICE_AGE,
+	PROP_REMOVE_EVICTED_DEVICES,
+	PROP_NUM_EVICTED_DEVICES,
+	PROP_READY,
+	PROP_USE_CACHE,
+	PROP_CONNECTION,
+	PROP_LAST
 };
 
+static GParamSpec *properties[PROP_LAST] = { NULL, };
+
 enum {
 	DEVICE_ADDED,
+	DEVICES_ADDED,
 	DEVICE_REMOVED,
 	LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
-static const char *connectable_uuids[] = {
-	"HSP",
-	"AudioSource",
-	"AudioSink",
-	"A/V_RemoteControlTarget",
-	"A/V_RemoteControl",
-	"Headset_-_AG",
-	"Handsfree",
-	"HandsfreeAudioGateway",
-	"HumanInterfaceDeviceService",
-};
-
-G_DEFINE_TYPE(BluetoothClient, bluetooth_client, G_TYPE_OBJECT)
-
-typedef gboolean (*IterSearchFunc) (GtkTreeStore *store,
-				GtkTreeIter *iter, gpointer user_data);
-
-static gboolean iter_search(GtkTreeStore *store,
-				GtkTreeIter *iter, GtkTreeIter *parent,
-				IterSearchFunc func, gpointer user_data)
-{
-	gboolean cont, found = FALSE;
-
-	if (parent == NULL)
-		cont = gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store),
-									iter);
-	else
-		cont = gtk_tree_model_iter_children(GTK_TREE_MODEL(store),
-								iter, parent);
-
-	while (cont == TRUE) {
-		GtkTreeIter child;
+static void bluetooth_client_async_initable_iface_init (GAsyncInitableIface *iface);
 
-		found = func(store, iter, user_data);
-		if (found == TRUE)
-			break;
-
-		found = iter_search(store, &child, iter, func, user_data);
-		if (found == TRUE) {
-			*iter = child;
-			break;
-		}
-
-		cont = gtk_tree_model_iter_next(GTK_TREE_MODEL(store), iter);
-	}
-
-	return found;
-}
-
-static gboolean
-compare_path (GtkTreeStore *store,
-	      GtkTreeIter *iter,
-	      gpointer user_data)
-{
-	const gchar *path = user_data;
-	g_autoptr(GDBusProxy) object = NULL;
-
-	gtk_tree_model_get (GTK_TREE_MODEL(store), iter,
-			    BLUETOOTH_COLUMN_PROXY, &object,
-			    -1);
-
-	return (object != NULL &&
-		g_str_equal (path, g_dbus_proxy_get_object_path (object)));
-}
-
-static gboolean
-compare_address (GtkTreeStore *store,
-		 GtkTreeIter *iter,
-		 gpointer user_data)
-{
-	const char *address = user_data;
-	g_autofree char *tmp_address = NULL;
+G_DEFINE_TYPE_WITH_CODE (BluetoothClient, bluetooth_client, G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE,
+						bluetooth_client_async_initable_iface_init))
 
-	gtk_tree_model_get (GTK_TREE_MODEL(store), iter,
-			    BLUETOOTH_COLUMN_ADDRESS, &tmp_address, -1);
-	return (g_strcmp0 (address, tmp_address) == 0);
-}
-
-static gboolean
-get_iter_from_path (GtkTreeStore *store,
-		    GtkTreeIter  *iter,
-		    const char   *path)
-{
-	g_return_val_if_fail (path != NULL, FALSE);
-	return iter_search(store, iter, NULL, compare_path, (gpointer) path);
-}
-
-static gboolean
-get_iter_from_proxy(GtkTreeStore *store,
-		    GtkTreeIter *iter,
-		    GDBusProxy *proxy)
+static void
+adapter_entry_free (AdapterEntry *entry)
 {
-	g_return_val_if_fail (proxy != NULL, FALSE);
-	return iter_search(store, iter, NULL, compare_path,
-			   (gpointer) g_dbus_proxy_get_object_path (proxy));
+	g_clear_pointer (&entry->devices, g_hash_table_destroy);
+	g_clear_object (&entry->proxy);
+	g_free (entry);
 }
 
-static gboolean
-get_iter_from_address (GtkTreeStore *store,
-		       GtkTreeIter  *iter,
-		       const char   *address,
-		       GDBusProxy   *adapter)
+static void
+device_entry_free (DeviceEntry *entry)
 {
-	GtkTreeIter parent_iter;
-
-	g_return_val_if_fail (address != NULL, FALSE);
-	g_return_val_if_fail (adapter != NULL, FALSE);
-
-	if (get_iter_from_proxy (store, &parent_iter, adapter) == FALSE)
-		return FALSE;
-
-	return iter_search (store, iter, &parent_iter, compare_address, (gpointer) address);
+	g_clear_object (&entry->proxy);
+	if (entry->cached) {
+		g_clear_object (&entry->device);
+	} else if (entry->device != NULL) {
+		g_object_remove_weak_pointer (G_OBJECT (entry->device), (gpointer *) &entry->device);
+		entry->device = NULL;
+	}
+	g_free (entry);
 }
 
-static char **
-device_list_uuids (const gchar * const *uuids)
+/* The keys of the index tables are owned by the proxies in the entries */
+static AdapterEntry *
+lookup_adapter (BluetoothClient *client,
+		const char      *path)
 {
-	GPtrArray *ret;
-	guint i;
-
-	if (uuids == NULL)
-		return NULL;
-
-	ret = g_ptr_array_new ();
-
-	for (i = 0; uuids[i] != NULL; i++) {
-		const char *uuid;
-
-		uuid = bluetooth_uuid_to_string (uuids[i]);
-		if (uuid == NULL)
-			continue;
-		g_ptr_array_add (ret, g_strdup (uuid));
-	}
-
-	if (ret->len == 0) {
-		g_ptr_array_free (ret, TRUE);
-		return NULL;
-	}
-
-	g_ptr_array_add (ret, NULL);
-
-	return (char **) g_ptr_array_free (ret, FALSE);
+	g_return_val_if_fail (path != NULL, NULL);
+	return g_hash_table_lookup (client->adapters, path);
 }
 
-gboolean
-bluetooth_client_get_connectable(const char **uuids)
+static DeviceEntry *
+lookup_device (BluetoothClient *client,
+	       const char      *path)
 {
-	int i, j;
-
-	for (i = 0; uuids && uuids[i] != NULL; i++) {
-		for (j = 0; j < G_N_ELEMENTS (connectable_uuids); j++) {
-			if (g_str_equal (connectable_uuids[j], uuids[i]))
-				return TRUE;
-		}
-	}
-
-	return FALSE;
+	g_return_val_if_fail (path != NULL, NULL);
+	return g_hash_table_lookup (client->devices, path);
 }
 
 static const char *
@@ -304,207 +315,1101 @@ device_resolve_type_and_icon (Device1 *device, BluetoothType *type, const char *
 		return;
 	}
 
-	if (*type == 0 || *type == BLUETOOTH_TYPE_ANY)
-		*type = bluetooth_appearance_to_type (device1_get_appearance (device));
-	if (*type == 0 || *type == BLUETOOTH_TYPE_ANY)
-		*type = bluetooth_class_to_type (device1_get_class (device));
+	if (*type == 0 || *type == BLUETOOTH_TYPE_ANY)
+		*type = bluetooth_appearance_to_type (device1_get_appearance (device));
+	if (*type == 0 || *type == BLUETOOTH_TYPE_ANY)
+		*type = bluetooth_class_to_type (device1_get_class (device));
+
+	*icon = icon_override (device1_get_address (device), *type);
+
+	if (!*icon)
+		*icon = device1_get_icon (device);
+
+	if (!*icon)
+		*icon = "bluetooth";
+}
+
+typedef const char * (*DeviceStringGetter) (Device1 *device);
+typedef gboolean (*DeviceBooleanGetter) (Device1 *device);
+
+typedef struct {
+	const char           *name;   /* Device1 property */
+	GType                 type;
+	GCallback             getter; /* device1_get_*(), or NULL if computed */
+	const char           *target; /* BluetoothDevice property */
+	BluetoothDeviceField  fields; /* what changes when the property does */
+} DeviceProperty;
+
+/* To handle a new Device1 property, add it here */
+static const DeviceProperty device_properties[] = {
+	{ "name", G_TYPE_STRING, G_CALLBACK (device1_get_name), "name", BLUETOOTH_DEVICE_FIELD_NAME },
+	{ "alias", G_TYPE_STRING, G_CALLBACK (device1_get_alias), "alias", BLUETOOTH_DEVICE_FIELD_ALIAS },
+	{ "paired", G_TYPE_BOOLEAN, G_CALLBACK (device1_get_paired), "paired", BLUETOOTH_DEVICE_FIELD_PAIRED },
+	{ "trusted", G_TYPE_BOOLEAN, G_CALLBACK (device1_get_trusted), "trusted", BLUETOOTH_DEVICE_FIELD_TRUSTED },
+	{ "connected", G_TYPE_BOOLEAN, G_CALLBACK (device1_get_connected), "connected", BLUETOOTH_DEVICE_FIELD_CONNECTED },
+	{ "legacy-pairing", G_TYPE_BOOLEAN, G_CALLBACK (device1_get_legacy_pairing), "legacy-pairing", BLUETOOTH_DEVICE_FIELD_LEGACY_PAIRING },
+	{ "uuids", G_TYPE_NONE, NULL, NULL, BLUETOOTH_DEVICE_FIELD_UUIDS },
+	{ "icon", G_TYPE_NONE, NULL, NULL, BLUETOOTH_DEVICE_FIELD_TYPE | BLUETOOTH_DEVICE_FIELD_ICON },
+	{ "class", G_TYPE_NONE, NULL, NULL, BLUETOOTH_DEVICE_FIELD_TYPE | BLUETOOTH_DEVICE_FIELD_ICON },
+	{ "appearance", G_TYPE_NONE, NULL, NULL, BLUETOOTH_DEVICE_FIELD_TYPE | BLUETOOTH_DEVICE_FIELD_ICON },
+};
+
+#define NOTIFY(prop) (1 << (prop))
+
+typedef struct {
+	const char *name;            /* Adapter1 property */
+	guint notify;                /* client properties changed for any adapter */
+	guint default_notify;        /* ... for the default adapter */
+	guint default_powered_notify; /* ... for the default adapter, if it is powered */
+} AdapterProperty;
+
+static const AdapterProperty adapter_properties[] = {
+	{ "alias", 0,
+	  NOTIFY (PROP_DEFAULT_ADAPTER_POWERED) | NOTIFY (PROP_DEFAULT_ADAPTER_NAME), 0 },
+	{ "discovering", 0,
+	  NOTIFY (PROP_DEFAULT_ADAPTER_SETUP_MODE), 0 },
+	{ "powered", NOTIFY (PROP_DEFAULT_ADAPTER_POWERED), 0,
+	  NOTIFY (PROP_DEFAULT_ADAPTER) | NOTIFY (PROP_DEFAULT_ADAPTER_SETUP_MODE) | NOTIFY (PROP_DEFAULT_ADAPTER_NAME) },
+};
+
+/* key=GQuark of the property name, value=DeviceProperty or AdapterProperty */
+static GHashTable *device_property_table;
+static GHashTable *adapter_property_table;
+
+static GHashTable *
+build_property_table (gconstpointer table,
+		      gsize         entry_size,
+		      guint         n_entries)
+{
+	GHashTable *ret;
+	guint i;
+
+	ret = g_hash_table_new (NULL, NULL);
+	for (i = 0; i < n_entries; i++) {
+		const char *name = *(const char **) ((const guint8 *) table + i * entry_size);
+
+		g_hash_table_insert (ret,
+				     GUINT_TO_POINTER (g_quark_from_static_string (name)),
+				     (gpointer) ((const guint8 *) table + i * entry_size));
+	}
+
+	return ret;
+}
+
+static void
+notify_properties (BluetoothClient *client,
+		   guint            mask)
+{
+	guint i;
+
+	for (i = PROP_0 + 1; i < PROP_LAST; i++) {
+		if (mask & NOTIFY (i))
+			g_object_notify_by_pspec (G_OBJECT (client), properties[i]);
+	}
+}
+
+static void
+device_apply_changes (Device1              *device1,
+		      BluetoothDevice      *device,
+		      BluetoothDeviceField  fields)
+{
+	guint i;
+
+	g_object_freeze_notify (G_OBJECT (device));
+
+	for (i = 0; i < G_N_ELEMENTS (device_properties); i++) {
+		const DeviceProperty *prop = &device_properties[i];
+
+		if (!(fields & prop->fields) || prop->getter == NULL)
+			continue;
+
+		switch (prop->type) {
+		case G_TYPE_STRING:
+			g_object_set (G_OBJECT (device), prop->target,
+				      ((DeviceStringGetter) prop->getter) (device1), NULL);
+			break;
+		case G_TYPE_BOOLEAN:
+			g_object_set (G_OBJECT (device), prop->target,
+				      ((DeviceBooleanGetter) prop->getter) (device1), NULL);
+			break;
+		default:
+			g_assert_not_reached ();
+		}
+	}
+
+	/* Properties computed from the Device1 ones */
+	if (fields & BLUETOOTH_DEVICE_FIELD_UUIDS) {
+		g_object_set (G_OBJECT (device),
+			      "services", bluetooth_uuids_to_service_flags (device1_get_uuids (device1)),
+			      NULL);
+	}
+	if (fields & (BLUETOOTH_DEVICE_FIELD_TYPE | BLUETOOTH_DEVICE_FIELD_ICON)) {
+		BluetoothType type = BLUETOOTH_TYPE_ANY;
+		const char *icon = NULL;
+
+		device_resolve_type_and_icon (device1, &type, &icon);
+
+		g_object_set (G_OBJECT (device),
+			      "type", type,
+			      "icon", icon,
+			      NULL);
+	}
+
+	g_object_thaw_notify (G_OBJECT (device));
+
+	g_signal_emit_by_name (G_OBJECT (device), "changed", fields);
+}
+
+typedef struct {
+	Device1              *proxy;
+	BluetoothDevice      *device;
+	BluetoothDeviceField  fields;
+} DeviceChanges;
+
+static void
+device_changes_clear (DeviceChanges *changes)
+{
+	g_clear_object (&changes->proxy);
+	g_clear_object (&changes->device);
+}
+
+static gboolean
+flush_device_changes_cb (gpointer user_data)
+{
+	BluetoothClient *client = user_data;
+	g_autoptr(GArray) changes = NULL;
+	GHashTableIter iter;
+	DeviceEntry *entry;
+	guint i;
+
+	client->changes_id = 0;
+
+	/* Take references, as handlers could cause devices to go away, or
+	 * more changes to be queued */
+	changes = g_array_sized_new (FALSE, FALSE, sizeof (DeviceChanges),
+				     g_hash_table_size (client->changed_devices));
+	g_array_set_clear_func (changes, (GDestroyNotify) device_changes_clear);
+
+	g_hash_table_iter_init (&iter, client->changed_devices);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &entry, NULL)) {
+		/* Not used anymore, so nothing to update */
+		if (entry->device != NULL) {
+			DeviceChanges c;
+
+			c.proxy = g_object_ref (entry->proxy);
+			c.device = g_object_ref (entry->device);
+			c.fields = entry->pending_changes;
+			g_array_append_val (changes, c);
+		}
+
+		entry->pending_changes = BLUETOOTH_DEVICE_FIELD_NONE;
+		g_hash_table_iter_remove (&iter);
+	}
+
+	for (i = 0; i < changes->len; i++) {
+		DeviceChanges *c = &g_array_index (changes, DeviceChanges, i);
+
+		g_debug ("Applying changes 0x%x to device '%s'", c->fields,
+			 g_dbus_proxy_get_object_path (G_DBUS_PROXY (c->proxy)));
+		device_apply_changes (c->proxy, c->device, c->fields);
+	}
+	client->metrics.model_updates += changes->len;
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+device_entry_cancel_changes (BluetoothClient *client,
+			     DeviceEntry     *entry)
+{
+	if (entry->pending_changes == BLUETOOTH_DEVICE_FIELD_NONE)
+		return;
+	entry->pending_changes = BLUETOOTH_DEVICE_FIELD_NONE;
+	g_hash_table_remove (client->changed_devices, entry);
+}
+
+static void device_entry_seen (BluetoothClient *client, DeviceEntry *entry);
+static gboolean device_entry_is_saved (DeviceEntry *entry);
+static void schedule_save_cache (BluetoothClient *client);
+
+/* Device1 properties that end up in the cache, see save_cache() */
+#define CACHE_FIELDS (BLUETOOTH_DEVICE_FIELD_NAME | \
+		      BLUETOOTH_DEVICE_FIELD_ALIAS | \
+		      BLUETOOTH_DEVICE_FIELD_TYPE | \
+		      BLUETOOTH_DEVICE_FIELD_ICON | \
+		      BLUETOOTH_DEVICE_FIELD_PAIRED | \
+		      BLUETOOTH_DEVICE_FIELD_TRUSTED | \
+		      BLUETOOTH_DEVICE_FIELD_LEGACY_PAIRING | \
+		      BLUETOOTH_DEVICE_FIELD_UUIDS)
+
+static void
+device_notify_cb (Device1         *device1,
+		  GParamSpec      *pspec,
+		  BluetoothClient *client)
+{
+	g_auto(HistogramTimer) timer = HISTOGRAM_TIMER_START (&client->metrics.device_notify_time);
+	const char *property = g_param_spec_get_name (pspec);
+	const DeviceProperty *prop;
+	DeviceEntry *entry;
+	const char *device_path;
+
+	device_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (device1));
+	entry = lookup_device (client, device_path);
+	if (entry == NULL)
+		return;
+
+	/* BlueZ updates RSSI and the like whenever it sees the device */
+	device_entry_seen (client, entry);
+
+	prop = g_hash_table_lookup (device_property_table,
+				    GUINT_TO_POINTER (g_param_spec_get_name_quark (pspec)));
+	/* Only paired or trusted devices are saved, so this is also
+	 * needed when a device stops being either */
+	if (prop != NULL && (prop->fields & CACHE_FIELDS) &&
+	    (device_entry_is_saved (entry) ||
+	     (prop->fields & (BLUETOOTH_DEVICE_FIELD_PAIRED | BLUETOOTH_DEVICE_FIELD_TRUSTED))))
+		schedule_save_cache (client);
+
+	/* Nobody's using the device, it will be created from
+	 * the up-to-date proxy when needed */
+	if (entry->device == NULL)
+		return;
+
+	if (prop == NULL) {
+		g_debug ("Unhandled property: %s", property);
+		return;
+	}
+
+	g_debug ("Property '%s' changed on device '%s'", property, device_path);
+
+	/* Gather all the changes for the same device so that they're
+	 * applied together, see flush_device_changes_cb() */
+	entry->pending_changes |= prop->fields;
+	g_hash_table_add (client->changed_devices, entry);
+
+	if (client->changes_id != 0)
+		return;
+	if (client->change_interval == 0)
+		client->changes_id = g_idle_add (flush_device_changes_cb, client);
+	else
+		client->changes_id = g_timeout_add (client->change_interval, flush_device_changes_cb, client);
+}
+
+static BluetoothDevice *
+device_new_from_proxy (Device1 *device)
+{
+	const char *icon;
+	BluetoothType type = BLUETOOTH_TYPE_ANY;
+
+	device_resolve_type_and_icon (device, &type, &icon);
+
+	return g_object_new (BLUETOOTH_TYPE_DEVICE,
+			     "address", device1_get_address (device),
+			     "alias", device1_get_alias (device),
+			     "name", device1_get_name (device),
+			     "type", type,
+			     "icon", icon,
+			     "legacy-pairing", device1_get_legacy_pairing (device),
+			     "services", bluetooth_uuids_to_service_flags (device1_get_uuids (device)),
+			     "paired", device1_get_paired (device),
+			     "connected", device1_get_connected (device),
+			     "trusted", device1_get_trusted (device),
+			     "proxy", device,
+			     NULL);
+}
+
+/* Returns a new reference to the BluetoothDevice for the entry,
+ * creating it if nothing else uses it */
+static BluetoothDevice *
+device_entry_get_device (DeviceEntry *entry)
+{
+	if (entry->device != NULL)
+		return g_object_ref (entry->device);
+
+	entry->device = device_new_from_proxy (entry->proxy);
+	g_object_add_weak_pointer (G_OBJECT (entry->device), (gpointer *) &entry->device);
+
+	return entry->device;
+}
+
+/* The list of devices on the default adapter, as exposed by
+ * bluetooth_client_get_devices(). BluetoothDevice objects are only
+ * created when they're requested, so that devices that are discovered
+ * but never shown don't cost more than their D-Bus proxy. */
+struct _BluetoothClientDevices {
+	GObject parent;
+
+	GPtrArray *entries; /* DeviceEntry, owned by the client's index */
+	guint64 inserts;
+	guint64 removals;
+};
+
+static void bluetooth_client_devices_list_model_init (GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BluetoothClientDevices, bluetooth_client_devices, G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, bluetooth_client_devices_list_model_init))
+
+static GType
+bluetooth_client_devices_get_item_type (GListModel *list)
+{
+	return BLUETOOTH_TYPE_DEVICE;
+}
+
+static guint
+bluetooth_client_devices_get_n_items (GListModel *list)
+{
+	BluetoothClientDevices *self = BLUETOOTH_CLIENT_DEVICES (list);
+
+	return self->entries->len;
+}
+
+static gpointer
+bluetooth_client_devices_get_item (GListModel *list,
+				   guint       position)
+{
+	BluetoothClientDevices *self = BLUETOOTH_CLIENT_DEVICES (list);
+
+	if (position >= self->entries->len)
+		return NULL;
+
+	return device_entry_get_device (g_ptr_array_index (self->entries, position));
+}
+
+static void
+bluetooth_client_devices_list_model_init (GListModelInterface *iface)
+{
+	iface->get_item_type = bluetooth_client_devices_get_item_type;
+	iface->get_n_items = bluetooth_client_devices_get_n_items;
+	iface->get_item = bluetooth_client_devices_get_item;
+}
+
+static void
+bluetooth_client_devices_finalize (GObject *object)
+{
+	BluetoothClientDevices *self = BLUETOOTH_CLIENT_DEVICES (object);
+
+	g_clear_pointer (&self->entries, g_ptr_array_unref);
+
+	G_OBJECT_CLASS (bluetooth_client_devices_parent_class)->finalize (object);
+}
+
+static void
+bluetooth_client_devices_class_init (BluetoothClientDevicesClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->finalize = bluetooth_client_devices_finalize;
+}
+
+static void
+bluetooth_client_devices_init (BluetoothClientDevices *self)
+{
+	self->entries = g_ptr_array_new ();
+}
+
+/* Replaces @n_removals entries at @position with @additions, emitting
+ * a single items-changed signal */
+static void
+bluetooth_client_devices_splice (BluetoothClientDevices  *self,
+				 guint                    position,
+				 guint                    n_removals,
+				 DeviceEntry            **additions,
+				 guint                    n_additions)
+{
+	GPtrArray *entries;
+	guint i;
+
+	g_return_if_fail (position + n_removals <= self->entries->len);
+
+	if (position + n_removals == self->entries->len) {
+		/* Common case of appending, or emptying */
+		g_ptr_array_set_size (self->entries, position);
+		for (i = 0; i < n_additions; i++)
+			g_ptr_array_add (self->entries, additions[i]);
+	} else {
+		entries = g_ptr_array_sized_new (self->entries->len - n_removals + n_additions);
+		for (i = 0; i < position; i++)
+			g_ptr_array_add (entries, g_ptr_array_index (self->entries, i));
+		for (i = 0; i < n_additions; i++)
+			g_ptr_array_add (entries, additions[i]);
+		for (i = position + n_removals; i < self->entries->len; i++)
+			g_ptr_array_add (entries, g_ptr_array_index (self->entries, i));
+		g_ptr_array_unref (self->entries);
+		self->entries = entries;
+	}
+
+	self->inserts += n_additions;
+	self->removals += n_removals;
+	if (n_removals > 0 || n_additions > 0)
+		g_list_model_items_changed (G_LIST_MODEL (self), position, n_removals, n_additions);
+}
+
+static void
+bluetooth_client_devices_remove (BluetoothClientDevices *self,
+				 DeviceEntry            *entry)
+{
+	guint position;
+
+	if (g_ptr_array_find (self->entries, entry, &position))
+		bluetooth_client_devices_splice (self, position, 1, NULL, 0);
+}
+
+/* Replaces @n_removals devices at @position in the model with the
+ * DeviceEntry in @entries, so that only a single items-changed signal
+ * is emitted. BluetoothDevice objects are only created if something
+ * listens to the device-added or devices-added signals. */
+static void
+splice_devices (BluetoothClient *client,
+		guint            position,
+		guint            n_removals,
+		GPtrArray       *entries)
+{
+	g_autoptr(GPtrArray) devices = NULL;
+	gboolean save = FALSE;
+	guint i;
+
+	for (i = 0; i < n_removals && !save; i++)
+		save = device_entry_is_saved (g_ptr_array_index (client->model->entries, position + i));
+	for (i = 0; i < entries->len && !save; i++)
+		save = device_entry_is_saved (g_ptr_array_index (entries, i));
+
+	bluetooth_client_devices_splice (client->model, position, n_removals,
+					 (DeviceEntry **) entries->pdata, entries->len);
+	if (save)
+		schedule_save_cache (client);
+
+	if (entries->len == 0)
+		return;
+
+	if (!g_signal_has_handler_pending (client, signals[DEVICES_ADDED], 0, FALSE) &&
+	    !g_signal_has_handler_pending (client, signals[DEVICE_ADDED], 0, FALSE))
+		return;
+
+	devices = g_ptr_array_new_full (entries->len, g_object_unref);
+	for (i = 0; i < entries->len; i++)
+		g_ptr_array_add (devices, device_entry_get_device (entries->pdata[i]));
+
+	g_signal_emit (G_OBJECT (client), signals[DEVICES_ADDED], 0, devices);
+	for (i = 0; i < devices->len; i++)
+		g_signal_emit (G_OBJECT (client), signals[DEVICE_ADDED], 0, devices->pdata[i]);
+}
+
+static gboolean
+device_entry_is_on_default_adapter (BluetoothClient *client,
+				    DeviceEntry     *entry)
+{
+	return client->default_adapter != NULL &&
+		g_strcmp0 (device1_get_adapter (entry->proxy),
+			   g_dbus_proxy_get_object_path (G_DBUS_PROXY (client->default_adapter))) == 0;
+}
+
+/* Does not remove the entry from the index */
+static void
+device_entry_remove (BluetoothClient *client,
+		     DeviceEntry     *entry)
+{
+	device_entry_cancel_changes (client, entry);
+
+	/* Already removed from the model */
+	if (entry->evicted)
+		return;
+
+	/* Note that removal can also happen from adapter_removed. */
+	g_signal_emit (G_OBJECT (client), signals[DEVICE_REMOVED], 0,
+		       g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)));
+
+	if (device_entry_is_on_default_adapter (client, entry)) {
+		bluetooth_client_devices_remove (client->model, entry);
+		if (device_entry_is_saved (entry))
+			schedule_save_cache (client);
+	}
+}
+
+static gboolean
+device_entry_is_evictable (DeviceEntry *entry)
+{
+	return !entry->evicted &&
+		!device1_get_paired (entry->proxy) &&
+		!device1_get_trusted (entry->proxy) &&
+		!device1_get_connected (entry->proxy);
+}
+
+static void
+device_entry_evict (BluetoothClient *client,
+		    DeviceEntry     *entry)
+{
+	const char *path;
+
+	path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy));
+	g_debug ("Evicting device '%s'", path);
+
+	device_entry_remove (client, entry);
+	entry->evicted = TRUE;
+	client->num_evicted++;
+
+	if (client->remove_evicted) {
+		AdapterEntry *adapter_entry;
+
+		/* bluetoothd will then remove the object, and device_removed()
+		 * will free the entry */
+		adapter_entry = lookup_adapter (client, device1_get_adapter (entry->proxy));
+		if (adapter_entry != NULL)
+			adapter1_call_remove_device (adapter_entry->proxy, path, NULL, NULL, NULL);
+	}
+}
+
+static gint
+compare_last_seen (gconstpointer a,
+		   gconstpointer b)
+{
+	const DeviceEntry *entry_a = *(DeviceEntry **) a;
+	const DeviceEntry *entry_b = *(DeviceEntry **) b;
+
+	if (entry_a->last_seen < entry_b->last_seen)
+		return -1;
+	return entry_a->last_seen > entry_b->last_seen;
+}
+
+/* Hides unpaired devices that weren't seen for longer than
+ * max-discovered-device-age, and the least recently seen ones
+ * beyond max-discovered-devices. Paired, trusted and connected
+ * devices are never evicted. */
+static void
+evict_devices (BluetoothClient *client)
+{
+	g_autoptr(GPtrArray) candidates = NULL;
+	GHashTableIter iter;
+	DeviceEntry *entry;
+	guint num_evicted, i;
+	gint64 oldest;
+
+	if (client->max_devices == 0 && client->max_device_age == 0)
+		return;
+
+	candidates = g_ptr_array_new ();
+	g_hash_table_iter_init (&iter, client->devices);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+		if (device_entry_is_evictable (entry))
+			g_ptr_array_add (candidates, entry);
+	}
+	g_ptr_array_sort (candidates, compare_last_seen);
+
+	num_evicted = client->num_evicted;
+	oldest = g_get_monotonic_time () - (gint64) client->max_device_age * G_USEC_PER_SEC;
+	for (i = 0; i < candidates->len; i++) {
+		entry = g_ptr_array_index (candidates, i);
+
+		if ((client->max_devices > 0 && candidates->len - i > client->max_devices) ||
+		    (client->max_device_age > 0 && entry->last_seen < oldest))
+			device_entry_evict (client, entry);
+		else
+			break;
+	}
+
+	if (client->num_evicted != num_evicted) {
+		g_debug ("Evicted %u devices", client->num_evicted - num_evicted);
+		g_object_notify_by_pspec (G_OBJECT (client), properties[PROP_NUM_EVICTED_DEVICES]);
+	}
+}
+
+static gboolean
+evict_devices_cb (gpointer user_data)
+{
+	BluetoothClient *client = user_data;
+
+	client->evict_id = 0;
+	evict_devices (client);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_eviction (BluetoothClient *client)
+{
+	if (client->evict_id == 0)
+		client->evict_id = g_idle_add (evict_devices_cb, client);
+}
+
+static gboolean
+evict_devices_timeout_cb (gpointer user_data)
+{
+	BluetoothClient *client = user_data;
+
+	evict_devices (client);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+update_eviction_timeout (BluetoothClient *client)
+{
+	g_clear_handle_id (&client->evict_timeout_id, g_source_remove);
+	/* Check twice per period, so that devices don't linger for
+	 * much longer than the maximum age */
+	if (client->max_device_age > 0)
+		client->evict_timeout_id = g_timeout_add_seconds (MAX (client->max_device_age / 2, 1),
+								  evict_devices_timeout_cb, client);
+	schedule_eviction (client);
+}
+
+static void
+device_entry_seen (BluetoothClient *client,
+		   DeviceEntry     *entry)
+{
+	g_autoptr(GPtrArray) entries = NULL;
+
+	entry->last_seen = g_get_monotonic_time ();
+	if (!entry->evicted)
+		return;
+
+	g_debug ("Evicted device '%s' was seen again",
+		 g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)));
+
+	entry->evicted = FALSE;
+	if (!device_entry_is_on_default_adapter (client, entry))
+		return;
+
+	entries = g_ptr_array_new ();
+	g_ptr_array_add (entries, entry);
+	splice_devices (client, client->model->entries->len, 0, entries);
+
+	/* Make room for it */
+	if (client->max_devices > 0)
+		schedule_eviction (client);
+}
+
+/* Set BLUETOOTH_RECORD_EVENTS to a file name in the environment to
+ * record the adapter and device events the client consumes, one
+ * "(xsssa{sv}as)" GVariant per line: the time in microseconds since the
+ * client was created, the event, the object path, the interface, its
+ * properties and the names of the invalidated properties, such as RSSI
+ * when a device goes out of range. "coldplug" is used for the objects
+ * present on startup, "added", "changed" and "removed" for later changes.
+ * tests/bluetooth-replay can replay the file against a fake bluez. */
+static void
+record_event (BluetoothClient    *client,
+	      const char         *event,
+	      GDBusProxy         *proxy,
+	      GVariant           *properties,
+	      const char * const *invalidated)
+{
+	const char * const no_invalidated[] = { NULL };
+	g_autoptr(GVariant) record = NULL;
+	g_autofree char *line = NULL;
+
+	if (properties == NULL)
+		properties = g_variant_new ("a{sv}", NULL);
+	if (invalidated == NULL)
+		invalidated = no_invalidated;
+
+	record = g_variant_ref_sink (g_variant_new ("(xsss@a{sv}^as)",
+						    g_get_monotonic_time () - client->init_time,
+						    event,
+						    g_dbus_proxy_get_object_path (proxy),
+						    g_dbus_proxy_get_interface_name (proxy),
+						    properties,
+						    invalidated));
+	line = g_variant_print (record, TRUE);
+	fprintf (client->record, "%s\n", line);
+}
+
+static void
+properties_changed_cb (GDBusProxy      *proxy,
+		       GVariant        *changed_properties,
+		       GStrv            invalidated_properties,
+		       BluetoothClient *client)
+{
+	if (IS_ADAPTER1 (proxy))
+		client->metrics.adapter_properties_changed++;
+	else
+		client->metrics.device_properties_changed++;
+
+	if (client->record != NULL)
+		record_event (client, "changed", proxy, changed_properties,
+			      (const char * const *) invalidated_properties);
+}
+
+static void
+record_added (BluetoothClient *client,
+	      GDBusProxy      *proxy)
+{
+	g_auto(GStrv) names = NULL;
+	GVariantBuilder builder;
+	guint i;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+	names = g_dbus_proxy_get_cached_property_names (proxy);
+	for (i = 0; names != NULL && names[i] != NULL; i++) {
+		g_autoptr(GVariant) value = NULL;
+
+		value = g_dbus_proxy_get_cached_property (proxy, names[i]);
+		g_variant_builder_add (&builder, "{sv}", names[i], value);
+	}
+	record_event (client, client->ready ? "added" : "coldplug", proxy,
+		      g_variant_builder_end (&builder), NULL);
+}
+
+/* Called for each adapter and device proxy the client uses */
+static void
+proxy_added (BluetoothClient *client,
+	     GDBusProxy      *proxy)
+{
+	if (client->record != NULL)
+		record_added (client, proxy);
+
+	g_signal_connect_object (G_OBJECT (proxy), "g-properties-changed",
+				 G_CALLBACK (properties_changed_cb), client, 0);
+}
+
+#define CACHE_VERSION 1
+/* version, address of the default adapter, and for each of its paired
+ * or trusted devices: object path, address, alias, name, icon, type,
+ * services, paired, trusted and legacy-pairing */
+#define CACHE_TYPE "(usa(ssmsmsmsuubbb))"
+#define CACHE_SAVE_DELAY 2 /* seconds */
+
+static char *
+cache_get_filename (void)
+{
+	return g_build_filename (g_get_user_cache_dir (), "gnome-bluetooth", "devices.gvariant", NULL);
+}
+
+/* Fills the model with the devices saved by a previous instance, so
+ * they can be shown before bluetoothd's state is loaded */
+static void
+load_cache (BluetoothClient *client)
+{
+	g_autofree char *filename = NULL;
+	g_autoptr(GMappedFile) mapped = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	g_autoptr(GVariant) cache = NULL;
+	g_autoptr(GVariantIter) iter = NULL;
+	g_autoptr(GPtrArray) entries = NULL;
+	g_autoptr(GError) error = NULL;
+	const char *adapter, *path, *address, *alias, *name, *icon;
+	guint32 version, type, services;
+	gboolean paired, trusted, legacy_pairing;
+
+	if (client->ready || client->cached != NULL || client->model->entries->len > 0)
+		return;
+
+	filename = cache_get_filename ();
+	mapped = g_mapped_file_new (filename, FALSE, &error);
+	if (mapped == NULL) {
+		g_debug ("Could not load device cache: %s", error->message);
+		return;
+	}
+
+	bytes = g_mapped_file_get_bytes (mapped);
+	cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (CACHE_TYPE), bytes, FALSE));
+	g_variant_get (cache, "(u&sa(ssmsmsmsuubbb))", &version, &adapter, &iter);
+	if (version != CACHE_VERSION) {
+		g_debug ("Ignoring device cache '%s' with version %u", filename, version);
+		return;
+	}
+
+	client->cache_adapter = g_strdup (adapter);
+	client->saved_cache = g_bytes_new (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+	client->cached = g_hash_table_new_full (g_str_hash, g_str_equal,
+						(GDestroyNotify) g_ref_string_release,
+						(GDestroyNotify) device_entry_free);
+	entries = g_ptr_array_new ();
+
+	while (g_variant_iter_next (iter, "(&s&sm&sm&sm&suubbb)", &path, &address,
+				    &alias, &name, &icon, &type, &services,
+				    &paired, &trusted, &legacy_pairing)) {
+		g_autoptr(GDBusProxy) proxy = NULL;
+		DeviceEntry *entry;
+
+		if (g_hash_table_contains (client->cached, address))
+			continue;
+
+		/* Only there for bluetooth_device_get_object_path(), it
+		 * is replaced by the real proxy once the device is loaded */
+		proxy = g_object_new (G_TYPE_DBUS_PROXY,
+				      "g-name", BLUEZ_SERVICE,
+				      "g-object-path", path,
+				      "g-interface-name", BLUEZ_DEVICE_INTERFACE,
+				      NULL);
+
+		entry = g_new0 (DeviceEntry, 1);
+		entry->cached = TRUE;
+		entry->last_seen = g_get_monotonic_time ();
+		entry->device = g_object_new (BLUETOOTH_TYPE_DEVICE,
+					      "proxy", proxy,
+					      "address", address,
+					      "alias", alias,
+					      "name", name,
+					      "icon", icon,
+					      "type", type,
+					      "services", services,
+					      "paired", paired,
+					      "trusted", trusted,
+					      "legacy-pairing", legacy_pairing,
+					      NULL);
+		g_hash_table_insert (client->cached, g_ref_string_new_intern (address), entry);
+		g_ptr_array_add (entries, entry);
+	}
+
+	g_debug ("Loaded %u devices on adapter '%s' from the cache", entries->len, adapter);
+
+	splice_devices (client, 0, 0, entries);
+}
+
+/* Removes the cached devices that bluetoothd doesn't know about */
+static void
+drop_cache (BluetoothClient *client)
+{
+	GHashTableIter iter;
+	DeviceEntry *entry;
+
+	if (client->cached == NULL)
+		return;
+
+	g_debug ("Removing %u cached devices that weren't found",
+		 g_hash_table_size (client->cached));
+
+	g_hash_table_iter_init (&iter, client->cached);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+		bluetooth_client_devices_remove (client->model, entry);
+		g_signal_emit (G_OBJECT (client), signals[DEVICE_REMOVED], 0,
+			       bluetooth_device_get_object_path (entry->device));
+	}
+
+	g_clear_pointer (&client->cached, g_hash_table_destroy);
+	g_clear_pointer (&client->cache_adapter, g_free);
+}
 
-	*icon = icon_override (device1_get_address (device), *type);
+/* Turns the cached entry for @device into a live one, keeping its
+ * position in the model and its BluetoothDevice */
+static gboolean
+reconcile_cached_device (BluetoothClient *client,
+			 AdapterEntry    *adapter_entry,
+			 Device1         *device)
+{
+	BluetoothDevice *cached_device;
+	DeviceEntry *entry;
+	gpointer key;
 
-	if (!*icon)
-		*icon = device1_get_icon (device);
+	if (client->cached == NULL ||
+	    !g_hash_table_steal_extended (client->cached, device1_get_address (device),
+					  &key, (gpointer *) &entry))
+		return FALSE;
+	g_ref_string_release (key);
+
+	g_debug ("Cached device '%s' was found", device1_get_address (device));
+
+	entry->cached = FALSE;
+	entry->proxy = DEVICE1 (g_object_ref (device));
+	entry->last_seen = g_get_monotonic_time ();
+	g_hash_table_insert (client->devices,
+			     (gpointer) g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)),
+			     entry);
+	g_hash_table_insert (adapter_entry->devices,
+			     g_ref_string_new_intern (device1_get_address (device)), entry);
+
+	/* The entry only keeps a weak pointer from now on */
+	cached_device = entry->device;
+	g_object_add_weak_pointer (G_OBJECT (cached_device), (gpointer *) &entry->device);
+	g_object_set (G_OBJECT (cached_device), "proxy", device, NULL);
+	device_apply_changes (device, cached_device,
+			      BLUETOOTH_DEVICE_FIELD_NAME |
+			      BLUETOOTH_DEVICE_FIELD_ALIAS |
+			      BLUETOOTH_DEVICE_FIELD_TYPE |
+			      BLUETOOTH_DEVICE_FIELD_ICON |
+			      BLUETOOTH_DEVICE_FIELD_PAIRED |
+			      BLUETOOTH_DEVICE_FIELD_TRUSTED |
+			      BLUETOOTH_DEVICE_FIELD_CONNECTED |
+			      BLUETOOTH_DEVICE_FIELD_LEGACY_PAIRING |
+			      BLUETOOTH_DEVICE_FIELD_UUIDS);
+	g_object_unref (cached_device);
 
-	if (!*icon)
-		*icon = "bluetooth";
+	return TRUE;
 }
 
 static void
-device_notify_cb (Device1         *device1,
-		  GParamSpec      *pspec,
-		  BluetoothClient *client)
+save_cache_cb (GObject      *source_object,
+	       GAsyncResult *res,
+	       gpointer      user_data)
 {
-	const char *property = g_param_spec_get_name (pspec);
-	GtkTreeIter iter;
-	guint i, n_items;
-	g_autoptr(BluetoothDevice) device = NULL;
-	const char *device_path;
+	g_autoptr(GError) error = NULL;
+
+	if (!g_file_replace_contents_finish (G_FILE (source_object), res, NULL, &error))
+		g_warning ("Could not save device cache: %s", error->message);
+}
+
+static void
+save_cache (BluetoothClient *client,
+	    gboolean         sync)
+{
+	g_autofree char *filename = NULL;
+	g_autofree char *dirname = NULL;
+	g_autoptr(GVariant) cache = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	g_autoptr(GFile) file = NULL;
+	GVariantBuilder builder;
+	guint i;
 
-	if (get_iter_from_proxy (client->store, &iter, G_DBUS_PROXY (device1)) == FALSE)
+	/* Nothing to save until bluetoothd's state is known */
+	if (client->default_adapter == NULL || client->cached != NULL)
 		return;
 
-	device_path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (device1));
-	n_items = g_list_model_get_n_items (G_LIST_MODEL (client->list_store));
-	for (i = 0; i < n_items; i++) {
-		g_autoptr(BluetoothDevice) d = NULL;
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssmsmsmsuubbb)"));
+	for (i = 0; i < client->model->entries->len; i++) {
+		DeviceEntry *entry = g_ptr_array_index (client->model->entries, i);
+		Device1 *proxy = entry->proxy;
+		BluetoothType type = BLUETOOTH_TYPE_ANY;
+		const char *icon = NULL;
 
-		d = g_list_model_get_item (G_LIST_MODEL (client->list_store), i);
-		if (g_str_equal (device_path, bluetooth_device_get_object_path (d))) {
-			device = g_steal_pointer (&d);
-			break;
-		}
+		if (!device1_get_paired (proxy) && !device1_get_trusted (proxy))
+			continue;
+
+		device_resolve_type_and_icon (proxy, &type, &icon);
+		g_variant_builder_add (&builder, "(ssmsmsmsuubbb)",
+				       g_dbus_proxy_get_object_path (G_DBUS_PROXY (proxy)),
+				       device1_get_address (proxy),
+				       device1_get_alias (proxy),
+				       device1_get_name (proxy),
+				       icon,
+				       type,
+				       bluetooth_uuids_to_service_flags (device1_get_uuids (proxy)),
+				       device1_get_paired (proxy),
+				       device1_get_trusted (proxy),
+				       device1_get_legacy_pairing (proxy));
 	}
+	cache = g_variant_ref_sink (g_variant_new ("(usa(ssmsmsmsuubbb))", CACHE_VERSION,
+						   adapter1_get_address (client->default_adapter),
+						   &builder));
 
-	if (!device) {
-		g_debug ("Device %s was not known, so property '%s' not applied", device_path, property);
+	bytes = g_variant_get_data_as_bytes (cache);
+	if (client->saved_cache != NULL && g_bytes_equal (bytes, client->saved_cache))
 		return;
-	}
 
-	g_debug ("Property '%s' changed on device '%s'", property, device_path);
+	filename = cache_get_filename ();
+	dirname = g_path_get_dirname (filename);
+	if (g_mkdir_with_parents (dirname, 0700) < 0) {
+		g_warning ("Could not create '%s': %s", dirname, g_strerror (errno));
+		return;
+	}
 
-	if (g_strcmp0 (property, "name") == 0) {
-		const gchar *name = device1_get_name (device1);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_NAME, name, -1);
-		g_object_set (G_OBJECT (device), "name", name, NULL);
-	} else if (g_strcmp0 (property, "alias") == 0) {
-		const gchar *alias = device1_get_alias (device1);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_ALIAS, alias, -1);
-		g_object_set (G_OBJECT (device), "alias", alias, NULL);
-	} else if (g_strcmp0 (property, "paired") == 0) {
-		gboolean paired = device1_get_paired (device1);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_PAIRED, paired, -1);
-		g_object_set (G_OBJECT (device), "paired", paired, NULL);
-	} else if (g_strcmp0 (property, "trusted") == 0) {
-		gboolean trusted = device1_get_trusted (device1);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_TRUSTED, trusted, -1);
-		g_object_set (G_OBJECT (device), "trusted", trusted, NULL);
-	} else if (g_strcmp0 (property, "connected") == 0) {
-		gboolean connected = device1_get_connected (device1);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_CONNECTED, connected, -1);
-		g_object_set (G_OBJECT (device), "connected", connected, NULL);
-	} else if (g_strcmp0 (property, "uuids") == 0) {
-		g_auto(GStrv) uuids = NULL;
-
-		uuids = device_list_uuids (device1_get_uuids (device1));
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_UUIDS, uuids, -1);
-		g_object_set (G_OBJECT (device), "uuids", uuids, NULL);
-	} else if (g_strcmp0 (property, "legacy-pairing") == 0) {
-		gboolean legacypairing = device1_get_legacy_pairing (device1);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_LEGACYPAIRING, legacypairing,
-				    -1);
-		g_object_set (G_OBJECT (device), "legacy-pairing", legacypairing, NULL);
-	} else if (g_strcmp0 (property, "icon") == 0 ||
-		   g_strcmp0 (property, "class") == 0 ||
-		   g_strcmp0 (property, "appearance") == 0) {
-		BluetoothType type = BLUETOOTH_TYPE_ANY;
-		const char *icon = NULL;
+	g_clear_pointer (&client->saved_cache, g_bytes_unref);
+	client->saved_cache = g_bytes_ref (bytes);
 
-		device_resolve_type_and_icon (device1, &type, &icon);
+	if (sync) {
+		g_autoptr(GError) error = NULL;
 
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_TYPE, type,
-				    BLUETOOTH_COLUMN_ICON, icon,
-				    -1);
-		g_object_set (G_OBJECT (device),
-			      "type", type,
-			      "icon", icon,
-			      NULL);
-	} else {
-		g_debug ("Unhandled property: %s", property);
+		if (!g_file_set_contents (filename, g_bytes_get_data (bytes, NULL),
+					  g_bytes_get_size (bytes), &error))
+			g_warning ("Could not save device cache: %s", error->message);
+		return;
 	}
+
+	file = g_file_new_for_path (filename);
+	g_file_replace_contents_bytes_async (file, bytes, NULL, FALSE,
+					     G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+					     NULL, save_cache_cb, NULL);
+}
+
+static gboolean
+device_entry_is_saved (DeviceEntry *entry)
+{
+	/* Entries loaded from the cache have no proxy, and are
+	 * never saved back */
+	return entry->proxy != NULL &&
+		(device1_get_paired (entry->proxy) || device1_get_trusted (entry->proxy));
+}
+
+static gboolean
+save_cache_timeout_cb (gpointer user_data)
+{
+	BluetoothClient *client = user_data;
+
+	client->save_cache_id = 0;
+	save_cache (client, FALSE);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Saves the cache once changes have settled down */
+static void
+schedule_save_cache (BluetoothClient *client)
+{
+	if (!client->use_cache || !client->ready || client->save_cache_id != 0)
+		return;
+
+	client->save_cache_id = g_timeout_add_seconds (CACHE_SAVE_DELAY, save_cache_timeout_cb, client);
 }
 
 static void
 device_added (GDBusObjectManager   *manager,
 	      Device1              *device,
-	      BluetoothClient      *client,
-	      gboolean              coldplug)
-{
-	g_autoptr (GDBusProxy) adapter = NULL;
-	const char *adapter_path, *address, *alias, *name, *icon;
-	g_auto(GStrv) uuids = NULL;
-	gboolean default_adapter;
-	gboolean paired, trusted, connected;
-	int legacypairing;
-	BluetoothType type = BLUETOOTH_TYPE_ANY;
-	GtkTreeIter iter, parent;
+	      BluetoothClient      *client)
+{
+	g_auto(HistogramTimer) timer = HISTOGRAM_TIMER_START (&client->metrics.device_added_time);
+	AdapterEntry *adapter_entry;
+	DeviceEntry *entry;
+	const char *adapter_path, *address;
 
+	proxy_added (client, G_DBUS_PROXY (device));
 	g_signal_connect_object (G_OBJECT (device), "notify",
 				 G_CALLBACK (device_notify_cb), client, 0);
 
 	adapter_path = device1_get_adapter (device);
 	address = device1_get_address (device);
-	alias = device1_get_alias (device);
-	name = device1_get_name (device);
-	paired = device1_get_paired (device);
-	trusted = device1_get_trusted (device);
-	connected = device1_get_connected (device);
-	uuids = device_list_uuids (device1_get_uuids (device));
-	legacypairing = device1_get_legacy_pairing (device);
-
-	device_resolve_type_and_icon (device, &type, &icon);
 
 	g_debug ("Inserting device '%s' on adapter '%s'", address, adapter_path);
 
-	if (get_iter_from_path (client->store, &parent, adapter_path) == FALSE)
+	adapter_entry = lookup_adapter (client, adapter_path);
+	if (adapter_entry == NULL)
+		return;
+
+	entry = g_hash_table_lookup (adapter_entry->devices, address);
+	if (entry != NULL) {
+		/* Already in the model if it needs to be */
+		if (entry->proxy == device)
+			return;
+
+		g_hash_table_steal (client->devices,
+				    g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)));
+		g_set_object (&entry->proxy, device);
+		g_hash_table_insert (client->devices,
+				     (gpointer) g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)),
+				     entry);
+		if (entry->device != NULL)
+			g_object_set (G_OBJECT (entry->device), "proxy", device, NULL);
+		device_entry_seen (client, entry);
+		return;
+	}
+
+	if (adapter_entry->proxy == client->default_adapter &&
+	    reconcile_cached_device (client, adapter_entry, device)) {
+		if (client->max_devices > 0)
+			schedule_eviction (client);
+		return;
+	}
+
+	entry = g_new0 (DeviceEntry, 1);
+	entry->proxy = DEVICE1 (g_object_ref (device));
+	entry->last_seen = g_get_monotonic_time ();
+	g_hash_table_insert (client->devices,
+			     (gpointer) g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)),
+			     entry);
+	g_hash_table_insert (adapter_entry->devices, g_ref_string_new_intern (address), entry);
+
+	if (client->max_devices > 0)
+		schedule_eviction (client);
+
+	if (adapter_entry->proxy != client->default_adapter)
 		return;
 
-	gtk_tree_model_get (GTK_TREE_MODEL(client->store), &parent,
-			    BLUETOOTH_COLUMN_PROXY, &adapter,
-			    BLUETOOTH_COLUMN_DEFAULT, &default_adapter,
-			    -1);
-
-	if (get_iter_from_address (client->store, &iter, address, adapter) == FALSE) {
-		gtk_tree_store_insert_with_values (client->store, &iter, &parent, -1,
-						   BLUETOOTH_COLUMN_ADDRESS, address,
-						   BLUETOOTH_COLUMN_ALIAS, alias,
-						   BLUETOOTH_COLUMN_NAME, name,
-						   BLUETOOTH_COLUMN_TYPE, type,
-						   BLUETOOTH_COLUMN_ICON, icon,
-						   BLUETOOTH_COLUMN_LEGACYPAIRING, legacypairing,
-						   BLUETOOTH_COLUMN_UUIDS, uuids,
-						   BLUETOOTH_COLUMN_PAIRED, paired,
-						   BLUETOOTH_COLUMN_CONNECTED, connected,
-						   BLUETOOTH_COLUMN_TRUSTED, trusted,
-						   BLUETOOTH_COLUMN_PROXY, device,
-						   -1);
+	if (client->coldplug_devices != NULL) {
+		g_ptr_array_add (client->coldplug_devices, entry);
 	} else {
-		gtk_tree_store_set(client->store, &iter,
-				   BLUETOOTH_COLUMN_ADDRESS, address,
-				   BLUETOOTH_COLUMN_ALIAS, alias,
-				   BLUETOOTH_COLUMN_NAME, name,
-				   BLUETOOTH_COLUMN_TYPE, type,
-				   BLUETOOTH_COLUMN_ICON, icon,
-				   BLUETOOTH_COLUMN_LEGACYPAIRING, legacypairing,
-				   BLUETOOTH_COLUMN_UUIDS, uuids,
-				   BLUETOOTH_COLUMN_PAIRED, paired,
-				   BLUETOOTH_COLUMN_CONNECTED, connected,
-				   BLUETOOTH_COLUMN_TRUSTED, trusted,
-				   BLUETOOTH_COLUMN_PROXY, device,
-				   -1);
-	}
-
-	if (default_adapter && !coldplug) {
-		BluetoothDevice *device_obj;
-
-		device_obj = g_object_new (BLUETOOTH_TYPE_DEVICE,
-					   "address", address,
-					   "alias", alias,
-					   "name", name,
-					   "type", type,
-					   "icon", icon,
-					   "legacy-pairing", legacypairing,
-					   "uuids", uuids,
-					   "paired", paired,
-					   "connected", connected,
-					   "trusted", trusted,
-					   "proxy", device,
-					   NULL);
-		g_list_store_append (client->list_store, device_obj);
-		g_signal_emit (G_OBJECT (client), signals[DEVICE_ADDED], 0, device_obj);
+		g_autoptr(GPtrArray) entries = NULL;
+
+		entries = g_ptr_array_new ();
+		g_ptr_array_add (entries, entry);
+		splice_devices (client, client->model->entries->len, 0, entries);
 	}
 }
 
@@ -512,28 +1417,23 @@ static void
 device_removed (const char      *path,
 		BluetoothClient *client)
 {
-	GtkTreeIter iter;
-	guint i, n_items;
+	AdapterEntry *adapter_entry;
+	DeviceEntry *entry;
 
 	g_debug ("Removing device '%s'", path);
 
-	if (get_iter_from_path(client->store, &iter, path) == TRUE) {
-		/* Note that removal can also happen from adapter_removed. */
-		g_signal_emit (G_OBJECT (client), signals[DEVICE_REMOVED], 0, path);
-		gtk_tree_store_remove(client->store, &iter);
+	entry = lookup_device (client, path);
+	if (entry == NULL) {
+		g_debug ("Device %s was not known, so not removed", path);
+		return;
 	}
 
-	n_items = g_list_model_get_n_items (G_LIST_MODEL (client->list_store));
-	for (i = 0; i < n_items; i++) {
-		g_autoptr(BluetoothDevice) device = NULL;
+	adapter_entry = lookup_adapter (client, device1_get_adapter (entry->proxy));
+	if (adapter_entry != NULL)
+		g_hash_table_remove (adapter_entry->devices, device1_get_address (entry->proxy));
 
-		device = g_list_model_get_item (G_LIST_MODEL (client->list_store), i);
-		if (g_str_equal (path, bluetooth_device_get_object_path (device))) {
-			g_list_store_remove (client->list_store, i);
-			return;
-		}
-	}
-	g_debug ("Device %s was not known, so not removed", path);
+	device_entry_remove (client, entry);
+	g_hash_table_remove (client->devices, path);
 }
 
 static void
@@ -570,70 +1470,42 @@ adapter_set_powered (BluetoothClient *client,
 }
 
 static void
-add_devices_to_list_store (BluetoothClient *client)
+add_devices_to_model (BluetoothClient *client)
 {
-	GList *object_list, *l;
-
-	g_debug ("Emptying list store as default adapter changed");
-	g_list_store_remove_all (client->list_store);
-
-	g_debug ("Coldplugging devices for new default adapter");
-	object_list = g_dbus_object_manager_get_objects (client->manager);
-	for (l = object_list; l != NULL; l = l->next) {
-		GDBusObject *object = l->data;
-		GDBusInterface *iface;
-		const char *adapter_path, *address, *alias, *name, *icon;
-		g_auto(GStrv) uuids = NULL;
-		gboolean default_adapter;
-		gboolean paired, trusted, connected;
-		int legacypairing;
-		BluetoothType type = BLUETOOTH_TYPE_ANY;
-		GtkTreeIter parent;
-		BluetoothDevice *device_obj;
+	g_auto(HistogramTimer) timer = HISTOGRAM_TIMER_START (&client->metrics.add_devices_to_model_time);
+	AdapterEntry *adapter_entry;
+	GHashTableIter iter;
+	DeviceEntry *entry;
+	g_autoptr(GPtrArray) entries = NULL;
+
+	adapter_entry = lookup_adapter (client, g_dbus_proxy_get_object_path (G_DBUS_PROXY (client->default_adapter)));
+	entries = g_ptr_array_sized_new (adapter_entry ? g_hash_table_size (adapter_entry->devices) : 0);
+
+	/* The entries are already up-to-date, we only need to swap
+	 * which ones are exposed */
+	if (adapter_entry != NULL) {
+		g_hash_table_iter_init (&iter, adapter_entry->devices);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+			if (!entry->evicted)
+				g_ptr_array_add (entries, entry);
+		}
+	}
 
-		iface = g_dbus_object_get_interface (object, BLUEZ_DEVICE_INTERFACE);
-		if (!iface)
-			continue;
+	/* The cached devices are kept if they were on this adapter, as they
+	 * will be matched with the real ones as those get added */
+	if (client->cached != NULL &&
+	    g_strcmp0 (client->cache_adapter, adapter1_get_address (client->default_adapter)) == 0) {
+		g_debug ("Adding %u devices from new default adapter '%s' after the cached ones",
+			 entries->len, g_dbus_proxy_get_object_path (G_DBUS_PROXY (client->default_adapter)));
+		splice_devices (client, client->model->entries->len, 0, entries);
+		return;
+	}
+	drop_cache (client);
 
-		adapter_path = device1_get_adapter (DEVICE1 (iface));
-		if (get_iter_from_path (client->store, &parent, adapter_path) == FALSE)
-			continue;
-		gtk_tree_model_get (GTK_TREE_MODEL(client->store), &parent,
-				    BLUETOOTH_COLUMN_DEFAULT, &default_adapter,
-				    -1);
-		if (!default_adapter)
-			continue;
+	g_debug ("Replacing model contents with %u devices from new default adapter '%s'",
+		 entries->len, g_dbus_proxy_get_object_path (G_DBUS_PROXY (client->default_adapter)));
 
-		address = device1_get_address (DEVICE1 (iface));
-		alias = device1_get_alias (DEVICE1 (iface));
-		name = device1_get_name (DEVICE1 (iface));
-		paired = device1_get_paired (DEVICE1 (iface));
-		trusted = device1_get_trusted (DEVICE1 (iface));
-		connected = device1_get_connected (DEVICE1 (iface));
-		uuids = device_list_uuids (device1_get_uuids (DEVICE1 (iface)));
-		legacypairing = device1_get_legacy_pairing (DEVICE1 (iface));
-
-		device_resolve_type_and_icon (DEVICE1 (iface), &type, &icon);
-
-		g_debug ("Adding device '%s' on adapter '%s' to list store", address, adapter_path);
-
-		device_obj = g_object_new (BLUETOOTH_TYPE_DEVICE,
-					   "address", address,
-					   "alias", alias,
-					   "name", name,
-					   "type", type,
-					   "icon", icon,
-					   "legacy-pairing", legacypairing,
-					   "uuids", uuids,
-					   "paired", paired,
-					   "connected", connected,
-					   "trusted", trusted,
-					   "proxy", DEVICE1 (iface),
-					   NULL);
-		g_list_store_append (client->list_store, device_obj);
-		g_signal_emit (G_OBJECT (client), signals[DEVICE_ADDED], 0, device_obj);
-	}
-	g_list_free_full (object_list, g_object_unref);
+	splice_devices (client, 0, client->model->entries->len, entries);
 }
 
 static void
@@ -641,27 +1513,21 @@ default_adapter_changed (GDBusObjectManager   *manager,
 			 GDBusProxy           *adapter,
 			 BluetoothClient      *client)
 {
-	GtkTreeIter iter;
-	gboolean powered;
+	AdapterEntry *entry;
 
 	g_assert (!client->default_adapter);
 
-	if (get_iter_from_proxy (client->store, &iter, adapter) == FALSE)
+	entry = lookup_adapter (client, g_dbus_proxy_get_object_path (adapter));
+	if (entry == NULL)
 		return;
 
 	g_debug ("Setting '%s' as the new default adapter", g_dbus_proxy_get_object_path (adapter));
 
 	client->default_adapter = ADAPTER1 (g_object_ref (G_OBJECT (adapter)));
 
-	gtk_tree_store_set (client->store, &iter,
-			    BLUETOOTH_COLUMN_DEFAULT, TRUE, -1);
-
-	add_devices_to_list_store (client);
+	add_devices_to_model (client);
 
-	gtk_tree_model_get (GTK_TREE_MODEL(client->store), &iter,
-			   BLUETOOTH_COLUMN_POWERED, &powered, -1);
-
-	if (powered) {
+	if (adapter1_get_powered (entry->proxy)) {
 		g_debug ("New default adapter is powered, so invalidating all the default-adapter* properties");
 		g_object_notify (G_OBJECT (client), "default-adapter");
 		g_object_notify (G_OBJECT (client), "default-adapter-powered");
@@ -684,63 +1550,31 @@ adapter_notify_cb (Adapter1       *adapter,
 		   BluetoothClient *client)
 {
 	const char *property = g_param_spec_get_name (pspec);
-	GtkTreeIter iter;
-	gboolean notify = TRUE;
+	const AdapterProperty *prop;
 	gboolean is_default;
+	guint mask;
+
+	if (lookup_adapter (client, g_dbus_proxy_get_object_path (G_DBUS_PROXY (adapter))) == NULL)
+		return;
 
-	if (get_iter_from_proxy (client->store, &iter, G_DBUS_PROXY (adapter)) == FALSE)
+	prop = g_hash_table_lookup (adapter_property_table,
+				    GUINT_TO_POINTER (g_param_spec_get_name_quark (pspec)));
+	if (prop == NULL)
 		return;
 
-	gtk_tree_model_get (GTK_TREE_MODEL(client->store), &iter,
-			    BLUETOOTH_COLUMN_DEFAULT, &is_default, -1);
+	is_default = (adapter == client->default_adapter);
 
 	g_debug ("Property '%s' changed on %sadapter '%s'", property,
 		 is_default ? "default " : "",
 		 g_dbus_proxy_get_object_path (G_DBUS_PROXY (adapter)));
 
-	if (g_strcmp0 (property, "alias") == 0) {
-		const gchar *alias = adapter1_get_alias (adapter);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_ALIAS, alias, -1);
-
-		if (is_default) {
-			g_object_notify (G_OBJECT (client), "default-adapter-powered");
-			g_object_notify (G_OBJECT (client), "default-adapter-name");
-		}
-	} else if (g_strcmp0 (property, "discovering") == 0) {
-		gboolean discovering = adapter1_get_discovering (adapter);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_DISCOVERING, discovering, -1);
-
-		if (is_default)
-			g_object_notify (G_OBJECT (client), "default-adapter-setup-mode");
-	} else if (g_strcmp0 (property, "powered") == 0) {
-		gboolean powered = adapter1_get_powered (adapter);
-
-		gtk_tree_store_set (client->store, &iter,
-				    BLUETOOTH_COLUMN_POWERED, powered, -1);
-
-		if (is_default && powered) {
-			g_debug ("Default adapter is powered, so invalidating all the default-adapter* properties");
-			g_object_notify (G_OBJECT (client), "default-adapter");
-			g_object_notify (G_OBJECT (client), "default-adapter-setup-mode");
-			g_object_notify (G_OBJECT (client), "default-adapter-name");
-		}
-		g_object_notify (G_OBJECT (client), "default-adapter-powered");
-	} else {
-		notify = FALSE;
-	}
-
-	if (notify != FALSE) {
-		GtkTreePath *path;
-
-		/* Tell the world */
-		path = gtk_tree_model_get_path (GTK_TREE_MODEL (client->store), &iter);
-		gtk_tree_model_row_changed (GTK_TREE_MODEL (client->store), path, &iter);
-		gtk_tree_path_free (path);
+	mask = prop->notify;
+	if (is_default) {
+		mask |= prop->default_notify;
+		if (adapter1_get_powered (adapter))
+			mask |= prop->default_powered_notify;
 	}
+	notify_properties (client, mask);
 }
 
 static void
@@ -748,29 +1582,22 @@ adapter_added (GDBusObjectManager   *manager,
 	       Adapter1             *adapter,
 	       BluetoothClient      *client)
 {
-	GtkTreeIter iter;
-	const gchar *address, *name, *alias;
-	gboolean discovering, powered;
+	AdapterEntry *entry;
 
+	proxy_added (client, G_DBUS_PROXY (adapter));
 	g_signal_connect_object (G_OBJECT (adapter), "notify",
 				 G_CALLBACK (adapter_notify_cb), client, 0);
 
-	address = adapter1_get_address (adapter);
-	name = adapter1_get_name (adapter);
-	alias = adapter1_get_alias (adapter);
-	discovering = adapter1_get_discovering (adapter);
-	powered = adapter1_get_powered (adapter);
+	g_debug ("Inserting adapter '%s'", adapter1_get_address (adapter));
 
-	g_debug ("Inserting adapter '%s'", address);
-
-	gtk_tree_store_insert_with_values(client->store, &iter, NULL, -1,
-					  BLUETOOTH_COLUMN_PROXY, adapter,
-					  BLUETOOTH_COLUMN_ADDRESS, address,
-					  BLUETOOTH_COLUMN_NAME, name,
-					  BLUETOOTH_COLUMN_ALIAS, alias,
-					  BLUETOOTH_COLUMN_DISCOVERING, discovering,
-					  BLUETOOTH_COLUMN_POWERED, powered,
-					  -1);
+	entry = g_new0 (AdapterEntry, 1);
+	entry->proxy = ADAPTER1 (g_object_ref (adapter));
+	entry->serial = client->adapter_serial++;
+	entry->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+						(GDestroyNotify) g_ref_string_release, NULL);
+	g_hash_table_insert (client->adapters,
+			     (gpointer) g_dbus_proxy_get_object_path (G_DBUS_PROXY (entry->proxy)),
+			     entry);
 
 	if (!client->default_adapter) {
 		default_adapter_changed (manager,
@@ -787,57 +1614,60 @@ adapter_removed (GDBusObjectManager   *manager,
 		 const char           *path,
 		 BluetoothClient      *client)
 {
-	GtkTreeIter iter, childiter;
+	AdapterEntry *entry;
+	GHashTableIter iter;
+	DeviceEntry *device_entry;
 	gboolean was_default = FALSE;
-	gboolean have_child;
 
-	if (g_strcmp0 (path, g_dbus_proxy_get_object_path (G_DBUS_PROXY (client->default_adapter))) == 0)
+	entry = lookup_adapter (client, path);
+	if (entry == NULL)
+		return;
+
+	if (ADAPTER1 (entry->proxy) == client->default_adapter)
 		was_default = TRUE;
 
 	g_debug ("Removing adapter '%s'", path);
 
-	if (!was_default)
-		goto out;
-
-	if (get_iter_from_path (client->store, &iter, path) == FALSE)
-		return;
+	/* Its devices are all going away */
+	if (was_default) {
+		drop_cache (client);
+		bluetooth_client_devices_splice (client->model, 0, client->model->entries->len, NULL, 0);
+	}
 
 	/* Ensure that all devices are removed. This can happen if bluetoothd
 	 * crashes as the "object-removed" signal is emitted in an undefined
 	 * order. */
-	have_child = gtk_tree_model_iter_children (GTK_TREE_MODEL (client->store), &childiter, &iter);
-	while (have_child) {
-		GDBusProxy *object;
-
-		gtk_tree_model_get (GTK_TREE_MODEL(client->store), &childiter,
-				    BLUETOOTH_COLUMN_PROXY, &object, -1);
-
-		g_signal_emit (G_OBJECT (client), signals[DEVICE_REMOVED], 0, g_dbus_proxy_get_object_path (object));
-		g_object_unref (object);
-
-		have_child = gtk_tree_store_remove (client->store, &childiter);
+	g_hash_table_iter_init (&iter, entry->devices);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &device_entry)) {
+		device_entry_remove (client, device_entry);
+		g_hash_table_iter_remove (&iter);
+		g_hash_table_remove (client->devices,
+				     g_dbus_proxy_get_object_path (G_DBUS_PROXY (device_entry->proxy)));
 	}
 
-	g_clear_object (&client->default_adapter);
-	gtk_tree_store_remove (client->store, &iter);
+	g_hash_table_remove (client->adapters, path);
 
-	if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL(client->store),
-					   &iter)) {
-		GDBusProxy *adapter;
+	if (was_default) {
+		AdapterEntry *oldest = NULL;
 
-		gtk_tree_model_get (GTK_TREE_MODEL(client->store), &iter,
-				   BLUETOOTH_COLUMN_PROXY, &adapter, -1);
+		g_clear_object (&client->default_adapter);
 
-		default_adapter_changed (manager, adapter, client);
+		/* The oldest remaining adapter becomes the default one */
+		g_hash_table_iter_init (&iter, client->adapters);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+			if (oldest == NULL || entry->serial < oldest->serial)
+				oldest = entry;
+		}
 
-		g_object_unref(adapter);
-	} else {
-		g_object_notify (G_OBJECT (client), "default-adapter");
-		g_object_notify (G_OBJECT (client), "default-adapter-powered");
-		g_object_notify (G_OBJECT (client), "default-adapter-setup-mode");
+		if (oldest != NULL) {
+			default_adapter_changed (manager, G_DBUS_PROXY (oldest->proxy), client);
+		} else {
+			g_object_notify (G_OBJECT (client), "default-adapter");
+			g_object_notify (G_OBJECT (client), "default-adapter-powered");
+			g_object_notify (G_OBJECT (client), "default-adapter-setup-mode");
+		}
 	}
 
-out:
 	client->num_adapters--;
 	g_object_notify (G_OBJECT (client), "num-adapters");
 }
@@ -868,14 +1698,15 @@ interface_added (GDBusObjectManager *manager,
 	BluetoothClient *client = user_data;
 
 	if (IS_ADAPTER1 (interface)) {
+		client->metrics.adapters_added++;
 		adapter_added (manager,
 			       ADAPTER1 (interface),
 			       client);
 	} else if (IS_DEVICE1 (interface)) {
+		client->metrics.devices_added++;
 		device_added (manager,
 			      DEVICE1 (interface),
-			      client,
-			      FALSE);
+			      client);
 	}
 }
 
@@ -887,11 +1718,16 @@ interface_removed (GDBusObjectManager *manager,
 {
 	BluetoothClient *client = user_data;
 
+	if (client->record != NULL && (IS_ADAPTER1 (interface) || IS_DEVICE1 (interface)))
+		record_event (client, "removed", G_DBUS_PROXY (interface), NULL, NULL);
+
 	if (IS_ADAPTER1 (interface)) {
+		client->metrics.adapters_removed++;
 		adapter_removed (manager,
 				 g_dbus_object_get_object_path (object),
 				 client);
 	} else if (IS_DEVICE1 (interface)) {
+		client->metrics.devices_removed++;
 		device_removed (g_dbus_object_get_object_path (object),
 				client);
 	}
@@ -927,6 +1763,118 @@ object_removed (GDBusObjectManager *manager,
 	g_list_free_full (interfaces, g_object_unref);
 }
 
+static void
+return_init_task (BluetoothClient *client,
+		  GTask           *task)
+{
+	if (g_task_return_error_if_cancelled (task))
+		return;
+	if (client->init_error != NULL)
+		g_task_return_error (task, g_error_copy (client->init_error));
+	else
+		g_task_return_boolean (task, TRUE);
+}
+
+/* Called once the initial adapters and devices were added, or
+ * the ObjectManager could not be created */
+static void
+set_ready (BluetoothClient *client,
+	   const GError    *error)
+{
+	GList *tasks, *l;
+
+	g_assert (!client->ready);
+
+	client->ready = TRUE;
+	if (error != NULL)
+		client->init_error = g_error_copy (error);
+
+	g_debug ("Client ready after %" G_GINT64_FORMAT " ms, with %u adapters and %u devices",
+		 (g_get_monotonic_time () - client->init_time) / 1000,
+		 client->num_adapters, client->model->entries->len);
+
+	tasks = g_steal_pointer (&client->init_tasks);
+	for (l = tasks; l != NULL; l = l->next)
+		return_init_task (client, l->data);
+	g_list_free_full (tasks, g_object_unref);
+
+	g_object_notify_by_pspec (G_OBJECT (client), properties[PROP_READY]);
+}
+
+static gboolean
+init_task_cancelled_cb (GCancellable *cancellable,
+			gpointer      user_data)
+{
+	GTask *task = user_data;
+	BluetoothClient *client = g_task_get_source_object (task);
+	GList *l;
+
+	/* Not waiting for the client to be ready anymore */
+	l = g_list_find (client->init_tasks, task);
+	if (l != NULL) {
+		client->init_tasks = g_list_delete_link (client->init_tasks, l);
+		g_task_return_error_if_cancelled (task);
+		g_object_unref (task);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+cancelled_source_free (GSource *source)
+{
+	g_source_destroy (source);
+	g_source_unref (source);
+}
+
+static void
+bluetooth_client_init_async (GAsyncInitable      *initable,
+			     int                  io_priority,
+			     GCancellable        *cancellable,
+			     GAsyncReadyCallback  callback,
+			     gpointer             user_data)
+{
+	BluetoothClient *client = BLUETOOTH_CLIENT (initable);
+	g_autoptr(GTask) task = NULL;
+	GSource *source;
+
+	task = g_task_new (client, cancellable, callback, user_data);
+	g_task_set_source_tag (task, bluetooth_client_init_async);
+	g_task_set_priority (task, io_priority);
+
+	/* Loading was started on construction, so only wait for it */
+	if (client->ready) {
+		return_init_task (client, task);
+		return;
+	}
+
+	/* Dispatched in the task's context, where init_tasks is used,
+	 * and destroyed along with the task */
+	if (cancellable != NULL) {
+		source = g_cancellable_source_new (cancellable);
+		g_source_set_callback (source, (GSourceFunc) init_task_cancelled_cb, task, NULL);
+		g_source_attach (source, g_task_get_context (task));
+		g_task_set_task_data (task, source, (GDestroyNotify) cancelled_source_free);
+	}
+
+	client->init_tasks = g_list_append (client->init_tasks, g_steal_pointer (&task));
+}
+
+static gboolean
+bluetooth_client_init_finish (GAsyncInitable  *initable,
+			      GAsyncResult    *res,
+			      GError         **error)
+{
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+bluetooth_client_async_initable_iface_init (GAsyncInitableIface *iface)
+{
+	iface->init_async = bluetooth_client_init_async;
+	iface->init_finish = bluetooth_client_init_finish;
+}
+
 static void
 object_manager_new_callback(GObject      *source_object,
 			    GAsyncResult *res,
@@ -935,12 +1883,16 @@ object_manager_new_callback(GObject      *source_object,
 	BluetoothClient *client;
 	GDBusObjectManager *manager;
 	GList *object_list, *l;
+	g_autoptr(GPtrArray) devices = NULL;
 	GError *error = NULL;
 
-	manager = g_dbus_object_manager_client_new_for_bus_finish (res, &error);
+	manager = g_dbus_object_manager_client_new_finish (res, &error);
 	if (!manager) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
 			g_warning ("Could not create bluez object manager: %s", error->message);
+			drop_cache (user_data);
+			set_ready (user_data, error);
+		}
 		g_error_free (error);
 		return;
 	}
@@ -963,8 +1915,8 @@ object_manager_new_callback(GObject      *source_object,
 	object_list = g_dbus_object_manager_get_objects (client->manager);
 
 	/* We need to add the adapters first, otherwise the devices will
-	 * be dropped to the floor, as they wouldn't have a parent in
-	 * the treestore */
+	 * be dropped to the floor, as they wouldn't have a parent adapter
+	 * to be indexed under */
 	g_debug ("Adding adapters from ObjectManager");
 	for (l = object_list; l != NULL; l = l->next) {
 		GDBusObject *object = l->data;
@@ -980,6 +1932,7 @@ object_manager_new_callback(GObject      *source_object,
 	}
 
 	g_debug ("Adding devices from ObjectManager");
+	client->coldplug_devices = g_ptr_array_new ();
 	for (l = object_list; l != NULL; l = l->next) {
 		GDBusObject *object = l->data;
 		GDBusInterface *iface;
@@ -990,41 +1943,222 @@ object_manager_new_callback(GObject      *source_object,
 
 		device_added (client->manager,
 			      DEVICE1 (iface),
-			      client,
-			      TRUE);
+			      client);
+	}
+	g_list_free_full (object_list, g_object_unref);
+
+	devices = g_steal_pointer (&client->coldplug_devices);
+	splice_devices (client, client->model->entries->len, 0, devices);
+	drop_cache (client);
+
+	set_ready (client, NULL);
+	schedule_save_cache (client);
+}
+
+static GVariant *
+histogram_to_variant (const Histogram *histogram)
+{
+	return g_variant_new ("(ttt@at)",
+			      histogram->count,
+			      histogram->total,
+			      histogram->max,
+			      g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, histogram->buckets,
+							 HISTOGRAM_NUM_BUCKETS, sizeof (guint64)));
+}
+
+static GVariant *
+metrics_to_variant (BluetoothClient *client)
+{
+	const Metrics *metrics = &client->metrics;
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	DeviceEntry *entry;
+	guint live_devices = 0;
+	guint oui_hits, oui_misses, oui_size;
+
+	oui_to_vendor_get_stats (&oui_hits, &oui_misses, &oui_size);
+
+	g_hash_table_iter_init (&iter, client->devices);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+		if (entry->device != NULL)
+			live_devices++;
+	}
+	if (client->cached != NULL)
+		live_devices += g_hash_table_size (client->cached);
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&builder, "{sv}", "adapters-added",
+			       g_variant_new_uint64 (metrics->adapters_added));
+	g_variant_builder_add (&builder, "{sv}", "adapters-removed",
+			       g_variant_new_uint64 (metrics->adapters_removed));
+	g_variant_builder_add (&builder, "{sv}", "adapter-properties-changed",
+			       g_variant_new_uint64 (metrics->adapter_properties_changed));
+	g_variant_builder_add (&builder, "{sv}", "devices-added",
+			       g_variant_new_uint64 (metrics->devices_added));
+	g_variant_builder_add (&builder, "{sv}", "devices-removed",
+			       g_variant_new_uint64 (metrics->devices_removed));
+	g_variant_builder_add (&builder, "{sv}", "device-properties-changed",
+			       g_variant_new_uint64 (metrics->device_properties_changed));
+	g_variant_builder_add (&builder, "{sv}", "model-inserts",
+			       g_variant_new_uint64 (client->model->inserts));
+	g_variant_builder_add (&builder, "{sv}", "model-removals",
+			       g_variant_new_uint64 (client->model->removals));
+	g_variant_builder_add (&builder, "{sv}", "model-updates",
+			       g_variant_new_uint64 (metrics->model_updates));
+	g_variant_builder_add (&builder, "{sv}", "device-added-time",
+			       histogram_to_variant (&metrics->device_added_time));
+	g_variant_builder_add (&builder, "{sv}", "device-notify-time",
+			       histogram_to_variant (&metrics->device_notify_time));
+	g_variant_builder_add (&builder, "{sv}", "add-devices-to-model-time",
+			       histogram_to_variant (&metrics->add_devices_to_model_time));
+	g_variant_builder_add (&builder, "{sv}", "adapter-proxies",
+			       g_variant_new_uint32 (g_hash_table_size (client->adapters)));
+	g_variant_builder_add (&builder, "{sv}", "device-proxies",
+			       g_variant_new_uint32 (g_hash_table_size (client->devices)));
+	g_variant_builder_add (&builder, "{sv}", "live-devices",
+			       g_variant_new_uint32 (live_devices));
+	g_variant_builder_add (&builder, "{sv}", "oui-cache-hits",
+			       g_variant_new_uint64 (oui_hits));
+	g_variant_builder_add (&builder, "{sv}", "oui-cache-misses",
+			       g_variant_new_uint64 (oui_misses));
+	g_variant_builder_add (&builder, "{sv}", "oui-cache-size",
+			       g_variant_new_uint32 (oui_size));
+
+	return g_variant_builder_end (&builder);
+}
+
+static void
+reset_metrics (BluetoothClient *client)
+{
+	memset (&client->metrics, 0, sizeof (client->metrics));
+	client->model->inserts = 0;
+	client->model->removals = 0;
+}
+
+#define METRICS_PATH "/org/gnome/Bluetooth/Metrics"
+
+static const char metrics_introspection[] =
+	"<node>"
+	"  <interface name='org.gnome.Bluetooth.Metrics1'>"
+	"    <method name='GetMetrics'>"
+	"      <arg name='metrics' type='a{sv}' direction='out'/>"
+	"    </method>"
+	"    <method name='ResetMetrics'/>"
+	"  </interface>"
+	"</node>";
+
+static void
+metrics_method_call (GDBusConnection       *connection,
+		     const char            *sender,
+		     const char            *object_path,
+		     const char            *interface_name,
+		     const char            *method_name,
+		     GVariant              *parameters,
+		     GDBusMethodInvocation *invocation,
+		     gpointer               user_data)
+{
+	BluetoothClient *client = user_data;
+
+	if (g_str_equal (method_name, "GetMetrics")) {
+		g_dbus_method_invocation_return_value (invocation,
+						       g_variant_new ("(@a{sv})", metrics_to_variant (client)));
+	} else if (g_str_equal (method_name, "ResetMetrics")) {
+		reset_metrics (client);
+		g_dbus_method_invocation_return_value (invocation, NULL);
+	}
+}
+
+static void
+metrics_bus_cb (GObject      *source_object,
+		GAsyncResult *res,
+		gpointer      user_data)
+{
+	static const GDBusInterfaceVTable vtable = { metrics_method_call, NULL, NULL };
+	g_autoptr(GDBusNodeInfo) info = NULL;
+	g_autoptr(GDBusConnection) bus = NULL;
+	g_autoptr(GError) error = NULL;
+	BluetoothClient *client;
+
+	bus = g_bus_get_finish (res, &error);
+	if (bus == NULL) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning ("Could not export metrics: %s", error->message);
+		return;
+	}
+
+	client = user_data;
+	info = g_dbus_node_info_new_for_xml (metrics_introspection, NULL);
+	client->metrics_id = g_dbus_connection_register_object (bus, METRICS_PATH,
+								info->interfaces[0], &vtable,
+								client, NULL, &error);
+	if (client->metrics_id == 0) {
+		g_warning ("Could not export metrics: %s", error->message);
+		return;
+	}
+
+	g_debug ("Exported metrics on '%s' at '%s'", g_dbus_connection_get_unique_name (bus), METRICS_PATH);
+	client->metrics_bus = g_steal_pointer (&bus);
+}
+
+static void bluetooth_client_init(BluetoothClient *client)
+{
+	const char *filename;
+
+	client->cancellable = g_cancellable_new ();
+	client->model = g_object_new (BLUETOOTH_TYPE_CLIENT_DEVICES, NULL);
+	client->adapters = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  NULL, (GDestroyNotify) adapter_entry_free);
+	client->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 NULL, (GDestroyNotify) device_entry_free);
+	client->changed_devices = g_hash_table_new (NULL, NULL);
+	client->discovery_filter = discovery_filter_new (NULL, 0, 0, NULL, TRUE);
+	client->init_time = g_get_monotonic_time ();
+
+	filename = g_getenv ("BLUETOOTH_RECORD_EVENTS");
+	if (filename != NULL) {
+		client->record = g_fopen (filename, "we");
+		if (client->record == NULL)
+			g_warning ("Could not record events to '%s': %s", filename, g_strerror (errno));
+		else /* so that the events leading to a hang or crash are kept */
+			setvbuf (client->record, NULL, _IOLBF, 0);
+	}
+
+	/* Set BLUETOOTH_EXPORT_METRICS in the environment to make the
+	 * metrics available on the session bus, for example with:
+	 * gdbus call --session --dest <unique name> --object-path /org/gnome/Bluetooth/Metrics
+	 *   --method org.gnome.Bluetooth.Metrics1.GetMetrics */
+	if (g_getenv ("BLUETOOTH_EXPORT_METRICS") != NULL)
+		g_bus_get (G_BUS_TYPE_SESSION, client->cancellable, metrics_bus_cb, client);
+}
+
+static void
+bluetooth_client_constructed (GObject *object)
+{
+	BluetoothClient *client = BLUETOOTH_CLIENT (object);
+
+	G_OBJECT_CLASS (bluetooth_client_parent_class)->constructed (object);
+
+	if (client->connection == NULL) {
+		g_dbus_object_manager_client_new_for_bus (G_BUS_TYPE_SYSTEM,
+							  G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+							  BLUEZ_SERVICE,
+							  BLUEZ_MANAGER_PATH,
+							  object_manager_get_proxy_type_func,
+							  NULL, NULL,
+							  client->cancellable,
+							  object_manager_new_callback, client);
+		return;
 	}
-	g_list_free_full (object_list, g_object_unref);
-}
 
-static void bluetooth_client_init(BluetoothClient *client)
-{
-	client->cancellable = g_cancellable_new ();
-	client->store = gtk_tree_store_new(_BLUETOOTH_NUM_COLUMNS,
-					 G_TYPE_OBJECT,     /* BLUETOOTH_COLUMN_PROXY */
-					 G_TYPE_OBJECT,     /* BLUETOOTH_COLUMN_PROPERTIES */
-					 G_TYPE_STRING,     /* BLUETOOTH_COLUMN_ADDRESS */
-					 G_TYPE_STRING,     /* BLUETOOTH_COLUMN_ALIAS */
-					 G_TYPE_STRING,     /* BLUETOOTH_COLUMN_NAME */
-					 G_TYPE_UINT,       /* BLUETOOTH_COLUMN_TYPE */
-					 G_TYPE_STRING,     /* BLUETOOTH_COLUMN_ICON */
-					 G_TYPE_BOOLEAN,    /* BLUETOOTH_COLUMN_DEFAULT */
-					 G_TYPE_BOOLEAN,    /* BLUETOOTH_COLUMN_PAIRED */
-					 G_TYPE_BOOLEAN,    /* BLUETOOTH_COLUMN_TRUSTED */
-					 G_TYPE_BOOLEAN,    /* BLUETOOTH_COLUMN_CONNECTED */
-					 G_TYPE_BOOLEAN,    /* BLUETOOTH_COLUMN_DISCOVERING */
-					 G_TYPE_INT,        /* BLUETOOTH_COLUMN_LEGACYPAIRING */
-					 G_TYPE_BOOLEAN,    /* BLUETOOTH_COLUMN_POWERED */
-					 G_TYPE_STRV);      /* BLUETOOTH_COLUMN_UUIDS */
-	client->list_store = g_list_store_new (BLUETOOTH_TYPE_DEVICE);
-
-	g_dbus_object_manager_client_new_for_bus (G_BUS_TYPE_SYSTEM,
-						  G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
-						  BLUEZ_SERVICE,
-						  BLUEZ_MANAGER_PATH,
-						  object_manager_get_proxy_type_func,
-						  NULL, NULL,
-						  client->cancellable,
-						  object_manager_new_callback, client);
+	/* Peer-to-peer connections don't have a bus name */
+	g_dbus_object_manager_client_new (client->connection,
+					  G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+					  g_dbus_connection_get_unique_name (client->connection) != NULL ? BLUEZ_SERVICE : NULL,
+					  BLUEZ_MANAGER_PATH,
+					  object_manager_get_proxy_type_func,
+					  NULL, NULL,
+					  client->cancellable,
+					  object_manager_new_callback, client);
 }
 
 GDBusProxy *
@@ -1038,24 +2172,94 @@ _bluetooth_client_get_default_adapter(BluetoothClient *client)
 	return G_DBUS_PROXY (g_object_ref (client->default_adapter));
 }
 
+GDBusProxy *
+_bluetooth_client_get_device_proxy (BluetoothClient *client,
+				    const char      *path)
+{
+	DeviceEntry *entry;
+
+	g_return_val_if_fail (BLUETOOTH_IS_CLIENT (client), NULL);
+
+	entry = lookup_device (client, path);
+	if (entry == NULL)
+		return NULL;
+
+	return G_DBUS_PROXY (g_object_ref (entry->proxy));
+}
+
+/* Set BLUETOOTH_DEBUG_SYNC_CALLS in the environment to be warned
+ * about blocking D-Bus calls made from the main context */
+void
+_bluetooth_warn_sync_call (const char *call)
+{
+	static int enabled = -1;
+
+	if (enabled < 0)
+		enabled = g_getenv ("BLUETOOTH_DEBUG_SYNC_CALLS") != NULL;
+	if (enabled && g_main_context_is_owner (g_main_context_default ()))
+		g_warning ("Blocking D-Bus call %s made from the main context", call);
+}
+
+static GVariant *
+discovery_filter_new (const char * const *uuids,
+		      gint16              rssi,
+		      guint16             pathloss,
+		      const char         *transport,
+		      gboolean            duplicate_data)
+{
+	GVariantBuilder builder;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&builder, "{sv}",
+			       "Discoverable", g_variant_new_boolean (TRUE));
+	if (uuids != NULL && uuids[0] != NULL)
+		g_variant_builder_add (&builder, "{sv}",
+				       "UUIDs", g_variant_new_strv (uuids, -1));
+	if (rssi != 0)
+		g_variant_builder_add (&builder, "{sv}",
+				       "RSSI", g_variant_new_int16 (rssi));
+	if (pathloss != 0)
+		g_variant_builder_add (&builder, "{sv}",
+				       "Pathloss", g_variant_new_uint16 (pathloss));
+	if (transport != NULL)
+		g_variant_builder_add (&builder, "{sv}",
+				       "Transport", g_variant_new_string (transport));
+	/* bluez reports duplicates by default, and RSSI updates rely on it */
+	if (!duplicate_data)
+		g_variant_builder_add (&builder, "{sv}",
+				       "DuplicateData", g_variant_new_boolean (FALSE));
+
+	return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+set_discovery_filter_cb (Adapter1     *adapter,
+			 GAsyncResult *res,
+			 gpointer      user_data)
+{
+	g_autoptr(GError) error = NULL;
+
+	if (!adapter1_call_set_discovery_filter_finish (adapter, res, &error))
+		g_debug ("Failed to set discovery filter on %s: %s",
+			 g_dbus_proxy_get_object_path (G_DBUS_PROXY (adapter)), error->message);
+}
+
 static void
 _bluetooth_client_set_default_adapter_discovering (BluetoothClient *client,
 						   gboolean         discovering)
 {
 	g_autoptr(GDBusProxy) adapter = NULL;
-	GVariantBuilder builder;
 
 	adapter = _bluetooth_client_get_default_adapter (client);
 	if (adapter == NULL)
 		return;
 
-	if (discovering) {
-		g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
-		g_variant_builder_add (&builder, "{sv}",
-				       "Discoverable", g_variant_new_boolean (TRUE));
-		adapter1_call_set_discovery_filter_sync (ADAPTER1 (adapter),
-							 g_variant_builder_end (&builder), NULL, NULL);
-	}
+	/* No need to wait for the reply, bluetoothd handles the
+	 * calls in order */
+	if (discovering)
+		adapter1_call_set_discovery_filter (ADAPTER1 (adapter),
+						    client->discovery_filter, NULL,
+						    (GAsyncReadyCallback) set_discovery_filter_cb, NULL);
 
 	client->discovery_started = discovering;
 	if (discovering)
@@ -1096,6 +2300,30 @@ bluetooth_client_get_property (GObject        *object,
 		g_value_set_string (value, client->default_adapter ?
 				    adapter1_get_address (client->default_adapter) : NULL);
 		break;
+	case PROP_CHANGE_INTERVAL:
+		g_value_set_uint (value, client->change_interval);
+		break;
+	case PROP_MAX_DISCOVERED_DEVICES:
+		g_value_set_uint (value, client->max_devices);
+		break;
+	case PROP_MAX_DISCOVERED_DEVICE_AGE:
+		g_value_set_uint (value, client->max_device_age);
+		break;
+	case PROP_REMOVE_EVICTED_DEVICES:
+		g_value_set_boolean (value, client->remove_evicted);
+		break;
+	case PROP_NUM_EVICTED_DEVICES:
+		g_value_set_uint (value, client->num_evicted);
+		break;
+	case PROP_READY:
+		g_value_set_boolean (value, client->ready);
+		break;
+	case PROP_USE_CACHE:
+		g_value_set_boolean (value, client->use_cache);
+		break;
+	case PROP_CONNECTION:
+		g_value_set_object (value, client->connection);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
 		break;
@@ -1114,6 +2342,30 @@ bluetooth_client_set_property (GObject        *object,
 	case PROP_DEFAULT_ADAPTER_SETUP_MODE:
 		_bluetooth_client_set_default_adapter_discovering (client, g_value_get_boolean (value));
 		break;
+	case PROP_CHANGE_INTERVAL:
+		client->change_interval = g_value_get_uint (value);
+		break;
+	case PROP_MAX_DISCOVERED_DEVICES:
+		client->max_devices = g_value_get_uint (value);
+		schedule_eviction (client);
+		break;
+	case PROP_MAX_DISCOVERED_DEVICE_AGE:
+		client->max_device_age = g_value_get_uint (value);
+		update_eviction_timeout (client);
+		break;
+	case PROP_REMOVE_EVICTED_DEVICES:
+		client->remove_evicted = g_value_get_boolean (value);
+		break;
+	case PROP_USE_CACHE:
+		client->use_cache = g_value_get_boolean (value);
+		if (client->use_cache)
+			load_cache (client);
+		else
+			g_clear_handle_id (&client->save_cache_id, g_source_remove);
+		break;
+	case PROP_CONNECTION:
+		client->connection = g_value_dup_object (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
 		break;
@@ -1129,8 +2381,27 @@ static void bluetooth_client_finalize(GObject *object)
 		g_clear_object (&client->cancellable);
 	}
 	g_clear_object (&client->manager);
-	g_object_unref (client->store);
-	g_object_unref (client->list_store);
+	g_clear_object (&client->connection);
+	g_clear_pointer (&client->record, fclose);
+	if (client->metrics_id != 0)
+		g_dbus_connection_unregister_object (client->metrics_bus, client->metrics_id);
+	g_clear_object (&client->metrics_bus);
+	g_clear_handle_id (&client->changes_id, g_source_remove);
+	g_clear_handle_id (&client->evict_id, g_source_remove);
+	g_clear_handle_id (&client->evict_timeout_id, g_source_remove);
+	if (client->save_cache_id != 0) {
+		g_clear_handle_id (&client->save_cache_id, g_source_remove);
+		save_cache (client, TRUE);
+	}
+	g_clear_pointer (&client->cached, g_hash_table_destroy);
+	g_clear_pointer (&client->cache_adapter, g_free);
+	g_clear_pointer (&client->saved_cache, g_bytes_unref);
+	g_clear_pointer (&client->changed_devices, g_hash_table_destroy);
+	g_clear_pointer (&client->devices, g_hash_table_destroy);
+	g_clear_pointer (&client->adapters, g_hash_table_destroy);
+	g_clear_pointer (&client->discovery_filter, g_variant_unref);
+	g_clear_object (&client->model);
+	g_clear_error (&client->init_error);
 
 	g_clear_object (&client->default_adapter);
 
@@ -1141,10 +2412,18 @@ static void bluetooth_client_class_init(BluetoothClientClass *klass)
 {
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
+	object_class->constructed = bluetooth_client_constructed;
 	object_class->finalize = bluetooth_client_finalize;
 	object_class->get_property = bluetooth_client_get_property;
 	object_class->set_property = bluetooth_client_set_property;
 
+	device_property_table = build_property_table (device_properties,
+						      sizeof (DeviceProperty),
+						      G_N_ELEMENTS (device_properties));
+	adapter_property_table = build_property_table (adapter_properties,
+						       sizeof (AdapterProperty),
+						       G_N_ELEMENTS (adapter_properties));
+
 	/**
 	 * BluetoothClient::device-added:
 	 * @client: a #BluetoothClient object which received the signal
@@ -1162,6 +2441,25 @@ static void bluetooth_client_class_init(BluetoothClientClass *klass)
 			      g_cclosure_marshal_VOID__OBJECT,
 			      G_TYPE_NONE, 1, G_TYPE_OBJECT);
 
+	/**
+	 * BluetoothClient::devices-added:
+	 * @client: a #BluetoothClient object which received the signal
+	 * @devices: (element-type BluetoothDevice): an array of #BluetoothDevice objects
+	 *
+	 * The #BluetoothClient::devices-added signal is launched when a
+	 * number of devices get added to the model at once, such as on
+	 * startup, or when the default adapter changes. It is followed by
+	 * a #BluetoothClient::device-added signal for each of the devices.
+	 **/
+	signals[DEVICES_ADDED] =
+		g_signal_new ("devices-added",
+			      G_TYPE_FROM_CLASS (klass),
+			      G_SIGNAL_RUN_LAST,
+			      0,
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__BOXED,
+			      G_TYPE_NONE, 1, G_TYPE_PTR_ARRAY);
+
 	/**
 	 * BluetoothClient::device-removed:
 	 * @client: a #BluetoothClient object which received the signal
@@ -1184,56 +2482,153 @@ static void bluetooth_client_class_init(BluetoothClientClass *klass)
 	 *
 	 * The number of detected Bluetooth adapters.
 	 */
-	g_object_class_install_property (object_class, PROP_NUM_ADAPTERS,
-					 g_param_spec_uint ("num-adapters", NULL,
-							    "The number of detected Bluetooth adapters",
-							    0, G_MAXUINT, 0, G_PARAM_READABLE));
+	properties[PROP_NUM_ADAPTERS] =
+		g_param_spec_uint ("num-adapters", NULL,
+		                   "The number of detected Bluetooth adapters",
+		                   0, G_MAXUINT, 0, G_PARAM_READABLE);
 
 	/**
 	 * BluetoothClient:default-adapter:
 	 *
 	 * The D-Bus path of the default Bluetooth adapter or %NULL.
 	 */
-	g_object_class_install_property (object_class, PROP_DEFAULT_ADAPTER,
-					 g_param_spec_string ("default-adapter", NULL,
-							      "The D-Bus path of the default adapter",
-							      NULL, G_PARAM_READABLE));
+	properties[PROP_DEFAULT_ADAPTER] =
+		g_param_spec_string ("default-adapter", NULL,
+		                     "The D-Bus path of the default adapter",
+		                     NULL, G_PARAM_READABLE);
 	/**
 	 * BluetoothClient:default-adapter-powered:
 	 *
 	 * %TRUE if the default Bluetooth adapter is powered.
 	 */
-	g_object_class_install_property (object_class, PROP_DEFAULT_ADAPTER_POWERED,
-					 g_param_spec_boolean ("default-adapter-powered", NULL,
-							      "Whether the default adapter is powered",
-							       FALSE, G_PARAM_READABLE));
+	properties[PROP_DEFAULT_ADAPTER_POWERED] =
+		g_param_spec_boolean ("default-adapter-powered", NULL,
+		                      "Whether the default adapter is powered",
+		                      FALSE, G_PARAM_READABLE);
 	/**
 	 * BluetoothClient:default-adapter-setup-mode:
 	 *
 	 * %TRUE if the default Bluetooth adapter is in setup mode (discoverable, and discovering).
 	 */
-	g_object_class_install_property (object_class, PROP_DEFAULT_ADAPTER_SETUP_MODE,
-					 g_param_spec_boolean ("default-adapter-setup-mode", NULL,
-							      "Whether the default adapter is visible to others and scanning",
-							       FALSE, G_PARAM_READWRITE));
+	properties[PROP_DEFAULT_ADAPTER_SETUP_MODE] =
+		g_param_spec_boolean ("default-adapter-setup-mode", NULL,
+		                      "Whether the default adapter is visible to others and scanning",
+		                      FALSE, G_PARAM_READWRITE);
 	/**
 	 * BluetoothClient:default-adapter-name:
 	 *
 	 * The name of the default Bluetooth adapter or %NULL.
 	 */
-	g_object_class_install_property (object_class, PROP_DEFAULT_ADAPTER_NAME,
-					 g_param_spec_string ("default-adapter-name", NULL,
-							      "The human readable name of the default adapter",
-							      NULL, G_PARAM_READABLE));
+	properties[PROP_DEFAULT_ADAPTER_NAME] =
+		g_param_spec_string ("default-adapter-name", NULL,
+		                     "The human readable name of the default adapter",
+		                     NULL, G_PARAM_READABLE);
 	/**
 	 * BluetoothClient:default-adapter-address:
 	 *
 	 * The address of the default Bluetooth adapter or %NULL.
 	 */
-	g_object_class_install_property (object_class, PROP_DEFAULT_ADAPTER_ADDRESS,
-					 g_param_spec_string ("default-adapter-address", NULL,
-							      "The address of the default adapter",
-							      NULL, G_PARAM_READABLE));
+	properties[PROP_DEFAULT_ADAPTER_ADDRESS] =
+		g_param_spec_string ("default-adapter-address", NULL,
+		                     "The address of the default adapter",
+		                     NULL, G_PARAM_READABLE);
+	/**
+	 * BluetoothClient:change-interval:
+	 *
+	 * The time in milliseconds during which property changes on devices
+	 * are gathered, before being applied together and announced with a
+	 * single #BluetoothDevice::changed signal. If 0, the changes are
+	 * applied as soon as the main loop is idle.
+	 */
+	properties[PROP_CHANGE_INTERVAL] =
+		g_param_spec_uint ("change-interval", NULL,
+		                   "Time during which device changes are gathered",
+		                   0, G_MAXUINT, 0, G_PARAM_READWRITE);
+	/**
+	 * BluetoothClient:max-discovered-devices:
+	 *
+	 * The maximum number of unpaired devices to keep track of. When more
+	 * devices are discovered, the ones that were seen least recently are
+	 * evicted. Paired, trusted and connected devices are never evicted,
+	 * and don't count towards the limit. If 0, there is no limit.
+	 */
+	properties[PROP_MAX_DISCOVERED_DEVICES] =
+		g_param_spec_uint ("max-discovered-devices", NULL,
+		                   "Maximum number of unpaired devices",
+		                   0, G_MAXUINT, 0, G_PARAM_READWRITE);
+	/**
+	 * BluetoothClient:max-discovered-device-age:
+	 *
+	 * The time in seconds after which an unpaired device that wasn't
+	 * seen again is evicted. If 0, devices are kept until they are
+	 * removed by bluetoothd.
+	 */
+	properties[PROP_MAX_DISCOVERED_DEVICE_AGE] =
+		g_param_spec_uint ("max-discovered-device-age", NULL,
+		                   "Time after which unpaired devices are evicted",
+		                   0, G_MAXUINT, 0, G_PARAM_READWRITE);
+	/**
+	 * BluetoothClient:remove-evicted-devices:
+	 *
+	 * Whether evicted devices should also be removed from bluetoothd,
+	 * rather than only being hidden from the list of devices until
+	 * they are seen again.
+	 */
+	properties[PROP_REMOVE_EVICTED_DEVICES] =
+		g_param_spec_boolean ("remove-evicted-devices", NULL,
+		                      "Whether to remove evicted devices from bluetoothd",
+		                      FALSE, G_PARAM_READWRITE);
+	/**
+	 * BluetoothClient:num-evicted-devices:
+	 *
+	 * The number of devices evicted so far, see
+	 * #BluetoothClient:max-discovered-devices and
+	 * #BluetoothClient:max-discovered-device-age.
+	 */
+	properties[PROP_NUM_EVICTED_DEVICES] =
+		g_param_spec_uint ("num-evicted-devices", NULL,
+		                   "Number of evicted devices",
+		                   0, G_MAXUINT, 0, G_PARAM_READABLE);
+	/**
+	 * BluetoothClient:ready:
+	 *
+	 * %TRUE once the adapters and devices present when the client was
+	 * created have been added, so that a list of devices can be shown
+	 * in one go. See also bluetooth_client_new_async().
+	 */
+	properties[PROP_READY] =
+		g_param_spec_boolean ("ready", NULL,
+		                      "Whether the initial devices were loaded",
+		                      FALSE, G_PARAM_READABLE);
+	/**
+	 * BluetoothClient:use-cache:
+	 *
+	 * Whether to save the paired and trusted devices of the default
+	 * adapter to a cache in the user's cache directory, and load them
+	 * from it on startup. Setting this property before going back to
+	 * the main loop fills the list of devices straight away, before
+	 * bluetoothd's list of devices is loaded. The cached devices are
+	 * then updated from bluetoothd's, or removed if it doesn't know
+	 * about them anymore. Until #BluetoothClient:ready is %TRUE,
+	 * cached devices can only be displayed.
+	 */
+	properties[PROP_USE_CACHE] =
+		g_param_spec_boolean ("use-cache", NULL,
+		                      "Whether to use a cache of the paired devices",
+		                      FALSE, G_PARAM_READWRITE);
+	/**
+	 * BluetoothClient:connection:
+	 *
+	 * The D-Bus connection to talk to bluetoothd on, or %NULL to use
+	 * the system bus. See bluetooth_client_new_for_connection().
+	 */
+	properties[PROP_CONNECTION] =
+		g_param_spec_object ("connection", NULL,
+		                     "D-Bus connection to bluetoothd",
+		                     G_TYPE_DBUS_CONNECTION,
+		                     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+	g_object_class_install_properties (object_class, PROP_LAST, properties);
 }
 
 /**
@@ -1257,21 +2652,134 @@ BluetoothClient *bluetooth_client_new(void)
 	return bluetooth_client;
 }
 
+/**
+ * bluetooth_client_new_for_connection:
+ * @connection: a #GDBusConnection
+ *
+ * Creates a new #BluetoothClient talking to bluetoothd's objects on
+ * @connection, which can be a peer-to-peer connection. Unlike
+ * bluetooth_client_new(), this does not return the singleton, and is
+ * meant for testing.
+ *
+ * Return value: (transfer full): a new #BluetoothClient object.
+ **/
+BluetoothClient *
+bluetooth_client_new_for_connection (GDBusConnection *connection)
+{
+	g_return_val_if_fail (G_IS_DBUS_CONNECTION (connection), NULL);
+
+	return BLUETOOTH_CLIENT (g_object_new (BLUETOOTH_TYPE_CLIENT,
+					       "connection", connection,
+					       NULL));
+}
+
+/**
+ * bluetooth_client_new_async:
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: a #GAsyncReadyCallback to call when the client is ready
+ * @user_data: data to pass to @callback
+ *
+ * Gets a reference to the #BluetoothClient singleton, like bluetooth_client_new(),
+ * and calls @callback once its initial list of adapters and devices has
+ * been loaded, see #BluetoothClient:ready. Call bluetooth_client_new_finish()
+ * from @callback to get the client.
+ **/
+void
+bluetooth_client_new_async (GCancellable        *cancellable,
+			    GAsyncReadyCallback  callback,
+			    gpointer             user_data)
+{
+	g_autoptr(BluetoothClient) client = NULL;
+
+	client = bluetooth_client_new ();
+	g_async_initable_init_async (G_ASYNC_INITABLE (client), G_PRIORITY_DEFAULT,
+				     cancellable, callback, user_data);
+}
+
+/**
+ * bluetooth_client_new_finish:
+ * @res: the #GAsyncResult passed to the callback of bluetooth_client_new_async()
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes getting the #BluetoothClient singleton, see bluetooth_client_new_async().
+ *
+ * Return value: (transfer full): a #BluetoothClient object, or %NULL on error.
+ **/
+BluetoothClient *
+bluetooth_client_new_finish (GAsyncResult  *res,
+			     GError       **error)
+{
+	g_autoptr(GObject) client = NULL;
+
+	client = g_async_result_get_source_object (res);
+	if (!g_async_initable_init_finish (G_ASYNC_INITABLE (client), res, error))
+		return NULL;
+
+	return BLUETOOTH_CLIENT (g_steal_pointer (&client));
+}
+
 /**
  * bluetooth_client_get_devices:
  * @client: a #BluetoothClient object
  *
- * Returns an unfiltered #GListStore representing the devices attached to the default
- * Bluetooth adapter.
+ * Returns an unfiltered #GListModel of #BluetoothDevice representing the
+ * devices attached to the default Bluetooth adapter.
  *
- * Return value: (transfer full): a #GListStore
+ * The #BluetoothDevice objects are created when they are first
+ * requested from the model, and kept up-to-date for as long as they
+ * are referenced.
+ *
+ * Return value: (transfer full): a #GListModel
  **/
-GListStore *
+GListModel *
 bluetooth_client_get_devices (BluetoothClient *client)
 {
 	g_return_val_if_fail (BLUETOOTH_IS_CLIENT (client), NULL);
 
-	return G_LIST_STORE (g_object_ref (client->list_store));
+	return G_LIST_MODEL (g_object_ref (client->model));
+}
+
+/**
+ * bluetooth_client_get_device_by_address:
+ * @client: a #BluetoothClient object
+ * @address: the Bluetooth address of the device, e.g. "00:11:22:33:44:55"
+ *
+ * Looks up the device with the address @address on the default
+ * Bluetooth adapter, without having to iterate over the list returned
+ * by bluetooth_client_get_devices().
+ *
+ * Return value: (transfer full) (nullable): a #BluetoothDevice, or %NULL
+ * if no such device is known.
+ **/
+BluetoothDevice *
+bluetooth_client_get_device_by_address (BluetoothClient *client,
+					const char      *address)
+{
+	AdapterEntry *adapter_entry;
+	DeviceEntry *entry;
+
+	g_return_val_if_fail (BLUETOOTH_IS_CLIENT (client), NULL);
+	g_return_val_if_fail (address != NULL, NULL);
+
+	/* Not matched with the devices from bluetoothd yet */
+	if (client->cached != NULL) {
+		entry = g_hash_table_lookup (client->cached, address);
+		if (entry != NULL)
+			return g_object_ref (entry->device);
+	}
+
+	if (client->default_adapter == NULL)
+		return NULL;
+
+	adapter_entry = lookup_adapter (client, g_dbus_proxy_get_object_path (G_DBUS_PROXY (client->default_adapter)));
+	if (adapter_entry == NULL)
+		return NULL;
+
+	entry = g_hash_table_lookup (adapter_entry->devices, address);
+	if (entry == NULL || entry->evicted)
+		return NULL;
+
+	return device_entry_get_device (entry);
 }
 
 typedef struct {
@@ -1279,14 +2787,36 @@ typedef struct {
 	BluetoothClient *client;
 } CreateDeviceData;
 
+typedef struct {
+	char *path;
+	Device1 *proxy;
+	gboolean pair;
+	gint64 begin_time;
+	gint64 pair_begin_time;
+} SetupDeviceData;
+
+static void
+setup_device_data_free (SetupDeviceData *data)
+{
+	g_free (data->path);
+	g_clear_object (&data->proxy);
+	g_free (data);
+}
+
 static void
 device_pair_callback (GDBusProxy   *proxy,
 		      GAsyncResult *res,
 		      GTask        *task)
 {
+	SetupDeviceData *data = g_task_get_task_data (task);
 	GError *error = NULL;
+	gboolean ret;
 
-	if (device1_call_pair_finish (DEVICE1(proxy), res, &error) == FALSE) {
+	ret = device1_call_pair_finish (DEVICE1(proxy), res, &error);
+	_bluetooth_trace_mark (data->pair_begin_time, "Pair", "%s (%s)",
+			       g_dbus_proxy_get_object_path (proxy),
+			       ret ? "success" : "failure");
+	if (ret == FALSE) {
 		g_debug ("Pair() failed for %s: %s",
 			 g_dbus_proxy_get_object_path (proxy),
 			 error->message);
@@ -1297,6 +2827,42 @@ device_pair_callback (GDBusProxy   *proxy,
 	g_object_unref (task);
 }
 
+static void
+setup_device_pair (GTask *task)
+{
+	SetupDeviceData *data = g_task_get_task_data (task);
+
+	if (data->pair == TRUE) {
+		data->pair_begin_time = g_get_monotonic_time ();
+		device1_call_pair (data->proxy,
+				   g_task_get_cancellable (task),
+				   (GAsyncReadyCallback) device_pair_callback,
+				   task);
+	} else {
+		g_task_return_boolean (task, TRUE);
+		g_object_unref (task);
+	}
+}
+
+static void
+setup_device_remove_callback (Adapter1     *adapter,
+			      GAsyncResult *res,
+			      GTask        *task)
+{
+	g_autoptr(GError) error = NULL;
+
+	if (!adapter1_call_remove_device_finish (adapter, res, &error)) {
+		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_task_return_error (task, g_steal_pointer (&error));
+			g_object_unref (task);
+			return;
+		}
+		g_warning ("Failed to remove device: %s", error->message);
+	}
+
+	setup_device_pair (task);
+}
+
 /**
  * bluetooth_client_setup_device_finish:
  * @client:
@@ -1311,6 +2877,7 @@ bluetooth_client_setup_device_finish (BluetoothClient  *client,
 				      GError          **error)
 {
 	GTask *task;
+	SetupDeviceData *data;
 	char *object_path;
 	gboolean ret;
 
@@ -1321,10 +2888,13 @@ bluetooth_client_setup_device_finish (BluetoothClient  *client,
 	g_warn_if_fail (g_task_get_source_tag (task) == bluetooth_client_setup_device);
 
 	ret = g_task_propagate_boolean (task, error);
-	object_path = g_strdup (g_task_get_task_data (task));
+	data = g_task_get_task_data (task);
+	object_path = g_strdup (data->path);
 	*path = object_path;
 	g_debug ("bluetooth_client_setup_device_finish() %s (path: %s)",
 		 ret ? "success" : "failure", object_path);
+	_bluetooth_trace_mark (data->begin_time, "SetupDevice", "%s (%s)",
+			       object_path, ret ? "success" : "failure");
 	return ret;
 }
 
@@ -1337,9 +2907,9 @@ bluetooth_client_setup_device (BluetoothClient          *client,
 			       gpointer                  user_data)
 {
 	GTask *task;
-	g_autoptr(GDBusProxy) device = NULL;
-	GtkTreeIter iter, adapter_iter;
-	gboolean paired;
+	DeviceEntry *entry;
+	AdapterEntry *adapter_entry;
+	SetupDeviceData *data;
 
 	g_return_if_fail (BLUETOOTH_IS_CLIENT (client));
 	g_return_if_fail (path != NULL);
@@ -1349,45 +2919,33 @@ bluetooth_client_setup_device (BluetoothClient          *client,
 			   callback,
 			   user_data);
 	g_task_set_source_tag (task, bluetooth_client_setup_device);
-	g_task_set_task_data (task, g_strdup (path), (GDestroyNotify) g_free);
-
-	if (get_iter_from_path (client->store, &iter, path) == FALSE) {
+	data = g_new0 (SetupDeviceData, 1);
+	data->path = g_strdup (path);
+	data->pair = pair;
+	data->begin_time = g_get_monotonic_time ();
+	g_task_set_task_data (task, data, (GDestroyNotify) setup_device_data_free);
+
+	entry = lookup_device (client, path);
+	if (entry == NULL) {
 		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
 					 "Device with object path %s does not exist",
 					 path);
 		g_object_unref (task);
 		return;
 	}
-
-	gtk_tree_model_get (GTK_TREE_MODEL(client->store), &iter,
-			    BLUETOOTH_COLUMN_PROXY, &device,
-			    BLUETOOTH_COLUMN_PAIRED, &paired, -1);
-
-	if (paired != FALSE &&
-	    gtk_tree_model_iter_parent (GTK_TREE_MODEL(client->store), &adapter_iter, &iter)) {
-		GDBusProxy *adapter;
-		g_autoptr(GError) err = NULL;
-
-		gtk_tree_model_get (GTK_TREE_MODEL(client->store), &adapter_iter,
-				    BLUETOOTH_COLUMN_PROXY, &adapter,
-				    -1);
-		adapter1_call_remove_device_sync (ADAPTER1 (adapter),
-						  path,
-						  NULL, &err);
-		if (err != NULL)
-			g_warning ("Failed to remove device: %s", err->message);
-		g_object_unref (adapter);
+	data->proxy = DEVICE1 (g_object_ref (entry->proxy));
+
+	adapter_entry = lookup_adapter (client, device1_get_adapter (entry->proxy));
+	if (device1_get_paired (entry->proxy) && adapter_entry != NULL) {
+		adapter1_call_remove_device (adapter_entry->proxy,
+					     path,
+					     cancellable,
+					     (GAsyncReadyCallback) setup_device_remove_callback,
+					     task);
+		return;
 	}
 
-	if (pair == TRUE) {
-		device1_call_pair (DEVICE1(device),
-				   cancellable,
-				   (GAsyncReadyCallback) device_pair_callback,
-				   task);
-	} else {
-		g_task_return_boolean (task, TRUE);
-		g_object_unref (task);
-	}
+	setup_device_pair (task);
 }
 
 /**
@@ -1447,8 +3005,7 @@ bluetooth_client_cancel_setup_device (BluetoothClient          *client,
 				      gpointer                  user_data)
 {
 	GTask *task;
-	g_autoptr(GDBusProxy) device = NULL;
-	GtkTreeIter iter;
+	DeviceEntry *entry;
 
 	g_return_if_fail (BLUETOOTH_IS_CLIENT (client));
 	g_return_if_fail (path != NULL);
@@ -1460,7 +3017,8 @@ bluetooth_client_cancel_setup_device (BluetoothClient          *client,
 	g_task_set_source_tag (task, bluetooth_client_cancel_setup_device);
 	g_task_set_task_data (task, g_strdup (path), (GDestroyNotify) g_free);
 
-	if (get_iter_from_path (client->store, &iter, path) == FALSE) {
+	entry = lookup_device (client, path);
+	if (entry == NULL) {
 		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
 					 "Device with object path %s does not exist",
 					 path);
@@ -1468,11 +3026,7 @@ bluetooth_client_cancel_setup_device (BluetoothClient          *client,
 		return;
 	}
 
-	gtk_tree_model_get (GTK_TREE_MODEL(client->store), &iter,
-			    BLUETOOTH_COLUMN_PROXY, &device,
-			    -1);
-
-	device1_call_cancel_pairing (DEVICE1(device),
+	device1_call_cancel_pairing (entry->proxy,
 				     cancellable,
 				     (GAsyncReadyCallback) device_cancel_pairing_callback,
 				     task);
@@ -1483,25 +3037,18 @@ bluetooth_client_set_trusted (BluetoothClient *client,
 			      const char      *device_path,
 			      gboolean         trusted)
 {
-	GObject *device;
-	GtkTreeIter iter;
+	DeviceEntry *entry;
 
 	g_return_val_if_fail (BLUETOOTH_IS_CLIENT (client), FALSE);
 	g_return_val_if_fail (device_path != NULL, FALSE);
 
-	if (get_iter_from_path (client->store, &iter, device_path) == FALSE) {
+	entry = lookup_device (client, device_path);
+	if (entry == NULL) {
 		g_debug ("Couldn't find device '%s' in tree to mark it as trusted", device_path);
 		return FALSE;
 	}
 
-	gtk_tree_model_get (GTK_TREE_MODEL (client->store), &iter,
-			    BLUETOOTH_COLUMN_PROXY, &device, -1);
-
-	if (device == NULL)
-		return FALSE;
-
-	g_object_set (device, "trusted", trusted, NULL);
-	g_object_unref (device);
+	g_object_set (entry->proxy, "trusted", trusted, NULL);
 
 	return TRUE;
 }
@@ -1511,10 +3058,14 @@ connect_callback (GDBusProxy   *proxy,
 		  GAsyncResult *res,
 		  GTask        *task)
 {
+	gint64 *begin_time = g_task_get_task_data (task);
 	gboolean retval;
 	GError *error = NULL;
 
 	retval = device1_call_connect_finish (DEVICE1 (proxy), res, &error);
+	_bluetooth_trace_mark (*begin_time, "Connect", "%s (%s)",
+			       g_dbus_proxy_get_object_path (proxy),
+			       retval ? "success" : "failure");
 	if (retval == FALSE) {
 		g_debug ("Connect failed for %s: %s",
 			 g_dbus_proxy_get_object_path (proxy), error->message);
@@ -1533,10 +3084,14 @@ disconnect_callback (GDBusProxy   *proxy,
 		     GAsyncResult *res,
 		     GTask        *task)
 {
+	gint64 *begin_time = g_task_get_task_data (task);
 	gboolean retval;
 	GError *error = NULL;
 
 	retval = device1_call_disconnect_finish (DEVICE1 (proxy), res, &error);
+	_bluetooth_trace_mark (*begin_time, "Disconnect", "%s (%s)",
+			       g_dbus_proxy_get_object_path (proxy),
+			       retval ? "success" : "failure");
 	if (retval == FALSE) {
 		g_debug ("Disconnect failed for %s: %s",
 			 g_dbus_proxy_get_object_path (proxy),
@@ -1572,9 +3127,9 @@ bluetooth_client_connect_service (BluetoothClient     *client,
 				  GAsyncReadyCallback  callback,
 				  gpointer             user_data)
 {
-	GtkTreeIter iter;
+	DeviceEntry *entry;
 	GTask *task;
-	g_autoptr(GDBusProxy) device = NULL;
+	gint64 *begin_time;
 
 	g_return_if_fail (BLUETOOTH_IS_CLIENT (client));
 	g_return_if_fail (path != NULL);
@@ -1584,8 +3139,12 @@ bluetooth_client_connect_service (BluetoothClient     *client,
 			   callback,
 			   user_data);
 	g_task_set_source_tag (task, bluetooth_client_connect_service);
+	begin_time = g_new (gint64, 1);
+	*begin_time = g_get_monotonic_time ();
+	g_task_set_task_data (task, begin_time, g_free);
 
-	if (get_iter_from_path (client->store, &iter, path) == FALSE) {
+	entry = lookup_device (client, path);
+	if (entry == NULL) {
 		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
 					 "Device with object path %s does not exist",
 					 path);
@@ -1593,17 +3152,13 @@ bluetooth_client_connect_service (BluetoothClient     *client,
 		return;
 	}
 
-	gtk_tree_model_get (GTK_TREE_MODEL(client->store), &iter,
-			    BLUETOOTH_COLUMN_PROXY, &device,
-			    -1);
-
 	if (connect) {
-		device1_call_connect (DEVICE1(device),
+		device1_call_connect (entry->proxy,
 				      cancellable,
 				      (GAsyncReadyCallback) connect_callback,
 				      task);
 	} else {
-		device1_call_disconnect (DEVICE1(device),
+		device1_call_disconnect (entry->proxy,
 					 cancellable,
 					 (GAsyncReadyCallback) disconnect_callback,
 					 task);
@@ -1633,3 +3188,165 @@ bluetooth_client_connect_service_finish (BluetoothClient *client,
 
 	return g_task_propagate_boolean (task, error);
 }
+
+static void
+set_discovery_filter_callback (Adapter1     *adapter,
+			       GAsyncResult *res,
+			       GTask        *task)
+{
+	GError *error = NULL;
+
+	if (!adapter1_call_set_discovery_filter_finish (adapter, res, &error)) {
+		g_debug ("Setting discovery filter failed for %s: %s",
+			 g_dbus_proxy_get_object_path (G_DBUS_PROXY (adapter)), error->message);
+		g_task_return_error (task, error);
+	} else {
+		g_task_return_boolean (task, TRUE);
+	}
+
+	g_object_unref (task);
+}
+
+/**
+ * bluetooth_client_set_discovery_filter:
+ * @client: a #BluetoothClient
+ * @uuids: (array zero-terminated=1) (nullable): the service UUIDs that discovered
+ *   devices should advertise, or %NULL for any
+ * @rssi: the minimum RSSI, in dBm, of the devices to report, or 0 for no threshold
+ * @pathloss: the maximum pathloss, in dB, of the devices to report, or 0 for no threshold.
+ *   Cannot be combined with @rssi.
+ * @transport: (nullable): "bredr", "le" or "auto", or %NULL for the adapter's default
+ * @duplicate_data: whether devices should be reported again when only their
+ *   advertising data changed, %TRUE being bluetoothd's default. Devices'
+ *   RSSI isn't updated when %FALSE
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the filter is set
+ * @user_data: the data to pass to callback function
+ *
+ * Restricts the devices reported while the default adapter is in setup mode,
+ * see #BluetoothClient:default-adapter-setup-mode, so that applications only
+ * interested in, for example, audio devices aren't woken up by every device
+ * nearby. The filter is kept when the default adapter changes.
+ *
+ * When the operation is finished, @callback will be called. You can
+ * then call bluetooth_client_set_discovery_filter_finish() to get the result of the
+ * operation.
+ **/
+void
+bluetooth_client_set_discovery_filter (BluetoothClient     *client,
+				       const char * const  *uuids,
+				       gint16               rssi,
+				       guint16              pathloss,
+				       const char          *transport,
+				       gboolean             duplicate_data,
+				       GCancellable        *cancellable,
+				       GAsyncReadyCallback  callback,
+				       gpointer             user_data)
+{
+	GTask *task;
+
+	g_return_if_fail (BLUETOOTH_IS_CLIENT (client));
+	g_return_if_fail (rssi == 0 || pathloss == 0);
+
+	task = g_task_new (G_OBJECT (client), cancellable, callback, user_data);
+	g_task_set_source_tag (task, bluetooth_client_set_discovery_filter);
+
+	g_clear_pointer (&client->discovery_filter, g_variant_unref);
+	client->discovery_filter = discovery_filter_new (uuids, rssi, pathloss,
+							 transport, duplicate_data);
+
+	/* Will be applied when discovery is started */
+	if (client->default_adapter == NULL) {
+		g_task_return_boolean (task, TRUE);
+		g_object_unref (task);
+		return;
+	}
+
+	adapter1_call_set_discovery_filter (client->default_adapter,
+					    client->discovery_filter,
+					    cancellable,
+					    (GAsyncReadyCallback) set_discovery_filter_callback,
+					    task);
+}
+
+/**
+ * bluetooth_client_set_discovery_filter_finish:
+ * @client: a #BluetoothClient
+ * @res: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes the discovery filter operation. See bluetooth_client_set_discovery_filter().
+ *
+ * Returns: %TRUE if the filter was set, %FALSE on error.
+ **/
+gboolean
+bluetooth_client_set_discovery_filter_finish (BluetoothClient *client,
+					      GAsyncResult    *res,
+					      GError         **error)
+{
+	GTask *task;
+
+	task = G_TASK (res);
+
+	g_warn_if_fail (g_task_get_source_tag (task) == bluetooth_client_set_discovery_filter);
+
+	return g_task_propagate_boolean (task, error);
+}
+
+/**
+ * bluetooth_client_get_metrics:
+ * @client: a #BluetoothClient
+ *
+ * Returns how much work the client did since it was created, or since
+ * bluetooth_client_reset_metrics() was last called, to help tune it.
+ * The dictionary contains:
+ * - "adapters-added", "adapters-removed", "devices-added" and
+ *   "devices-removed": the number of interfaces added and removed
+ *   after the initial load, as uint64
+ * - "adapter-properties-changed" and "device-properties-changed": the
+ *   number of PropertiesChanged signals received, as uint64
+ * - "model-inserts", "model-removals" and "model-updates": the number
+ *   of devices inserted in, removed from, and changed in the model
+ *   returned by bluetooth_client_get_devices(), as uint64
+ * - "device-added-time", "device-notify-time" and
+ *   "add-devices-to-model-time": the time spent handling new devices,
+ *   handling device property changes, and filling the model when the
+ *   default adapter changes, as "(tttat)": the number of calls, the
+ *   total and the maximum duration in microseconds, and a histogram of
+ *   durations, where bucket i counts durations under 2^i microseconds
+ * - "adapter-proxies", "device-proxies" and "live-devices": the number
+ *   of adapter and device D-Bus proxies, and of #BluetoothDevice objects
+ *   currently in use, as uint32
+ * - "oui-cache-hits", "oui-cache-misses" and "oui-cache-size": the
+ *   lookups of the vendor of a device's OUI that were answered from
+ *   the cache, and those that weren't, as uint64, and the number of
+ *   cached vendors, as uint32. Those are shared by the whole process,
+ *   and aren't reset by bluetooth_client_reset_metrics()
+ *
+ * Setting BLUETOOTH_EXPORT_METRICS in the environment also makes those
+ * available on the session bus, through the GetMetrics method of the
+ * org.gnome.Bluetooth.Metrics1 interface at /org/gnome/Bluetooth/Metrics.
+ *
+ * Return value: (transfer full): a #GVariant of type "a{sv}"
+ **/
+GVariant *
+bluetooth_client_get_metrics (BluetoothClient *client)
+{
+	g_return_val_if_fail (BLUETOOTH_IS_CLIENT (client), NULL);
+
+	return g_variant_ref_sink (metrics_to_variant (client));
+}
+
+/**
+ * bluetooth_client_reset_metrics:
+ * @client: a #BluetoothClient
+ *
+ * Resets the counters and timings returned by bluetooth_client_get_metrics().
+ **/
+void
+bluetooth_client_reset_metrics (BluetoothClient *client)
+{
+	g_return_if_fail (BLUETOOTH_IS_CLIENT (client));
+
+	reset_metrics (client);
+}
@@ -24,15 +24,23 @@
 #pragma once
 
 #include <glib-object.h>
-#include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <bluetooth-enums.h>
+#include <bluetooth-device.h>
 
 #define BLUETOOTH_TYPE_CLIENT (bluetooth_client_get_type())
 G_DECLARE_FINAL_TYPE (BluetoothClient, bluetooth_client, BLUETOOTH, CLIENT, GObject)
 
 BluetoothClient *bluetooth_client_new(void);
+void bluetooth_client_new_async (GCancellable        *cancellable,
+				 GAsyncReadyCallback  callback,
+				 gpointer             user_data);
+BluetoothClient *bluetooth_client_new_finish (GAsyncResult  *res,
+					      GError       **error);
 
-GListStore *bluetooth_client_get_devices (BluetoothClient *client);
+GListModel *bluetooth_client_get_devices (BluetoothClient *client);
+BluetoothDevice *bluetooth_client_get_device_by_address (BluetoothClient *client,
+							 const char      *address);
 
 void bluetooth_client_connect_service (BluetoothClient     *client,
 				       const char          *path,
@@ -44,3 +52,17 @@ void bluetooth_client_connect_service (BluetoothClient     *client,
 gboolean bluetooth_client_connect_service_finish (BluetoothClient *client,
 						  GAsyncResult    *res,
 						  GError         **error);
+
+void bluetooth_client_set_discovery_filter (BluetoothClient     *client,
+					    const char * const  *uuids,
+					    gint16               rssi,
+					    guint16              pathloss,
+					    const char          *transport,
+					    gboolean             duplicate_data,
+					    GCancellable        *cancellable,
+					    GAsyncReadyCallback  callback,
+					    gpointer             user_data);
+
+gboolean bluetooth_client_set_discovery_filter_finish (BluetoothClient *client,
+						       GAsyncResult    *res,
+						       GError         **error);
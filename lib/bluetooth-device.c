@@ -10,6 +10,7 @@
 
 #include "bluetooth-device.h"
 #include "bluetooth-utils.h"
+#include "bluetooth-utils-private.h"
 #include "gnome-bluetooth-enum-types.h"
 
 enum {
@@ -24,12 +25,21 @@ enum {
 	PROP_CONNECTED,
 	PROP_LEGACYPAIRING,
 	PROP_UUIDS,
+	PROP_SERVICES,
 };
 
+enum {
+	CHANGED,
+	LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
 struct _BluetoothDevice {
 	GObject parent;
 
 	GDBusProxy *proxy;
+	/* Interned GRefStrings, shared between devices and other users */
 	char *address;
 	char *alias;
 	char *name;
@@ -39,11 +49,41 @@ struct _BluetoothDevice {
 	gboolean trusted;
 	gboolean connected;
 	gboolean legacy_pairing;
-	char **uuids;
+	BluetoothServiceFlags services;
+	char **uuids; /* derived from services, when first needed */
 };
 
 G_DEFINE_TYPE(BluetoothDevice, bluetooth_device, G_TYPE_OBJECT)
 
+static void
+set_ref_string (char       **field,
+		const char  *value)
+{
+	if (g_strcmp0 (*field, value) == 0)
+		return;
+
+	g_clear_pointer (field, g_ref_string_release);
+	if (value != NULL)
+		*field = g_ref_string_new_intern (value);
+}
+
+static void
+bluetooth_device_set_services (BluetoothDevice       *device,
+			       BluetoothServiceFlags  services,
+			       gboolean               clear_uuids)
+{
+	if (device->services == services)
+		return;
+
+	device->services = services;
+	if (clear_uuids) {
+		g_clear_pointer (&device->uuids, g_strfreev);
+		g_object_notify (G_OBJECT (device), "uuids");
+	} else {
+		g_object_notify (G_OBJECT (device), "services");
+	}
+}
+
 static void
 bluetooth_device_get_property (GObject        *object,
 			       guint           property_id,
@@ -84,8 +124,13 @@ bluetooth_device_get_property (GObject        *object,
 		g_value_set_boolean (value, device->legacy_pairing);
 		break;
 	case PROP_UUIDS:
+		if (device->uuids == NULL)
+			device->uuids = _bluetooth_service_flags_to_names (device->services);
 		g_value_set_boxed (value, device->uuids);
 		break;
+	case PROP_SERVICES:
+		g_value_set_flags (value, device->services);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
 		break;
@@ -103,26 +148,22 @@ bluetooth_device_set_property (GObject        *object,
 	switch (property_id) {
 	case PROP_PROXY:
 		g_clear_object (&device->proxy);
-		device->proxy = g_value_get_object (value);
+		device->proxy = g_value_dup_object (value);
 		break;
 	case PROP_ADDRESS:
-		g_clear_pointer (&device->address, g_free);
-		device->address = g_value_dup_string (value);
+		set_ref_string (&device->address, g_value_get_string (value));
 		break;
 	case PROP_ALIAS:
-		g_clear_pointer (&device->alias, g_free);
-		device->alias = g_value_dup_string (value);
+		set_ref_string (&device->alias, g_value_get_string (value));
 		break;
 	case PROP_NAME:
-		g_clear_pointer (&device->name, g_free);
-		device->name = g_value_dup_string (value);
+		set_ref_string (&device->name, g_value_get_string (value));
 		break;
 	case PROP_TYPE:
 		device->type = g_value_get_flags (value);
 		break;
 	case PROP_ICON:
-		g_clear_pointer (&device->icon, g_free);
-		device->icon = g_value_dup_string (value);
+		set_ref_string (&device->icon, g_value_get_string (value));
 		break;
 	case PROP_PAIRED:
 		device->paired = g_value_get_boolean (value);
@@ -139,6 +180,12 @@ bluetooth_device_set_property (GObject        *object,
 	case PROP_UUIDS:
 		g_clear_pointer (&device->uuids, g_strfreev);
 		device->uuids = g_value_dup_boxed (value);
+		bluetooth_device_set_services (device,
+					       _bluetooth_names_to_service_flags ((const char * const *) device->uuids),
+					       FALSE);
+		break;
+	case PROP_SERVICES:
+		bluetooth_device_set_services (device, g_value_get_flags (value), TRUE);
 		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
@@ -151,10 +198,10 @@ static void bluetooth_device_finalize(GObject *object)
 	BluetoothDevice *device = BLUETOOTH_DEVICE (object);
 
 	g_clear_object (&device->proxy);
-	g_clear_pointer (&device->address, g_free);
-	g_clear_pointer (&device->alias, g_free);
-	g_clear_pointer (&device->name, g_free);
-	g_clear_pointer (&device->icon, g_free);
+	g_clear_pointer (&device->address, g_ref_string_release);
+	g_clear_pointer (&device->alias, g_ref_string_release);
+	g_clear_pointer (&device->name, g_ref_string_release);
+	g_clear_pointer (&device->icon, g_ref_string_release);
 	g_clear_pointer (&device->uuids, g_strfreev);
 
 	G_OBJECT_CLASS(bluetooth_device_parent_class)->finalize (object);
@@ -168,6 +215,24 @@ static void bluetooth_device_class_init(BluetoothDeviceClass *klass)
 	object_class->get_property = bluetooth_device_get_property;
 	object_class->set_property = bluetooth_device_set_property;
 
+	/**
+	 * BluetoothDevice::changed:
+	 * @device: a #BluetoothDevice object which received the signal
+	 * @fields: a #BluetoothDeviceField mask of the changed properties
+	 *
+	 * The #BluetoothDevice::changed signal is emitted once after a batch
+	 * of property changes was applied to the device, so that consumers
+	 * can update once instead of once per #GObject::notify.
+	 **/
+	signals[CHANGED] =
+		g_signal_new ("changed",
+			      G_TYPE_FROM_CLASS (klass),
+			      G_SIGNAL_RUN_LAST,
+			      0,
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__FLAGS,
+			      G_TYPE_NONE, 1, BLUETOOTH_TYPE_DEVICE_FIELD);
+
 	g_object_class_install_property (object_class, PROP_PROXY,
 					 g_param_spec_object ("proxy", NULL, "Proxy",
 							      G_TYPE_DBUS_PROXY, G_PARAM_READWRITE));
@@ -201,6 +266,9 @@ static void bluetooth_device_class_init(BluetoothDeviceClass *klass)
 	g_object_class_install_property (object_class, PROP_UUIDS,
 					 g_param_spec_boxed ("uuids", NULL, "UUIDs",
 							     G_TYPE_STRV, G_PARAM_READWRITE));
+	g_object_class_install_property (object_class, PROP_SERVICES,
+					 g_param_spec_flags ("services", NULL, "Services",
+							     BLUETOOTH_TYPE_SERVICE_FLAGS, BLUETOOTH_SERVICE_NONE, G_PARAM_READWRITE));
 }
 
 static void
@@ -218,6 +286,86 @@ bluetooth_device_get_object_path (BluetoothDevice *device)
 	return g_dbus_proxy_get_object_path (device->proxy);
 }
 
+/**
+ * bluetooth_device_get_address:
+ * @device: a #BluetoothDevice
+ *
+ * Returns the #BluetoothDevice:address of the device, without copying it.
+ *
+ * Returns: (nullable): the address, valid until it changes.
+ */
+const char *
+bluetooth_device_get_address (BluetoothDevice *device)
+{
+	g_return_val_if_fail (BLUETOOTH_IS_DEVICE (device), NULL);
+
+	return device->address;
+}
+
+/**
+ * bluetooth_device_get_alias:
+ * @device: a #BluetoothDevice
+ *
+ * Returns the #BluetoothDevice:alias of the device, without copying it.
+ *
+ * Returns: (nullable): the alias, valid until it changes.
+ */
+const char *
+bluetooth_device_get_alias (BluetoothDevice *device)
+{
+	g_return_val_if_fail (BLUETOOTH_IS_DEVICE (device), NULL);
+
+	return device->alias;
+}
+
+/**
+ * bluetooth_device_get_name:
+ * @device: a #BluetoothDevice
+ *
+ * Returns the #BluetoothDevice:name of the device, without copying it.
+ *
+ * Returns: (nullable): the name, valid until it changes.
+ */
+const char *
+bluetooth_device_get_name (BluetoothDevice *device)
+{
+	g_return_val_if_fail (BLUETOOTH_IS_DEVICE (device), NULL);
+
+	return device->name;
+}
+
+/**
+ * bluetooth_device_get_icon:
+ * @device: a #BluetoothDevice
+ *
+ * Returns the #BluetoothDevice:icon of the device, without copying it.
+ *
+ * Returns: (nullable): the icon name, valid until it changes.
+ */
+const char *
+bluetooth_device_get_icon (BluetoothDevice *device)
+{
+	g_return_val_if_fail (BLUETOOTH_IS_DEVICE (device), NULL);
+
+	return device->icon;
+}
+
+/**
+ * bluetooth_device_get_services:
+ * @device: a #BluetoothDevice
+ *
+ * Returns the #BluetoothDevice:services of the device.
+ *
+ * Returns: the known services of the device.
+ */
+BluetoothServiceFlags
+bluetooth_device_get_services (BluetoothDevice *device)
+{
+	g_return_val_if_fail (BLUETOOTH_IS_DEVICE (device), BLUETOOTH_SERVICE_NONE);
+
+	return device->services;
+}
+
 #define BOOL_STR(x) (x ? "True" : "False")
 
 char *
@@ -233,6 +381,8 @@ bluetooth_device_to_string (BluetoothDevice *device)
 	g_string_append_printf (str, "\tD-Bus Path: %s\n", device->proxy ? g_dbus_proxy_get_object_path (device->proxy) : "(none)");
 	g_string_append_printf (str, "\tType: %s Icon: %s\n", bluetooth_type_to_string (device->type), device->icon);
 	g_string_append_printf (str, "\tPaired: %s Trusted: %s Connected: %s\n", BOOL_STR(device->paired), BOOL_STR(device->trusted), BOOL_STR(device->connected));
+	if (device->uuids == NULL)
+		device->uuids = _bluetooth_service_flags_to_names (device->services);
 	if (device->uuids != NULL) {
 		guint i;
 		g_string_append_printf (str, "\tUUIDs: ");
@@ -7,12 +7,17 @@
 #pragma once
 
 #include <glib-object.h>
-#include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <bluetooth-enums.h>
 
 #define BLUETOOTH_TYPE_DEVICE (bluetooth_device_get_type())
 G_DECLARE_FINAL_TYPE (BluetoothDevice, bluetooth_device, BLUETOOTH, DEVICE, GObject)
 
 const char *bluetooth_device_get_object_path (BluetoothDevice *device);
+const char *bluetooth_device_get_address (BluetoothDevice *device);
+const char *bluetooth_device_get_alias (BluetoothDevice *device);
+const char *bluetooth_device_get_name (BluetoothDevice *device);
+const char *bluetooth_device_get_icon (BluetoothDevice *device);
+BluetoothServiceFlags bluetooth_device_get_services (BluetoothDevice *device);
 void bluetooth_device_dump (BluetoothDevice *device);
 char *bluetooth_device_to_string (BluetoothDevice *device);
@@ -100,44 +100,124 @@ typedef enum {
 #define BLUETOOTH_TYPE_AUDIO (BLUETOOTH_TYPE_HEADSET | BLUETOOTH_TYPE_HEADPHONES | BLUETOOTH_TYPE_OTHER_AUDIO | BLUETOOTH_TYPE_SPEAKERS)
 
 /**
- * BluetoothColumn:
- * @BLUETOOTH_COLUMN_PROXY: a #GDBusProxy object
- * @BLUETOOTH_COLUMN_PROPERTIES: Used to be #GDBusProxy object for DBus.Properties, now always %NULL
- * @BLUETOOTH_COLUMN_ADDRESS: a string representing a Bluetooth address
- * @BLUETOOTH_COLUMN_ALIAS: a string to use for display (the name of the device, or its address if the name is not known). Only available for devices.
- * @BLUETOOTH_COLUMN_NAME: a string representing the device or adapter's name
- * @BLUETOOTH_COLUMN_TYPE: the #BluetoothType of the device. Only available for devices.
- * @BLUETOOTH_COLUMN_ICON: a string representing the icon name for the device. Only available for devices.
- * @BLUETOOTH_COLUMN_DEFAULT: whether the adapter is the default one. Only available for adapters.
- * @BLUETOOTH_COLUMN_PAIRED: whether the device is paired to its parent adapter. Only available for devices.
- * @BLUETOOTH_COLUMN_TRUSTED: whether the device is trusted. Only available for devices.
- * @BLUETOOTH_COLUMN_CONNECTED: whether the device is connected. Only available for devices.
- * @BLUETOOTH_COLUMN_DISCOVERING: whether the adapter is discovering. Only available for adapters.
- * @BLUETOOTH_COLUMN_LEGACYPAIRING: whether the device does not support Bluetooth 2.1 Simple Secure Pairing. Only available for devices.
- * @BLUETOOTH_COLUMN_POWERED: whether the adapter is powered. Only available for adapters.
- * @BLUETOOTH_COLUMN_UUIDS: a string array of human-readable UUIDs.
- *
- * A column identifier to pass to bluetooth_chooser_get_selected_device_info().
+ * BluetoothDeviceField:
+ * @BLUETOOTH_DEVICE_FIELD_NONE: no properties changed
+ * @BLUETOOTH_DEVICE_FIELD_NAME: the name of the device changed
+ * @BLUETOOTH_DEVICE_FIELD_ALIAS: the alias of the device changed
+ * @BLUETOOTH_DEVICE_FIELD_TYPE: the #BluetoothType of the device changed
+ * @BLUETOOTH_DEVICE_FIELD_ICON: the icon name of the device changed
+ * @BLUETOOTH_DEVICE_FIELD_PAIRED: whether the device is paired changed
+ * @BLUETOOTH_DEVICE_FIELD_TRUSTED: whether the device is trusted changed
+ * @BLUETOOTH_DEVICE_FIELD_CONNECTED: whether the device is connected changed
+ * @BLUETOOTH_DEVICE_FIELD_LEGACY_PAIRING: whether the device supports Simple Secure Pairing changed
+ * @BLUETOOTH_DEVICE_FIELD_UUIDS: the list of services of the device changed
+ *
+ * The properties of a #BluetoothDevice that were changed, as passed to the #BluetoothDevice::changed signal.
  **/
 typedef enum {
-	BLUETOOTH_COLUMN_PROXY,
-	BLUETOOTH_COLUMN_PROPERTIES,
-	BLUETOOTH_COLUMN_ADDRESS,
-	BLUETOOTH_COLUMN_ALIAS,
-	BLUETOOTH_COLUMN_NAME,
-	BLUETOOTH_COLUMN_TYPE,
-	BLUETOOTH_COLUMN_ICON,
-	BLUETOOTH_COLUMN_DEFAULT,
-	BLUETOOTH_COLUMN_PAIRED,
-	BLUETOOTH_COLUMN_TRUSTED,
-	BLUETOOTH_COLUMN_CONNECTED,
-	BLUETOOTH_COLUMN_DISCOVERING,
-	BLUETOOTH_COLUMN_LEGACYPAIRING,
-	BLUETOOTH_COLUMN_POWERED,
-	BLUETOOTH_COLUMN_UUIDS,
-} BluetoothColumn;
+	BLUETOOTH_DEVICE_FIELD_NONE		= 0,
+	BLUETOOTH_DEVICE_FIELD_NAME		= 1 << 0,
+	BLUETOOTH_DEVICE_FIELD_ALIAS		= 1 << 1,
+	BLUETOOTH_DEVICE_FIELD_TYPE		= 1 << 2,
+	BLUETOOTH_DEVICE_FIELD_ICON		= 1 << 3,
+	BLUETOOTH_DEVICE_FIELD_PAIRED		= 1 << 4,
+	BLUETOOTH_DEVICE_FIELD_TRUSTED		= 1 << 5,
+	BLUETOOTH_DEVICE_FIELD_CONNECTED	= 1 << 6,
+	BLUETOOTH_DEVICE_FIELD_LEGACY_PAIRING	= 1 << 7,
+	BLUETOOTH_DEVICE_FIELD_UUIDS		= 1 << 8,
+} BluetoothDeviceField;
 
-#define _BLUETOOTH_NUM_COLUMNS (BLUETOOTH_COLUMN_UUIDS + 1)
+/**
+ * BluetoothServiceFlags:
+ * @BLUETOOTH_SERVICE_NONE: no known services
+ * @BLUETOOTH_SERVICE_SERIAL_PORT: Serial Port Profile
+ * @BLUETOOTH_SERVICE_DIALUP_NETWORKING: Dial-up Networking Profile
+ * @BLUETOOTH_SERVICE_IRMC_SYNC: IrMC synchronisation
+ * @BLUETOOTH_SERVICE_OBEX_OBJECT_PUSH: OBEX Object Push Profile
+ * @BLUETOOTH_SERVICE_OBEX_FILE_TRANSFER: OBEX File Transfer Profile
+ * @BLUETOOTH_SERVICE_HSP: Headset Profile
+ * @BLUETOOTH_SERVICE_AUDIO_SOURCE: A2DP audio source
+ * @BLUETOOTH_SERVICE_AUDIO_SINK: A2DP audio sink
+ * @BLUETOOTH_SERVICE_AVRCP_TARGET: A/V remote control target
+ * @BLUETOOTH_SERVICE_A2DP: Advanced Audio Distribution Profile
+ * @BLUETOOTH_SERVICE_AVRCP_CONTROL: A/V remote control
+ * @BLUETOOTH_SERVICE_HSP_AG: Headset Profile audio gateway
+ * @BLUETOOTH_SERVICE_PAN_PANU: PAN user
+ * @BLUETOOTH_SERVICE_PAN_NAP: PAN network access point
+ * @BLUETOOTH_SERVICE_PAN_GN: PAN group ad-hoc network
+ * @BLUETOOTH_SERVICE_HANDSFREE: Hands-Free Profile
+ * @BLUETOOTH_SERVICE_HANDSFREE_AG: Hands-Free Profile audio gateway
+ * @BLUETOOTH_SERVICE_HID: Human Interface Device, over BR/EDR or LE
+ * @BLUETOOTH_SERVICE_SIM_ACCESS: SIM Access Profile
+ * @BLUETOOTH_SERVICE_PBAP: Phone Book Access Profile server
+ * @BLUETOOTH_SERVICE_GENERIC_AUDIO: generic audio
+ * @BLUETOOTH_SERVICE_GENERIC_NETWORKING: generic networking
+ * @BLUETOOTH_SERVICE_VIDEO_SOURCE: Video Distribution Profile source
+ * @BLUETOOTH_SERVICE_SYNCML_CLIENT: SyncML client
+ * @BLUETOOTH_SERVICE_SYNCML_SERVER: Nokia SyncML server
+ * @BLUETOOTH_SERVICE_SEMC_HLA: Sony Ericsson HLA
+ * @BLUETOOTH_SERVICE_SEMC_WATCH_PHONE: Sony Ericsson Watch Phone
+ *
+ * The known services advertised by a #BluetoothDevice, as parsed from its
+ * UUIDs. See also %BLUETOOTH_SERVICE_CONNECTABLE, %BLUETOOTH_SERVICE_AUDIO,
+ * %BLUETOOTH_SERVICE_INPUT and %BLUETOOTH_SERVICE_OBEX.
+ **/
+typedef enum {
+	BLUETOOTH_SERVICE_NONE			= 0,
+	BLUETOOTH_SERVICE_SERIAL_PORT		= 1 << 0,
+	BLUETOOTH_SERVICE_DIALUP_NETWORKING	= 1 << 1,
+	BLUETOOTH_SERVICE_IRMC_SYNC		= 1 << 2,
+	BLUETOOTH_SERVICE_OBEX_OBJECT_PUSH	= 1 << 3,
+	BLUETOOTH_SERVICE_OBEX_FILE_TRANSFER	= 1 << 4,
+	BLUETOOTH_SERVICE_HSP			= 1 << 5,
+	BLUETOOTH_SERVICE_AUDIO_SOURCE		= 1 << 6,
+	BLUETOOTH_SERVICE_AUDIO_SINK		= 1 << 7,
+	BLUETOOTH_SERVICE_AVRCP_TARGET		= 1 << 8,
+	BLUETOOTH_SERVICE_A2DP			= 1 << 9,
+	BLUETOOTH_SERVICE_AVRCP_CONTROL		= 1 << 10,
+	BLUETOOTH_SERVICE_HSP_AG		= 1 << 11,
+	BLUETOOTH_SERVICE_PAN_PANU		= 1 << 12,
+	BLUETOOTH_SERVICE_PAN_NAP		= 1 << 13,
+	BLUETOOTH_SERVICE_PAN_GN		= 1 << 14,
+	BLUETOOTH_SERVICE_HANDSFREE		= 1 << 15,
+	BLUETOOTH_SERVICE_HANDSFREE_AG		= 1 << 16,
+	BLUETOOTH_SERVICE_HID			= 1 << 17,
+	BLUETOOTH_SERVICE_SIM_ACCESS		= 1 << 18,
+	BLUETOOTH_SERVICE_PBAP			= 1 << 19,
+	BLUETOOTH_SERVICE_GENERIC_AUDIO		= 1 << 20,
+	BLUETOOTH_SERVICE_GENERIC_NETWORKING	= 1 << 21,
+	BLUETOOTH_SERVICE_VIDEO_SOURCE		= 1 << 22,
+	BLUETOOTH_SERVICE_SYNCML_CLIENT		= 1 << 23,
+	BLUETOOTH_SERVICE_SYNCML_SERVER		= 1 << 24,
+	BLUETOOTH_SERVICE_SEMC_HLA		= 1 << 25,
+	BLUETOOTH_SERVICE_SEMC_WATCH_PHONE	= 1 << 26,
+} BluetoothServiceFlags;
+
+/**
+ * BLUETOOTH_SERVICE_AUDIO:
+ *
+ * The #BluetoothServiceFlags of audio services.
+ */
+#define BLUETOOTH_SERVICE_AUDIO (BLUETOOTH_SERVICE_HSP | BLUETOOTH_SERVICE_AUDIO_SOURCE | BLUETOOTH_SERVICE_AUDIO_SINK | BLUETOOTH_SERVICE_A2DP | BLUETOOTH_SERVICE_HSP_AG | BLUETOOTH_SERVICE_HANDSFREE | BLUETOOTH_SERVICE_HANDSFREE_AG | BLUETOOTH_SERVICE_GENERIC_AUDIO)
+/**
+ * BLUETOOTH_SERVICE_INPUT:
+ *
+ * The #BluetoothServiceFlags of input services.
+ */
+#define BLUETOOTH_SERVICE_INPUT (BLUETOOTH_SERVICE_HID)
+/**
+ * BLUETOOTH_SERVICE_OBEX:
+ *
+ * The #BluetoothServiceFlags of services that can receive files over OBEX.
+ */
+#define BLUETOOTH_SERVICE_OBEX (BLUETOOTH_SERVICE_OBEX_OBJECT_PUSH)
+/**
+ * BLUETOOTH_SERVICE_CONNECTABLE:
+ *
+ * The #BluetoothServiceFlags of services that BlueZ can connect to, making
+ * a device with any of them connectable.
+ */
+#define BLUETOOTH_SERVICE_CONNECTABLE (BLUETOOTH_SERVICE_HSP | BLUETOOTH_SERVICE_AUDIO_SOURCE | BLUETOOTH_SERVICE_AUDIO_SINK | BLUETOOTH_SERVICE_AVRCP_TARGET | BLUETOOTH_SERVICE_AVRCP_CONTROL | BLUETOOTH_SERVICE_HSP_AG | BLUETOOTH_SERVICE_HANDSFREE | BLUETOOTH_SERVICE_HANDSFREE_AG | BLUETOOTH_SERVICE_HID)
 
 /**
  * BluetoothStatus:
@@ -271,9 +271,9 @@ get_paired_for_address (const char  *adapter,
 			const char  *device,
 			char       **name)
 {
-	g_autoptr(GListStore) model = NULL;
+	g_autoptr(BluetoothDevice) _device = NULL;
 	g_autofree char *default_address = NULL;
-	guint n_devices, i;
+	gboolean paired = FALSE;
 
 	g_object_get (client,
 		      "default-adapter-address", &default_address,
@@ -284,25 +284,12 @@ get_paired_for_address (const char  *adapter,
 		return FALSE;
 	}
 
-	model = bluetooth_client_get_devices (client);
-	n_devices = g_list_model_get_n_items (G_LIST_MODEL (model));
-
-	for (i = 0; i < n_devices; i++) {
-		g_autoptr(BluetoothDevice) _device = NULL;
-		g_autofree char *address = NULL;
-		g_autofree char *alias = NULL;
-		gboolean paired = FALSE;
-
-		_device = g_list_model_get_item (G_LIST_MODEL (model), i);
+	_device = bluetooth_client_get_device_by_address (client, device);
+	if (_device != NULL) {
 		g_object_get (_device,
-			      "address", &address,
-			      "alias", &alias,
-			      "paired", paired,
+			      "alias", name,
+			      "paired", &paired,
 			      NULL);
-		if (g_strcmp0 (device, address) != 0)
-			continue;
-
-		*name = g_steal_pointer (&alias);
 		return paired;
 	}
 
@@ -37,6 +37,7 @@
 #include "bluetooth-settings-row.h"
 #include "bluetooth-settings-obexpush.h"
 #include "bluetooth-pairing-dialog.h"
+#include "bluetooth-trace.h"
 #include "pin.h"
 
 struct _BluetoothSettingsWidget {
@@ -51,6 +52,7 @@ struct _BluetoothSettingsWidget {
 	/* Pairing */
 	BluetoothAgent      *agent;
 	GtkWindow           *pairing_dialog;
+	gint64               pairing_dialog_time; /* when shown, or last answered */
 	GHashTable          *pairing_devices; /* key=object-path, value=boolean */
 
 	/* Properties */
@@ -219,11 +221,26 @@ add_device_type (BluetoothSettingsWidget *self,
 
 	t = GPOINTER_TO_UINT (g_hash_table_lookup (self->devices_type, bdaddr));
 	if (t == 0 || t == BLUETOOTH_TYPE_ANY) {
-		g_hash_table_insert (self->devices_type, g_strdup (bdaddr), GUINT_TO_POINTER (type));
+		g_hash_table_insert (self->devices_type, g_ref_string_new_intern (bdaddr), GUINT_TO_POINTER (type));
 		g_debug ("Saving device type %s for %s", bluetooth_type_to_string (type), bdaddr);
 	}
 }
 
+static void
+pairing_dialog_response_cb (GtkDialog *dialog,
+			    int        response,
+			    gpointer   user_data)
+{
+	BluetoothSettingsWidget *self = user_data;
+
+	_bluetooth_trace_mark (self->pairing_dialog_time, "Pairing dialog",
+			       "mode %d, response %d",
+			       bluetooth_pairing_dialog_get_mode (BLUETOOTH_PAIRING_DIALOG (dialog)),
+			       response);
+	/* The same dialog might get reused for the next step */
+	self->pairing_dialog_time = g_get_monotonic_time ();
+}
+
 static void
 setup_pairing_dialog (BluetoothSettingsWidget *self)
 {
@@ -234,6 +251,11 @@ setup_pairing_dialog (BluetoothSettingsWidget *self)
 	toplevel = GTK_WIDGET (gtk_widget_get_native (GTK_WIDGET (self)));
 	gtk_window_set_transient_for (self->pairing_dialog, GTK_WINDOW (toplevel));
 	gtk_window_set_modal (self->pairing_dialog, TRUE);
+
+	/* Connected first, so it runs before the handler for the mode */
+	self->pairing_dialog_time = g_get_monotonic_time ();
+	g_signal_connect (G_OBJECT (self->pairing_dialog), "response",
+			  G_CALLBACK (pairing_dialog_response_cb), self);
 }
 
 static gboolean
@@ -845,6 +867,7 @@ typedef struct {
 	BluetoothSettingsWidget *self;
 	char *device;
 	GTimer *timer;
+	gint64 begin_time;
 	guint timeout_id;
 } SetupConnectData;
 
@@ -886,6 +909,9 @@ connect_callback (GObject      *source_object,
 		g_debug ("Failed to connect to device %s: %s", data->device, error->message);
 	}
 
+	_bluetooth_trace_mark (data->begin_time, "Connect after setup", "%s (%s)",
+			       data->device, success ? "success" : "failure");
+
 	turn_off_pairing (data->self, data->device);
 
 	g_object_set (G_OBJECT (data->self->client),
@@ -962,6 +988,7 @@ create_callback (GObject      *source_object,
 	data->self = user_data;
 	data->device = g_steal_pointer (&path);
 	data->timer = g_timer_new ();
+	data->begin_time = g_get_monotonic_time ();
 
 	bluetooth_client_connect_service (BLUETOOTH_CLIENT (source_object),
 					  data->device, TRUE, self->cancellable, connect_callback, data);
@@ -1088,10 +1115,9 @@ update_properties (BluetoothSettingsWidget *self,
 	GtkSwitch *button;
 	BluetoothType type;
 	gboolean connected, paired;
-	g_auto(GStrv) uuids = NULL;
+	BluetoothServiceFlags services;
 	char *bdaddr, *alias;
 	g_autofree char *icon = NULL;
-	guint i;
 
 	if (self->debug)
 		bluetooth_device_dump (device);
@@ -1102,7 +1128,7 @@ update_properties (BluetoothSettingsWidget *self,
 		      "icon", &icon,
 		      "paired", &paired,
 		      "connected", &connected,
-		      "uuids", &uuids,
+		      "services", &services,
 		      "type", &type,
 		      NULL);
 
@@ -1139,13 +1165,9 @@ update_properties (BluetoothSettingsWidget *self,
 
 	/* UUIDs */
 	gtk_widget_set_sensitive (GTK_WIDGET (button),
-				  bluetooth_client_get_connectable ((const char **) uuids));
-	for (i = 0; uuids && uuids[i] != NULL; i++) {
-		if (g_str_equal (uuids[i], "OBEXObjectPush")) {
-			gtk_widget_show (WID ("send_button"));
-			break;
-		}
-	}
+				  (services & BLUETOOTH_SERVICE_CONNECTABLE) != 0);
+	if (services & BLUETOOTH_SERVICE_OBEX)
+		gtk_widget_show (WID ("send_button"));
 
 	/* Type */
 	gtk_label_set_text (GTK_LABEL (WID ("type_label")), bluetooth_type_to_string (type));
@@ -1290,12 +1312,23 @@ show_confirm_dialog (BluetoothSettingsWidget *self,
 	return FALSE;
 }
 
-static gboolean
-remove_selected_device (BluetoothSettingsWidget *self)
+static void
+remove_device_cb (GObject      *source_object,
+		  GAsyncResult *res,
+		  gpointer      user_data)
 {
-	GDBusProxy *adapter_proxy;
 	g_autoptr(GError) error = NULL;
-	GVariant *ret;
+	g_autofree char *path = user_data;
+
+	if (!adapter1_call_remove_device_finish (ADAPTER1 (source_object), res, &error) &&
+	    !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		g_warning ("Failed to remove device '%s': %s", path, error->message);
+}
+
+static void
+remove_selected_device (BluetoothSettingsWidget *self)
+{
+	g_autoptr(GDBusProxy) adapter_proxy = NULL;
 
 	g_debug ("About to call RemoveDevice for %s", self->selected_object_path);
 
@@ -1303,28 +1336,14 @@ remove_selected_device (BluetoothSettingsWidget *self)
 
 	if (adapter_proxy == NULL) {
 		g_warning ("Failed to get a GDBusProxy for the default adapter");
-		return FALSE;
-	}
-
-	//FIXME use adapter1_call_remove_device_sync()
-	ret = g_dbus_proxy_call_sync (G_DBUS_PROXY (adapter_proxy),
-				      "RemoveDevice",
-				      g_variant_new ("(o)", self->selected_object_path),
-				      G_DBUS_CALL_FLAGS_NONE,
-				      -1,
-				      NULL,
-				      &error);
-
-	if (ret == NULL) {
-		g_warning ("Failed to remove device '%s': %s",
-			   self->selected_object_path, error->message);
-	} else {
-		g_variant_unref (ret);
+		return;
 	}
 
-	g_object_unref (adapter_proxy);
-
-	return (ret != NULL);
+	adapter1_call_remove_device (ADAPTER1 (adapter_proxy),
+				     self->selected_object_path,
+				     self->cancellable,
+				     remove_device_cb,
+				     g_strdup (self->selected_object_path));
 }
 
 static void
@@ -1536,12 +1555,11 @@ add_device_section (BluetoothSettingsWidget *self)
 }
 
 static void
-device_changed_cb (GObject    *object,
-		   GParamSpec *pspec,
-		   gpointer    user_data)
+device_changed_cb (BluetoothDevice      *device,
+		   BluetoothDeviceField  fields,
+		   gpointer              user_data)
 {
 	BluetoothSettingsWidget *self = user_data;
-	BluetoothDevice *device = BLUETOOTH_DEVICE (object);
 	GtkWidget *child;
 	const char *object_path;
 
@@ -1557,15 +1575,12 @@ device_changed_cb (GObject    *object,
 
 		path = g_object_get_data (G_OBJECT (child), "object-path");
 		if (g_str_equal (object_path, path)) {
-			g_autofree char *address = NULL;
-			BluetoothType type;
-
-			g_object_get (G_OBJECT (device),
-				      "address", &address,
-				      "type", &type,
-				      NULL);
+			if (fields & BLUETOOTH_DEVICE_FIELD_TYPE) {
+				BluetoothType type;
 
-			add_device_type (self, address, type);
+				g_object_get (G_OBJECT (device), "type", &type, NULL);
+				add_device_type (self, bluetooth_device_get_address (device), type);
+			}
 
 			/* Update the properties if necessary */
 			if (g_strcmp0 (self->selected_object_path, object_path) == 0)
@@ -1581,22 +1596,18 @@ device_added_cb (BluetoothClient *client,
 		 gpointer         user_data)
 {
 	BluetoothSettingsWidget *self = user_data;
-	g_autofree char *alias = NULL;
-	g_autofree char *address = NULL;
 	BluetoothType type;
 	GtkWidget *row;
 
 	row = bluetooth_settings_row_new_from_device (device);
 
-	g_object_get (G_OBJECT (row),
-		      "alias", &alias,
-		      "address", &address,
-		      "type", &type,
-		      NULL);
-	add_device_type (self, address, type);
-	g_debug ("Adding device %s (%s)", alias, bluetooth_device_get_object_path (device));
+	g_object_get (G_OBJECT (device), "type", &type, NULL);
+	add_device_type (self, bluetooth_device_get_address (device), type);
+	g_debug ("Adding device %s (%s)", bluetooth_device_get_alias (device), bluetooth_device_get_object_path (device));
 
-	g_object_set_data_full (G_OBJECT (row), "object-path", g_strdup (bluetooth_device_get_object_path (device)), g_free);
+	g_object_set_data_full (G_OBJECT (row), "object-path",
+				g_ref_string_new_intern (bluetooth_device_get_object_path (device)),
+				(GDestroyNotify) g_ref_string_release);
 
 	gtk_list_box_append (GTK_LIST_BOX (self->device_list), row);
 	gtk_size_group_add_widget (self->row_sizegroup, row);
@@ -1607,7 +1618,7 @@ device_added_cb (BluetoothClient *client,
 	gtk_widget_set_vexpand (self->child_box, FALSE);
 	gtk_stack_set_visible_child_name (GTK_STACK (self->device_stack), DEVICES_PAGE);
 
-	g_signal_connect_object (G_OBJECT (device), "notify",
+	g_signal_connect_object (G_OBJECT (device), "changed",
 				 G_CALLBACK (device_changed_cb), self, 0);
 }
 
@@ -1660,7 +1671,7 @@ devices_coldplug (BluetoothSettingsWidget *self)
 	g_autoptr(GListModel) model = NULL;
 	guint n_devices, i;
 
-	model = G_LIST_MODEL (bluetooth_client_get_devices (self->client));
+	model = bluetooth_client_get_devices (self->client);
 	n_devices = g_list_model_get_n_items (model);
 	for (i = 0; i < n_devices; i++) {
 		g_autoptr(BluetoothDevice) device = NULL;
@@ -1709,6 +1720,7 @@ setup_pairing_agent (BluetoothSettingsWidget *self)
 		g_clear_object (&self->agent);
 		return;
 	}
+	bluetooth_agent_set_client (self->agent, self->client);
 
 	bluetooth_agent_set_pincode_func (self->agent, pincode_callback, self);
 	bluetooth_agent_set_passkey_func (self->agent, passkey_callback, self);
@@ -1758,23 +1770,23 @@ is_session_active (BluetoothSettingsWidget *self)
 }
 
 static void
-setup_obex (BluetoothSettingsWidget *self)
+session_proxy_new_cb (GObject      *source_object,
+		      GAsyncResult *res,
+		      gpointer      user_data)
 {
+	BluetoothSettingsWidget *self;
+	GDBusProxy *session_proxy;
 	g_autoptr(GError) error = NULL;
 
-	self->session_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-							     G_DBUS_PROXY_FLAGS_NONE,
-							     NULL,
-							     GNOME_SESSION_DBUS_NAME,
-							     GNOME_SESSION_DBUS_OBJECT,
-							     GNOME_SESSION_DBUS_INTERFACE,
-							     NULL,
-							     &error);
-
-	if (self->session_proxy == NULL) {
-		g_warning ("Failed to get session proxy: %s", error->message);
+	session_proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+	if (session_proxy == NULL) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning ("Failed to get session proxy: %s", error->message);
 		return;
 	}
+
+	self = user_data;
+	self->session_proxy = session_proxy;
 	g_signal_connect (self->session_proxy, "g-properties-changed",
 			  G_CALLBACK (session_properties_changed_cb), self);
 	self->has_console = is_session_active (self);
@@ -1783,6 +1795,20 @@ setup_obex (BluetoothSettingsWidget *self)
 		obex_agent_up ();
 }
 
+static void
+setup_obex (BluetoothSettingsWidget *self)
+{
+	g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+				  G_DBUS_PROXY_FLAGS_NONE,
+				  NULL,
+				  GNOME_SESSION_DBUS_NAME,
+				  GNOME_SESSION_DBUS_OBJECT,
+				  GNOME_SESSION_DBUS_INTERFACE,
+				  self->cancellable,
+				  session_proxy_new_cb,
+				  self);
+}
+
 static void
 bluetooth_settings_widget_init (BluetoothSettingsWidget *self)
 {
@@ -1820,11 +1846,11 @@ bluetooth_settings_widget_init (BluetoothSettingsWidget *self)
 						       NULL);
 	self->devices_type = g_hash_table_new_full (g_str_hash,
 						    g_str_equal,
-						    (GDestroyNotify) g_free,
+						    (GDestroyNotify) g_ref_string_release,
 						    NULL);
 
-	setup_pairing_agent (self);
 	self->client = bluetooth_client_new ();
+	setup_pairing_agent (self);
 	g_signal_connect (self->client, "device-added",
 			  G_CALLBACK (device_added_cb), self);
 	g_signal_connect (self->client, "device-removed",
@@ -1865,7 +1891,6 @@ bluetooth_settings_widget_finalize (GObject *object)
 	obex_agent_down ();
 
 	/* See default_adapter_changed () */
-	/* FIXME: This is blocking */
 	if (self->client)
 		g_object_set (G_OBJECT (self->client), "default-adapter-setup-mode", FALSE, NULL);
 
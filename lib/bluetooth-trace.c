@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2021 Bastien Nocera <hadess@hadess.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "config.h"
+
+#ifdef HAVE_SYSPROF
+#include <sysprof-capture.h>
+#endif
+
+#include "bluetooth-trace.h"
+
+#define TRACE_GROUP "gnome-bluetooth"
+
+void
+_bluetooth_trace_mark (gint64      begin_time,
+		       const char *name,
+		       const char *message_format,
+		       ...)
+{
+	g_autofree char *message = NULL;
+	gint64 end_time;
+	va_list args;
+
+	end_time = g_get_monotonic_time ();
+
+	va_start (args, message_format);
+	message = g_strdup_vprintf (message_format, args);
+	va_end (args);
+
+#ifdef HAVE_SYSPROF
+	/* Both use CLOCK_MONOTONIC, in ns for sysprof */
+	sysprof_collector_mark (begin_time * 1000,
+				(end_time - begin_time) * 1000,
+				TRACE_GROUP,
+				name,
+				message);
+#endif
+
+	g_debug ("%s took %.3f ms: %s", name,
+		 (end_time - begin_time) / 1000.0, message);
+}
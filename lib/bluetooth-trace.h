@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2021 Bastien Nocera <hadess@hadess.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* Records a span that started at @begin_time, as returned by
+ * g_get_monotonic_time(), and ends now. The span shows up as a mark
+ * in sysprof captures when built with sysprof support, and in the
+ * debug output otherwise */
+void _bluetooth_trace_mark (gint64      begin_time,
+			    const char *name,
+			    const char *message_format,
+			    ...) G_GNUC_PRINTF (3, 4);
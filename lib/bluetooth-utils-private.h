@@ -0,0 +1,11 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <bluetooth-enums.h>
+
+char **_bluetooth_service_flags_to_names (BluetoothServiceFlags services);
+BluetoothServiceFlags _bluetooth_names_to_service_flags (const char * const *names);
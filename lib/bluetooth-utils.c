@@ -34,10 +34,12 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <glib/gi18n-lib.h>
 #include <gtk/gtk.h>
 
 #include "bluetooth-utils.h"
+#include "bluetooth-utils-private.h"
 #include "gnome-bluetooth-enum-types.h"
 
 /**
@@ -261,86 +263,185 @@ bluetooth_appearance_to_type (guint16 appearance)
 
 }
 
-static const char *
-uuid16_custom_to_string (guint uuid16, const char *uuid)
+typedef struct {
+	guint32 uuid;
+	const char *name;
+	BluetoothServiceFlags service;
+} UuidName;
+
+/* Short names from Table 2 at:
+ * https://www.bluetooth.org/Technical/AssignedNumbers/service_discovery.htm
+ * Sorted by UUID, as they're looked up with bsearch(), and a NULL
+ * name means the UUID is ignored */
+static const UuidName uuid_names[] = {
+	{ BLUETOOTH_UUID_SDP, NULL, BLUETOOTH_SERVICE_NONE }, /* ServiceDiscoveryServerServiceClassID */
+	{ BLUETOOTH_UUID_SPP, "SerialPort", BLUETOOTH_SERVICE_SERIAL_PORT },
+	{ BLUETOOTH_UUID_DUN, "DialupNetworking", BLUETOOTH_SERVICE_DIALUP_NETWORKING },
+	{ BLUETOOTH_UUID_IRMC, "IrMCSync", BLUETOOTH_SERVICE_IRMC_SYNC },
+	{ BLUETOOTH_UUID_OPP, "OBEXObjectPush", BLUETOOTH_SERVICE_OBEX_OBJECT_PUSH },
+	{ BLUETOOTH_UUID_FTP, "OBEXFileTransfer", BLUETOOTH_SERVICE_OBEX_FILE_TRANSFER },
+	{ BLUETOOTH_UUID_HSP, "HSP", BLUETOOTH_SERVICE_HSP },
+	{ BLUETOOTH_UUID_A2DP_SOURCE, "AudioSource", BLUETOOTH_SERVICE_AUDIO_SOURCE },
+	{ BLUETOOTH_UUID_A2DP_SINK, "AudioSink", BLUETOOTH_SERVICE_AUDIO_SINK },
+	{ BLUETOOTH_UUID_AVRCP_TARGET, "A/V_RemoteControlTarget", BLUETOOTH_SERVICE_AVRCP_TARGET },
+	{ BLUETOOTH_UUID_A2DP, "AdvancedAudioDistribution", BLUETOOTH_SERVICE_A2DP },
+	{ BLUETOOTH_UUID_AVRCP_CONTROL, "A/V_RemoteControl", BLUETOOTH_SERVICE_AVRCP_CONTROL },
+	{ BLUETOOTH_UUID_HSP_AG, "Headset_-_AG", BLUETOOTH_SERVICE_HSP_AG },
+	{ BLUETOOTH_UUID_PAN_PANU, "PANU", BLUETOOTH_SERVICE_PAN_PANU },
+	{ BLUETOOTH_UUID_PAN_NAP, "NAP", BLUETOOTH_SERVICE_PAN_NAP },
+	{ BLUETOOTH_UUID_PAN_GN, "GN", BLUETOOTH_SERVICE_PAN_GN },
+	{ BLUETOOTH_UUID_HFP_HF, "Handsfree", BLUETOOTH_SERVICE_HANDSFREE },
+	{ BLUETOOTH_UUID_HFP_AG, "HandsfreeAudioGateway", BLUETOOTH_SERVICE_HANDSFREE_AG },
+	{ BLUETOOTH_UUID_HID, "HumanInterfaceDeviceService", BLUETOOTH_SERVICE_HID },
+	{ BLUETOOTH_UUID_SAP, "SIM_Access", BLUETOOTH_SERVICE_SIM_ACCESS },
+	{ BLUETOOTH_UUID_PBAP, "Phonebook_Access_-_PSE", BLUETOOTH_SERVICE_PBAP },
+	{ BLUETOOTH_UUID_PNP, NULL, BLUETOOTH_SERVICE_NONE }, /* PnPInformation */
+	{ BLUETOOTH_UUID_GENERIC_NET, "GenericNetworking", BLUETOOTH_SERVICE_GENERIC_NETWORKING },
+	{ BLUETOOTH_UUID_GENERIC_AUDIO, "GenericAudio", BLUETOOTH_SERVICE_GENERIC_AUDIO },
+	{ BLUETOOTH_UUID_VDP_SOURCE, "VideoSource", BLUETOOTH_SERVICE_VIDEO_SOURCE },
+	{ 0x1812, "HumanInterfaceDeviceService", BLUETOOTH_SERVICE_HID },
+};
+
+/* Sony Ericsson vendor UUIDs, -8da5-11df-8d6f-0002a5d5c51b */
+static const UuidName uuid_semc_names[] = {
+	{ 0x8e771301, "SEMC HLA", BLUETOOTH_SERVICE_SEMC_HLA },
+	{ 0x8e771303, "SEMC HLA", BLUETOOTH_SERVICE_SEMC_HLA },
+	{ 0x8e771401, "SEMC Watch Phone", BLUETOOTH_SERVICE_SEMC_WATCH_PHONE },
+};
+
+/* UUIDs with the SyncML base, -0000-1000-8000-0002ee000002 */
+static const UuidName uuid_custom_names[] = {
+	{ 0x2, "SyncMLClient", BLUETOOTH_SERVICE_SYNCML_CLIENT },
+	{ 0x5601, "Nokia SyncML Server", BLUETOOTH_SERVICE_SYNCML_SERVER },
+};
+
+#define UUID_STR_LEN 36
+#define UUID_BASE_SUFFIX "-0000-1000-8000-00805f9b34fb"
+#define UUID_CUSTOM_SUFFIX "-0000-1000-8000-0002ee000002"
+#define UUID_SEMC_SUFFIX "-8da5-11df-8d6f-0002a5d5c51b"
+
+typedef enum {
+	UUID_KIND_INVALID,
+	UUID_KIND_BASE,
+	UUID_KIND_CUSTOM,
+	UUID_KIND_SEMC,
+	UUID_KIND_VENDOR,
+} UuidKind;
+
+static gboolean
+parse_hex32 (const char *str,
+	     guint       len,
+	     guint32    *value)
 {
-	switch (uuid16) {
-	case 0x2:
-		return "SyncMLClient";
-	case 0x5601:
-		return "Nokia SyncML Server";
-	default:
-		g_debug ("Unhandled custom UUID %s (0x%x)", uuid, uuid16);
-		return NULL;
+	guint i;
+
+	*value = 0;
+	for (i = 0; i < len; i++) {
+		int digit = g_ascii_xdigit_value (str[i]);
+		if (digit < 0)
+			return FALSE;
+		*value = (*value << 4) | digit;
 	}
+
+	return TRUE;
 }
 
-/* Short names from Table 2 at:
- * https://www.bluetooth.org/Technical/AssignedNumbers/service_discovery.htm */
-static const char *
-uuid16_to_string (guint uuid16, const char *uuid)
+/* Parses @uuid in place, without allocating. The first 32 bits are
+ * the short UUID for UUIDs on top of the Bluetooth base UUID, which
+ * is how BlueZ sends all of them, and the other known bases are told
+ * apart by their suffix. Any other 128-bit UUID is a vendor one.
+ * Strings that aren't full 128-bit UUIDs are parsed from their leading
+ * hex digits, as before. */
+static UuidKind
+parse_uuid (const char *uuid,
+	    guint32    *value)
+{
+	guint i;
+
+	if (strlen (uuid) != UUID_STR_LEN) {
+		for (i = 0; i < 8 && g_ascii_isxdigit (uuid[i]); i++)
+			;
+		if (i == 0 || !parse_hex32 (uuid, i, value))
+			return UUID_KIND_INVALID;
+		return UUID_KIND_BASE;
+	}
+
+	for (i = 0; i < UUID_STR_LEN; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (uuid[i] != '-')
+				return UUID_KIND_INVALID;
+		} else if (!g_ascii_isxdigit (uuid[i])) {
+			return UUID_KIND_INVALID;
+		}
+	}
+
+	parse_hex32 (uuid, 8, value);
+
+	if (g_ascii_strcasecmp (uuid + 8, UUID_BASE_SUFFIX) == 0)
+		return UUID_KIND_BASE;
+	if (g_ascii_strcasecmp (uuid + 8, UUID_CUSTOM_SUFFIX) == 0)
+		return UUID_KIND_CUSTOM;
+	if (g_ascii_strcasecmp (uuid + 8, UUID_SEMC_SUFFIX) == 0)
+		return UUID_KIND_SEMC;
+	return UUID_KIND_VENDOR;
+}
+
+static int
+compare_uuid_names (const void *a,
+		    const void *b)
 {
-	switch (uuid16) {
-	case BLUETOOTH_UUID_SPP:
-		return "SerialPort";
-	case BLUETOOTH_UUID_DUN:
-		return "DialupNetworking";
-	case BLUETOOTH_UUID_IRMC:
-		return "IrMCSync";
-	case BLUETOOTH_UUID_OPP:
-		return "OBEXObjectPush";
-	case BLUETOOTH_UUID_FTP:
-		return "OBEXFileTransfer";
-	case BLUETOOTH_UUID_HSP:
-		return "HSP";
-	case BLUETOOTH_UUID_A2DP_SOURCE:
-		return "AudioSource";
-	case BLUETOOTH_UUID_A2DP_SINK:
-		return "AudioSink";
-	case BLUETOOTH_UUID_AVRCP_TARGET:
-		return "A/V_RemoteControlTarget";
-	case BLUETOOTH_UUID_A2DP:
-		return "AdvancedAudioDistribution";
-	case BLUETOOTH_UUID_AVRCP_CONTROL:
-		return "A/V_RemoteControl";
-	case BLUETOOTH_UUID_HSP_AG:
-		return "Headset_-_AG";
-	case BLUETOOTH_UUID_PAN_PANU:
-		return "PANU";
-	case BLUETOOTH_UUID_PAN_NAP:
-		return "NAP";
-	case BLUETOOTH_UUID_PAN_GN:
-		return "GN";
-	case BLUETOOTH_UUID_HFP_HF:
-		return "Handsfree";
-	case BLUETOOTH_UUID_HFP_AG:
-		return "HandsfreeAudioGateway";
-	case BLUETOOTH_UUID_HID:
-	case 0x1812:
-		return "HumanInterfaceDeviceService";
-	case BLUETOOTH_UUID_SAP:
-		return "SIM_Access";
-	case BLUETOOTH_UUID_PBAP:
-		return "Phonebook_Access_-_PSE";
-	case BLUETOOTH_UUID_GENERIC_AUDIO:
-		return "GenericAudio";
-	case BLUETOOTH_UUID_SDP: /* ServiceDiscoveryServerServiceClassID */
-	case BLUETOOTH_UUID_PNP: /* PnPInformation */
-		/* Those are ignored */
+	guint32 uuid_a = ((const UuidName *) a)->uuid;
+	guint32 uuid_b = ((const UuidName *) b)->uuid;
+
+	return (uuid_a > uuid_b) - (uuid_a < uuid_b);
+}
+
+static const UuidName *
+lookup_uuid_name (const UuidName *names,
+		  gsize           n_names,
+		  guint32         uuid)
+{
+	UuidName key = { uuid, NULL, 0 };
+
+	return bsearch (&key, names, n_names, sizeof (UuidName), compare_uuid_names);
+}
+
+static const UuidName *
+uuid_to_name (const char *uuid)
+{
+	const UuidName *name;
+	UuidKind kind;
+	guint32 value;
+
+	kind = parse_uuid (uuid, &value);
+	if (kind == UUID_KIND_INVALID || value == 0)
 		return NULL;
-	case BLUETOOTH_UUID_GENERIC_NET:
-		return "GenericNetworking";
-	case BLUETOOTH_UUID_VDP_SOURCE:
-		return "VideoSource";
-	case 0x8e771303:
-	case 0x8e771301:
-		return "SEMC HLA";
-	case 0x8e771401:
-		return "SEMC Watch Phone";
+
+	switch (kind) {
+	case UUID_KIND_CUSTOM:
+		name = lookup_uuid_name (uuid_custom_names, G_N_ELEMENTS (uuid_custom_names), value);
+		if (name == NULL)
+			g_debug ("Unhandled custom UUID %s (0x%x)", uuid, value);
+		break;
+	case UUID_KIND_SEMC:
+		name = lookup_uuid_name (uuid_semc_names, G_N_ELEMENTS (uuid_semc_names), value);
+		if (name == NULL)
+			g_debug ("Unhandled SEMC UUID %s", uuid);
+		break;
+	case UUID_KIND_VENDOR:
+		/* Vendor UUIDs are only known on all 128 bits, as above */
+		g_debug ("Unhandled vendor UUID %s", uuid);
+		name = NULL;
+		break;
+	case UUID_KIND_BASE:
 	default:
-		g_debug ("Unhandled UUID %s (0x%x)", uuid, uuid16);
-		return NULL;
+		name = lookup_uuid_name (uuid_names, G_N_ELEMENTS (uuid_names), value);
+		if (name == NULL)
+			g_debug ("Unhandled UUID %s (0x%x)", uuid, value);
+		break;
 	}
+
+	return name;
 }
 
 /**
@@ -354,27 +455,101 @@ uuid16_to_string (guint uuid16, const char *uuid)
 const char *
 bluetooth_uuid_to_string (const char *uuid)
 {
-	char **parts;
-	guint uuid16;
-	gboolean is_custom = FALSE;
+	const UuidName *name;
 
-	if (g_str_has_suffix (uuid, "-0000-1000-8000-0002ee000002") != FALSE)
-		is_custom = TRUE;
+	name = uuid_to_name (uuid);
+	return name ? name->name : NULL;
+}
 
-	parts = g_strsplit (uuid, "-", -1);
-	if (parts == NULL || parts[0] == NULL) {
-		g_strfreev (parts);
-		return NULL;
+/**
+ * bluetooth_uuids_to_service_flags:
+ * @uuids: (array zero-terminated=1) (nullable): Bluetooth UUIDs
+ *
+ * Returns the known services in @uuids, as a bitmask.
+ *
+ * Return value: a #BluetoothServiceFlags.
+ **/
+BluetoothServiceFlags
+bluetooth_uuids_to_service_flags (const char * const *uuids)
+{
+	BluetoothServiceFlags services = BLUETOOTH_SERVICE_NONE;
+	guint i;
+
+	for (i = 0; uuids != NULL && uuids[i] != NULL; i++) {
+		const UuidName *name;
+
+		name = uuid_to_name (uuids[i]);
+		if (name != NULL)
+			services |= name->service;
+	}
+
+	return services;
+}
+
+static void
+add_service_names (GPtrArray             *names,
+		   const UuidName        *table,
+		   gsize                  n_entries,
+		   BluetoothServiceFlags *services)
+{
+	gsize i;
+
+	for (i = 0; i < n_entries; i++) {
+		if (!(*services & table[i].service))
+			continue;
+		g_ptr_array_add (names, g_strdup (table[i].name));
+		/* Only once for services with several UUIDs */
+		*services &= ~table[i].service;
 	}
+}
+
+/* The names from bluetooth_uuid_to_string() of the services, in UUID order */
+char **
+_bluetooth_service_flags_to_names (BluetoothServiceFlags services)
+{
+	GPtrArray *names;
 
-	uuid16 = g_ascii_strtoull (parts[0], NULL, 16);
-	g_strfreev (parts);
-	if (uuid16 == 0)
+	if (services == BLUETOOTH_SERVICE_NONE)
 		return NULL;
 
-	if (is_custom == FALSE)
-		return uuid16_to_string (uuid16, uuid);
-	return uuid16_custom_to_string (uuid16, uuid);
+	names = g_ptr_array_new ();
+	add_service_names (names, uuid_names, G_N_ELEMENTS (uuid_names), &services);
+	add_service_names (names, uuid_semc_names, G_N_ELEMENTS (uuid_semc_names), &services);
+	add_service_names (names, uuid_custom_names, G_N_ELEMENTS (uuid_custom_names), &services);
+	g_ptr_array_add (names, NULL);
+
+	return (char **) g_ptr_array_free (names, FALSE);
+}
+
+static BluetoothServiceFlags
+lookup_service_by_name (const UuidName *table,
+			gsize           n_entries,
+			const char     *name)
+{
+	gsize i;
+
+	for (i = 0; i < n_entries; i++) {
+		if (g_strcmp0 (table[i].name, name) == 0)
+			return table[i].service;
+	}
+
+	return BLUETOOTH_SERVICE_NONE;
+}
+
+/* The reverse of _bluetooth_service_flags_to_names() */
+BluetoothServiceFlags
+_bluetooth_names_to_service_flags (const char * const *names)
+{
+	BluetoothServiceFlags services = BLUETOOTH_SERVICE_NONE;
+	guint i;
+
+	for (i = 0; names != NULL && names[i] != NULL; i++) {
+		services |= lookup_service_by_name (uuid_names, G_N_ELEMENTS (uuid_names), names[i]);
+		services |= lookup_service_by_name (uuid_semc_names, G_N_ELEMENTS (uuid_semc_names), names[i]);
+		services |= lookup_service_by_name (uuid_custom_names, G_N_ELEMENTS (uuid_custom_names), names[i]);
+	}
+
+	return services;
 }
 
 /**
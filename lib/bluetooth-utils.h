@@ -62,6 +62,7 @@ BluetoothType  bluetooth_appearance_to_type    (guint16 appearance);
 const gchar   *bluetooth_type_to_string        (guint type);
 gboolean       bluetooth_verify_address        (const char *bdaddr);
 const char    *bluetooth_uuid_to_string        (const char *uuid);
+BluetoothServiceFlags bluetooth_uuids_to_service_flags (const char * const *uuids);
 
 void bluetooth_send_to_address (const char *address,
 				const char *alias);
@@ -0,0 +1,34 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Compiles the PIN database into the format that pin.c maps
+ */
+
+#include "pin-database.h"
+
+int main (int argc, char **argv)
+{
+	g_autoptr(GVariant) data = NULL;
+	g_autoptr(GError) error = NULL;
+
+	if (argc != 3) {
+		g_printerr ("Usage: %s INPUT OUTPUT\n", argv[0]);
+		return 1;
+	}
+
+	data = pin_database_compile (argv[1], &error);
+	if (data == NULL) {
+		g_printerr ("Failed to parse '%s': %s\n", argv[1], error->message);
+		return 1;
+	}
+
+	if (!g_file_set_contents (argv[2],
+				  g_variant_get_data (data),
+				  g_variant_get_size (data),
+				  &error)) {
+		g_printerr ("Failed to write '%s': %s\n", argv[2], error->message);
+		return 1;
+	}
+
+	return 0;
+}
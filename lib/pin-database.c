@@ -0,0 +1,219 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Compiles the PIN database, without depending on the rest of the
+ * library, as pin-compile runs on the build machine
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <bluetooth-enums.h>
+
+#include "pin.h"
+#include "pin-database.h"
+
+#define MAX_DIGITS_PIN_PREFIX "max:"
+
+#define TYPE_IS(x, r) {				\
+	if (g_str_equal(type, x)) return r;	\
+}
+
+static guint string_to_type(const char *type)
+{
+	TYPE_IS ("any", BLUETOOTH_TYPE_ANY);
+	TYPE_IS ("mouse", BLUETOOTH_TYPE_MOUSE);
+	TYPE_IS ("tablet", BLUETOOTH_TYPE_TABLET);
+	TYPE_IS ("keyboard", BLUETOOTH_TYPE_KEYBOARD);
+	TYPE_IS ("headset", BLUETOOTH_TYPE_HEADSET);
+	TYPE_IS ("headphones", BLUETOOTH_TYPE_HEADPHONES);
+	TYPE_IS ("audio", BLUETOOTH_TYPE_OTHER_AUDIO);
+	TYPE_IS ("printer", BLUETOOTH_TYPE_PRINTER);
+	TYPE_IS ("network", BLUETOOTH_TYPE_NETWORK);
+	TYPE_IS ("joypad", BLUETOOTH_TYPE_JOYPAD);
+
+	g_warning ("unhandled type '%s'", type);
+	return BLUETOOTH_TYPE_ANY;
+}
+
+typedef struct {
+	GVariantBuilder rules;
+	guint n_rules;
+	GHashTable *by_oui;
+	GHashTable *by_type;
+	GArray *generic;
+} PinParseData;
+
+static void
+pin_parse_data_index (GHashTable    *index,
+		      gpointer       key,
+		      GDestroyNotify key_free,
+		      guint32        rule_idx)
+{
+	GArray *rules;
+
+	rules = g_hash_table_lookup (index, key);
+	if (rules == NULL) {
+		rules = g_array_new (FALSE, FALSE, sizeof (guint32));
+		g_hash_table_insert (index, key, rules);
+	} else if (key_free != NULL) {
+		key_free (key);
+	}
+	g_array_append_val (rules, rule_idx);
+}
+
+static void
+pin_db_parse_start_tag (GMarkupParseContext *ctx,
+			const gchar         *element_name,
+			const gchar        **attr_names,
+			const gchar        **attr_values,
+			gpointer             data,
+			GError             **error)
+{
+	PinParseData *pdata = (PinParseData *) data;
+	GVariantBuilder matches;
+	const char *oui = NULL;
+	guint type = BLUETOOTH_TYPE_ANY;
+	gboolean after_name = FALSE;
+	gboolean has_pin = FALSE;
+	const char *pin = "";
+	guint max_digits = 0;
+	guint32 rule_idx;
+
+	if (g_str_equal (element_name, "device") == FALSE)
+		return;
+
+	g_variant_builder_init (&matches, G_VARIANT_TYPE ("a(uus)"));
+
+	while (*attr_names && *attr_values) {
+		if (g_str_equal (*attr_names, "type")) {
+			guint match_type;
+
+			match_type = string_to_type (*attr_values);
+			g_variant_builder_add (&matches, "(uus)", PIN_MATCH_TYPE, match_type, "");
+			if (!after_name)
+				type = match_type;
+		} else if (g_str_equal (*attr_names, "oui")) {
+			g_variant_builder_add (&matches, "(uus)", PIN_MATCH_OUI, 0, *attr_values);
+			if (!after_name)
+				oui = *attr_values;
+		} else if (g_str_equal (*attr_names, "vendor")) {
+			g_variant_builder_add (&matches, "(uus)", PIN_MATCH_VENDOR, 0, *attr_values);
+		} else if (g_str_equal (*attr_names, "name")) {
+			g_variant_builder_add (&matches, "(uus)", PIN_MATCH_NAME, 0, *attr_values);
+			after_name = TRUE;
+		} else if (g_str_equal (*attr_names, "pin")) {
+			has_pin = TRUE;
+			if (g_str_has_prefix (*attr_values, MAX_DIGITS_PIN_PREFIX) != FALSE) {
+				max_digits = strtoul (*attr_values + strlen (MAX_DIGITS_PIN_PREFIX), NULL, 0);
+				g_assert (max_digits > 0 && max_digits < PIN_NUM_DIGITS);
+			} else {
+				pin = *attr_values;
+			}
+			break;
+		}
+
+		++attr_names;
+		++attr_values;
+	}
+
+	g_variant_builder_add (&pdata->rules, "(a(uus)bsu)",
+			       &matches, has_pin, pin, max_digits);
+	rule_idx = pdata->n_rules++;
+
+	if (oui != NULL && strlen (oui) >= OUI_KEY_LEN)
+		pin_parse_data_index (pdata->by_oui, g_ascii_strup (oui, OUI_KEY_LEN), g_free, rule_idx);
+	else if (oui == NULL && type != BLUETOOTH_TYPE_ANY)
+		pin_parse_data_index (pdata->by_type, GUINT_TO_POINTER (type), NULL, rule_idx);
+	else
+		g_array_append_val (pdata->generic, rule_idx);
+}
+
+static GVariant *
+rule_list_to_variant (GArray *rules)
+{
+	return g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+					  rules->data, rules->len, sizeof (guint32));
+}
+
+static gint
+compare_oui_keys (gconstpointer a,
+		  gconstpointer b)
+{
+	return strcmp (*(const char **) a, *(const char **) b);
+}
+
+GVariant *
+pin_database_compile (const char  *filename,
+		      GError     **error)
+{
+	GMarkupParseContext *ctx;
+	GMarkupParser parser = { pin_db_parse_start_tag, NULL, NULL, NULL, NULL };
+	PinParseData pdata = { 0, };
+	GVariantBuilder by_oui, by_type;
+	g_autoptr(GPtrArray) keys = NULL;
+	g_autoptr(GVariant) tree = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	GHashTableIter iter;
+	gpointer key, value;
+	char *buf;
+	gsize buf_len;
+	guint i;
+
+	if (!g_file_get_contents (filename, &buf, &buf_len, error))
+		return NULL;
+
+	g_variant_builder_init (&pdata.rules, G_VARIANT_TYPE ("a(a(uus)bsu)"));
+	pdata.by_oui = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      g_free, (GDestroyNotify) g_array_unref);
+	pdata.by_type = g_hash_table_new_full (NULL, NULL,
+					       NULL, (GDestroyNotify) g_array_unref);
+	pdata.generic = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	ctx = g_markup_parse_context_new (&parser, 0, &pdata, NULL);
+
+	if (!g_markup_parse_context_parse (ctx, buf, buf_len, error)) {
+		g_markup_parse_context_free (ctx);
+		g_free (buf);
+		g_variant_builder_clear (&pdata.rules);
+		g_hash_table_destroy (pdata.by_oui);
+		g_hash_table_destroy (pdata.by_type);
+		g_array_unref (pdata.generic);
+		return NULL;
+	}
+
+	g_markup_parse_context_free (ctx);
+	g_free (buf);
+
+	/* Sorted, for lookups to use a binary search */
+	keys = g_ptr_array_new ();
+	g_hash_table_iter_init (&iter, pdata.by_oui);
+	while (g_hash_table_iter_next (&iter, &key, NULL))
+		g_ptr_array_add (keys, key);
+	g_ptr_array_sort (keys, compare_oui_keys);
+
+	g_variant_builder_init (&by_oui, G_VARIANT_TYPE ("a(sau)"));
+	for (i = 0; i < keys->len; i++) {
+		g_variant_builder_add (&by_oui, "(s@au)", keys->pdata[i],
+				       rule_list_to_variant (g_hash_table_lookup (pdata.by_oui, keys->pdata[i])));
+	}
+
+	g_variant_builder_init (&by_type, G_VARIANT_TYPE ("a(uau)"));
+	g_hash_table_iter_init (&iter, pdata.by_type);
+	while (g_hash_table_iter_next (&iter, &key, &value))
+		g_variant_builder_add (&by_type, "(u@au)", GPOINTER_TO_UINT (key), rule_list_to_variant (value));
+
+	tree = g_variant_ref_sink (g_variant_new ("(uta(a(uus)bsu)a(sau)a(uau)@au)",
+						  PIN_DB_VERSION, (guint64) buf_len,
+						  &pdata.rules, &by_oui, &by_type,
+						  rule_list_to_variant (pdata.generic)));
+
+	g_hash_table_destroy (pdata.by_oui);
+	g_hash_table_destroy (pdata.by_type);
+	g_array_unref (pdata.generic);
+
+	/* Serialised, so that it's used exactly like the mapped file */
+	bytes = g_variant_get_data_as_bytes (tree);
+	return g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (PIN_DB_TYPE), bytes, TRUE));
+}
+
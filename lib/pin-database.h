@@ -0,0 +1,41 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * The compiled PIN database, shared between pin.c and the pin-compile
+ * build tool
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef enum {
+	PIN_MATCH_TYPE,
+	PIN_MATCH_OUI,
+	PIN_MATCH_VENDOR,
+	PIN_MATCH_NAME,
+} PinMatchKind;
+
+/* OUIs are indexed on their first 3 octets, eg. "00:13:6C" */
+#define OUI_KEY_LEN 8
+
+/* The compiled database, as written by pin-compile next to the XML
+ * file, or built in memory from the XML file if that's missing or
+ * out of date. Rules are only ever evaluated in document order, but
+ * the indexes avoid looking at the ones that can't match:
+ * - version, and size of the XML file it was compiled from
+ * - rules: a <device> element, with its attributes in document
+ *   order as (kind, type, value), up to and including "pin", as later
+ *   attributes were never looked at, whether it has a pin, the pin
+ *   and the max digits
+ * - rules with an OUI, sorted by OUI key
+ * - rules with a type but no OUI, by type
+ * - all the others, which are checked for every device, along with
+ *   rules where the name comes before the OUI or the type, as
+ *   a matching name has a side-effect on "confirm" */
+#define PIN_DB_VERSION 1
+#define PIN_DB_TYPE "(ut" "a(a(uus)bsu)" "a(sau)" "a(uau)" "au)"
+
+/* Parses the XML database into the compiled form */
+GVariant *pin_database_compile (const char  *filename,
+				GError     **error);
@@ -24,142 +24,484 @@
 #include <stdlib.h>
 #include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libudev.h>
 #include <bluetooth-enums.h>
 #include <bluetooth-utils.h>
 
 #include "pin.h"
+#include "pin-database.h"
 
 #define PIN_CODE_DB "pin-code-database.xml"
-#define MAX_DIGITS_PIN_PREFIX "max:"
+#define PIN_CODE_DB_COMPILED_SUFFIX ".bin"
+
+/* Vendor names are looked up in the udev hwdb, through a single
+ * handle, and cached for the lifetime of the process, including
+ * for OUIs the hwdb doesn't know about. The least recently used
+ * entries are dropped past OUI_CACHE_MAX_SIZE. */
+#define OUI_CACHE_MAX_SIZE 512
+
+typedef struct {
+	guint32 oui;
+	char *vendor;
+	GList link;
+} OuiCacheEntry;
+
+typedef struct {
+	struct udev *udev;
+	struct udev_hwdb *hwdb;
+	GHashTable *entries; /* OUI → OuiCacheEntry */
+	GQueue lru; /* most recently used first */
+	guint hits;
+	guint misses;
+} OuiCache;
+
+G_LOCK_DEFINE_STATIC (oui_cache);
+static OuiCache oui_cache;
+
+static void
+oui_cache_entry_free (OuiCacheEntry *entry)
+{
+	g_free (entry->vendor);
+	g_free (entry);
+}
+
+static gboolean
+parse_oui (const char *address,
+	   guint32    *oui)
+{
+	const int offsets[] = { 0, 1, 3, 4, 6, 7 };
+	guint i;
+
+	if (address == NULL ||
+	    strlen (address) < 8)
+		return FALSE;
+
+	*oui = 0;
+	for (i = 0; i < G_N_ELEMENTS (offsets); i++) {
+		int digit = g_ascii_xdigit_value (address[offsets[i]]);
+		if (digit < 0)
+			return FALSE;
+		*oui = (*oui << 4) | digit;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+oui_cache_open_hwdb (OuiCache *cache)
+{
+	if (cache->hwdb != NULL)
+		return TRUE;
+
+	if (cache->udev == NULL)
+		cache->udev = udev_new ();
+	if (cache->udev == NULL)
+		return FALSE;
+
+	cache->hwdb = udev_hwdb_new (cache->udev);
+	return cache->hwdb != NULL;
+}
+
+static char *
+oui_cache_lookup_hwdb (OuiCache *cache,
+		       guint32   oui)
+{
+	struct udev_list_entry *list, *l;
+	char modalias[sizeof ("OUI:XXXXXX")];
+
+	g_snprintf (modalias, sizeof (modalias), "OUI:%06X", oui);
+	list = udev_hwdb_get_properties_list_entry (cache->hwdb, modalias, 0);
+
+	udev_list_entry_foreach (l, list) {
+		const char *name = udev_list_entry_get_name (l);
+
+		if (g_strcmp0 (name, "ID_OUI_FROM_DATABASE") == 0)
+			return g_strdup (udev_list_entry_get_value (l));
+	}
+
+	return NULL;
+}
 
 char *
 oui_to_vendor (const char *oui)
 {
-	struct udev *udev = NULL;
-	struct udev_hwdb *hwdb = NULL;
-	struct udev_list_entry *list, *l;
-	char *modalias = NULL;
-	char *vendor = NULL;
+	OuiCache *cache = &oui_cache;
+	OuiCacheEntry *entry;
+	guint32 key;
+	char *vendor;
 
-	if (oui == NULL ||
-	    strlen (oui) < 8)
+	if (!parse_oui (oui, &key))
 		return NULL;
 
-	udev = udev_new ();
-	if (udev == NULL)
-		goto bail;
+	G_LOCK (oui_cache);
 
-	hwdb = udev_hwdb_new (udev);
-	if (hwdb == NULL)
-		goto bail;
+	if (cache->entries == NULL)
+		cache->entries = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) oui_cache_entry_free);
 
-	modalias = g_strdup_printf ("OUI:%c%c%c%c%c%c",
-				    g_ascii_toupper (oui[0]),
-				    g_ascii_toupper (oui[1]),
-				    g_ascii_toupper (oui[3]),
-				    g_ascii_toupper (oui[4]),
-				    g_ascii_toupper (oui[6]),
-				    g_ascii_toupper (oui[7]));
+	entry = g_hash_table_lookup (cache->entries, GUINT_TO_POINTER (key));
+	if (entry != NULL) {
+		cache->hits++;
+		g_queue_unlink (&cache->lru, &entry->link);
+		g_queue_push_head_link (&cache->lru, &entry->link);
+		vendor = g_strdup (entry->vendor);
+		G_UNLOCK (oui_cache);
+		return vendor;
+	}
 
-	list = udev_hwdb_get_properties_list_entry (hwdb, modalias, 0);
+	/* Not cached, as the answer might change once udev is available */
+	if (!oui_cache_open_hwdb (cache)) {
+		G_UNLOCK (oui_cache);
+		return NULL;
+	}
 
-	udev_list_entry_foreach (l, list) {
-		const char *name = udev_list_entry_get_name (l);
+	cache->misses++;
 
-		if (g_strcmp0 (name, "ID_OUI_FROM_DATABASE") == 0) {
-			vendor = g_strdup (udev_list_entry_get_value (l));
-			break;
-		}
+	if (g_hash_table_size (cache->entries) >= OUI_CACHE_MAX_SIZE) {
+		GList *last = g_queue_pop_tail_link (&cache->lru);
+		OuiCacheEntry *old = last->data;
+		g_hash_table_remove (cache->entries, GUINT_TO_POINTER (old->oui));
 	}
 
-bail:
-	g_clear_pointer (&modalias, g_free);
-	g_clear_pointer (&hwdb, udev_hwdb_unref);
-	g_clear_pointer (&udev, udev_unref);
+	entry = g_new0 (OuiCacheEntry, 1);
+	entry->oui = key;
+	entry->vendor = oui_cache_lookup_hwdb (cache, key);
+	entry->link.data = entry;
+	g_hash_table_insert (cache->entries, GUINT_TO_POINTER (key), entry);
+	g_queue_push_head_link (&cache->lru, &entry->link);
+	vendor = g_strdup (entry->vendor);
+
+	G_UNLOCK (oui_cache);
 
 	return vendor;
 }
 
-#define TYPE_IS(x, r) {				\
-	if (g_str_equal(type, x)) return r;	\
+void
+oui_to_vendor_get_stats (guint *hits,
+			 guint *misses,
+			 guint *size)
+{
+	G_LOCK (oui_cache);
+	if (hits != NULL)
+		*hits = oui_cache.hits;
+	if (misses != NULL)
+		*misses = oui_cache.misses;
+	if (size != NULL)
+		*size = oui_cache.entries ? g_hash_table_size (oui_cache.entries) : 0;
+	G_UNLOCK (oui_cache);
+}
+
+typedef struct {
+	char *filename;
+	gint64 mtime;
+	goffset size;
+
+	GMappedFile *mapped;
+	GVariant *data;
+	GVariant *rules;
+	GVariant *by_oui;
+	GVariant *by_type;
+	GVariant *generic;
+} PinDatabase;
+
+static PinDatabase *pin_db = NULL;
+
+static void
+pin_database_free (PinDatabase *db)
+{
+	g_free (db->filename);
+	g_clear_pointer (&db->rules, g_variant_unref);
+	g_clear_pointer (&db->by_oui, g_variant_unref);
+	g_clear_pointer (&db->by_type, g_variant_unref);
+	g_clear_pointer (&db->generic, g_variant_unref);
+	g_clear_pointer (&db->data, g_variant_unref);
+	g_clear_pointer (&db->mapped, g_mapped_file_unref);
+	g_free (db);
+}
+
+static PinDatabase *
+pin_database_new (GVariant *data)
+{
+	PinDatabase *db;
+
+	db = g_new0 (PinDatabase, 1);
+	db->data = data;
+	db->rules = g_variant_get_child_value (data, 2);
+	db->by_oui = g_variant_get_child_value (data, 3);
+	db->by_type = g_variant_get_child_value (data, 4);
+	db->generic = g_variant_get_child_value (data, 5);
+
+	return db;
+}
+
+/* Maps the compiled database next to @filename, if it's up-to-date */
+static PinDatabase *
+pin_database_map (const char *filename,
+		  GStatBuf   *st)
+{
+	g_autofree char *compiled = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	GMappedFile *mapped;
+	PinDatabase *db;
+	GVariant *data;
+	GStatBuf compiled_st;
+	guint32 version;
+	guint64 size;
+
+	compiled = g_strconcat (filename, PIN_CODE_DB_COMPILED_SUFFIX, NULL);
+	if (g_stat (compiled, &compiled_st) < 0)
+		return NULL;
+	if (compiled_st.st_mtime < st->st_mtime) {
+		g_debug ("'%s' is older than '%s', ignoring", compiled, filename);
+		return NULL;
+	}
+
+	mapped = g_mapped_file_new (compiled, FALSE, NULL);
+	if (mapped == NULL)
+		return NULL;
+
+	bytes = g_mapped_file_get_bytes (mapped);
+	data = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (PIN_DB_TYPE), bytes, FALSE));
+	g_variant_get_child (data, 0, "u", &version);
+	g_variant_get_child (data, 1, "t", &size);
+	if (version != PIN_DB_VERSION || size != (guint64) st->st_size) {
+		g_debug ("'%s' is out of date, ignoring", compiled);
+		g_variant_unref (data);
+		g_mapped_file_unref (mapped);
+		return NULL;
+	}
+
+	db = pin_database_new (data);
+	db->mapped = mapped;
+
+	g_debug ("Mapped compiled PIN database '%s'", compiled);
+
+	return db;
+}
+
+static PinDatabase *
+pin_database_load (const char *filename,
+		   GStatBuf   *st)
+{
+	PinDatabase *db;
+	GVariant *data;
+	GError *err = NULL;
+
+	db = pin_database_map (filename, st);
+	if (db == NULL) {
+		data = pin_database_compile (filename, &err);
+		if (data == NULL) {
+			g_warning ("Failed to parse '%s': %s\n", PIN_CODE_DB, err->message);
+			g_error_free (err);
+			return NULL;
+		}
+		db = pin_database_new (data);
+	}
+
+	g_debug ("Loaded %" G_GSIZE_FORMAT " PIN rules from '%s'",
+		 g_variant_n_children (db->rules), filename);
+
+	db->filename = g_strdup (filename);
+	db->mtime = st->st_mtime;
+	db->size = st->st_size;
+
+	return db;
 }
 
-static guint string_to_type(const char *type)
+/* Returns the database, (re)loading it if the file changed */
+static PinDatabase *
+pin_database_get (void)
 {
-	TYPE_IS ("any", BLUETOOTH_TYPE_ANY);
-	TYPE_IS ("mouse", BLUETOOTH_TYPE_MOUSE);
-	TYPE_IS ("tablet", BLUETOOTH_TYPE_TABLET);
-	TYPE_IS ("keyboard", BLUETOOTH_TYPE_KEYBOARD);
-	TYPE_IS ("headset", BLUETOOTH_TYPE_HEADSET);
-	TYPE_IS ("headphones", BLUETOOTH_TYPE_HEADPHONES);
-	TYPE_IS ("audio", BLUETOOTH_TYPE_OTHER_AUDIO);
-	TYPE_IS ("printer", BLUETOOTH_TYPE_PRINTER);
-	TYPE_IS ("network", BLUETOOTH_TYPE_NETWORK);
-	TYPE_IS ("joypad", BLUETOOTH_TYPE_JOYPAD);
+	g_autofree char *filename = NULL;
+	GStatBuf st;
+
+	/* A local copy takes precedence, for testing */
+	filename = g_strdup (PIN_CODE_DB);
+	if (g_stat (filename, &st) < 0) {
+		g_free (filename);
+		filename = g_build_filename (PKGDATADIR, PIN_CODE_DB, NULL);
+		if (g_stat (filename, &st) < 0) {
+			g_warning ("Could not load "PIN_CODE_DB);
+			return NULL;
+		}
+	}
+
+	if (pin_db != NULL &&
+	    g_str_equal (pin_db->filename, filename) &&
+	    pin_db->mtime == st.st_mtime &&
+	    pin_db->size == st.st_size)
+		return pin_db;
+
+	g_clear_pointer (&pin_db, pin_database_free);
+	pin_db = pin_database_load (filename, &st);
 
-	g_warning ("unhandled type '%s'", type);
-	return BLUETOOTH_TYPE_ANY;
+	return pin_db;
 }
 
 typedef struct {
-	char *ret_pin;
-	guint max_digits;
 	guint type;
 	const char *address;
 	const char *name;
 	char *vendor;
+	gboolean vendor_looked_up;
 	gboolean confirm;
-} PinParseData;
+} PinLookup;
 
-static void
-pin_db_parse_start_tag (GMarkupParseContext *ctx,
-			const gchar         *element_name,
-			const gchar        **attr_names,
-			const gchar        **attr_values,
-			gpointer             data,
-			GError             **error)
-{
-	PinParseData *pdata = (PinParseData *) data;
-
-	if (pdata->ret_pin != NULL || pdata->max_digits != 0)
-		return;
-	if (g_str_equal (element_name, "device") == FALSE)
-		return;
-
-	while (*attr_names && *attr_values) {
-		if (g_str_equal (*attr_names, "type")) {
-			guint type;
-
-			type = string_to_type (*attr_values);
-			if (type != BLUETOOTH_TYPE_ANY && type != pdata->type)
-				return;
-		} else if (g_str_equal (*attr_names, "oui")) {
-			if (g_str_has_prefix (pdata->address, *attr_values) == FALSE)
-				return;
-		} else if (g_str_equal (*attr_names, "vendor")) {
-			if (*attr_values == NULL || pdata->vendor == NULL)
-				return;
-			if (strstr (pdata->vendor, *attr_values) == NULL)
-				return;
-		} else if (g_str_equal (*attr_names, "name")) {
-			if (*attr_values == NULL || pdata->name == NULL)
-				return;
-			if (strstr (pdata->name, *attr_values) == NULL)
-				return;
-			pdata->confirm = FALSE;
-		} else if (g_str_equal (*attr_names, "pin")) {
-			if (g_str_has_prefix (*attr_values, MAX_DIGITS_PIN_PREFIX) != FALSE) {
-				pdata->max_digits = strtoul (*attr_values + strlen (MAX_DIGITS_PIN_PREFIX), NULL, 0);
-				g_assert (pdata->max_digits > 0 && pdata->max_digits < PIN_NUM_DIGITS);
-			} else {
-				pdata->ret_pin = g_strdup (*attr_values);
+static const char *
+pin_lookup_get_vendor (PinLookup *lookup)
+{
+	char *tmp_vendor;
+
+	if (lookup->vendor_looked_up)
+		return lookup->vendor;
+
+	lookup->vendor_looked_up = TRUE;
+	tmp_vendor = oui_to_vendor (lookup->address);
+	if (tmp_vendor)
+		lookup->vendor = g_ascii_strdown (tmp_vendor, -1);
+	g_free (tmp_vendor);
+
+	return lookup->vendor;
+}
+
+static gboolean
+pin_rule_matches (GVariant  *rule,
+		  PinLookup *lookup)
+{
+	g_autoptr(GVariant) matches = NULL;
+	gboolean has_pin;
+	gsize i, n_matches;
+
+	matches = g_variant_get_child_value (rule, 0);
+	n_matches = g_variant_n_children (matches);
+
+	for (i = 0; i < n_matches; i++) {
+		guint32 kind, type;
+		const char *value, *vendor;
+
+		g_variant_get_child (matches, i, "(uu&s)", &kind, &type, &value);
+
+		switch (kind) {
+		case PIN_MATCH_TYPE:
+			if (type != BLUETOOTH_TYPE_ANY && type != lookup->type)
+				return FALSE;
+			break;
+		case PIN_MATCH_OUI:
+			if (g_str_has_prefix (lookup->address, value) == FALSE)
+				return FALSE;
+			break;
+		case PIN_MATCH_VENDOR:
+			vendor = pin_lookup_get_vendor (lookup);
+			if (vendor == NULL)
+				return FALSE;
+			if (strstr (vendor, value) == NULL)
+				return FALSE;
+			break;
+		case PIN_MATCH_NAME:
+			if (lookup->name == NULL)
+				return FALSE;
+			if (strstr (lookup->name, value) == NULL)
+				return FALSE;
+			lookup->confirm = FALSE;
+			break;
+		default:
+			return FALSE;
+		}
+	}
+
+	g_variant_get_child (rule, 1, "b", &has_pin);
+	return has_pin;
+}
+
+static const guint32 *
+lookup_oui_rules (GVariant   *by_oui,
+		  const char *oui,
+		  gsize      *n_rules)
+{
+	gsize low = 0, high;
+
+	*n_rules = 0;
+	if (oui == NULL)
+		return NULL;
+
+	high = g_variant_n_children (by_oui);
+	while (low < high) {
+		gsize mid = (low + high) / 2;
+		g_autoptr(GVariant) rules = NULL;
+		const char *key;
+		int cmp;
+
+		g_variant_get_child (by_oui, mid, "(&s@au)", &key, &rules);
+		cmp = strcmp (oui, key);
+		if (cmp == 0)
+			return g_variant_get_fixed_array (rules, n_rules, sizeof (guint32));
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return NULL;
+}
+
+static const guint32 *
+lookup_type_rules (GVariant *by_type,
+		   guint     type,
+		   gsize    *n_rules)
+{
+	gsize i, n;
+
+	*n_rules = 0;
+	n = g_variant_n_children (by_type);
+	for (i = 0; i < n; i++) {
+		g_autoptr(GVariant) rules = NULL;
+		guint32 rules_type;
+
+		g_variant_get_child (by_type, i, "(u@au)", &rules_type, &rules);
+		if (rules_type == type)
+			return g_variant_get_fixed_array (rules, n_rules, sizeof (guint32));
+	}
+
+	return NULL;
+}
+
+/* Walks the candidate rules in document order, by merging the
+ * sorted lists of rule indexes that could apply to the device.
+ * The lists point into the database, which outlives the lookup. */
+static GVariant *
+pin_database_lookup (PinDatabase *db,
+		     PinLookup   *lookup)
+{
+	g_autofree char *oui = NULL;
+	const guint32 *lists[3];
+	gsize lens[3];
+	gsize pos[3] = { 0, 0, 0 };
+
+	if (strlen (lookup->address) >= OUI_KEY_LEN)
+		oui = g_ascii_strup (lookup->address, OUI_KEY_LEN);
+	lists[0] = lookup_oui_rules (db->by_oui, oui, &lens[0]);
+	lists[1] = lookup_type_rules (db->by_type, lookup->type, &lens[1]);
+	lists[2] = g_variant_get_fixed_array (db->generic, &lens[2], sizeof (guint32));
+
+	while (TRUE) {
+		GVariant *rule;
+		guint i, min_list = 0;
+		guint32 min_idx = G_MAXUINT32;
+
+		for (i = 0; i < G_N_ELEMENTS (lists); i++) {
+			if (pos[i] < lens[i] && lists[i][pos[i]] < min_idx) {
+				min_idx = lists[i][pos[i]];
+				min_list = i;
 			}
-			return;
 		}
+		if (min_idx == G_MAXUINT32)
+			return NULL;
+		pos[min_list]++;
 
-		++attr_names;
-		++attr_values;
+		rule = g_variant_get_child_value (db->rules, min_idx);
+		if (pin_rule_matches (rule, lookup))
+			return rule;
+		g_variant_unref (rule);
 	}
 }
 
@@ -170,66 +512,46 @@ get_pincode_for_device (guint       type,
 			guint      *max_digits,
 			gboolean   *confirm)
 {
-	GMarkupParseContext *ctx;
-	GMarkupParser parser = { pin_db_parse_start_tag, NULL, NULL, NULL, NULL };
-	PinParseData *data;
-	char *buf;
-	gsize buf_len;
-	GError *err = NULL;
-	char *tmp_vendor, *ret_pin;
+	PinDatabase *db;
+	PinLookup lookup = { 0, };
+	g_autoptr(GVariant) rule = NULL;
+	char *ret_pin = NULL;
+	guint32 ret_max_digits = 0;
 
 	g_return_val_if_fail (address != NULL, NULL);
 
 	g_debug ("Getting pincode for device '%s' (type: %s address: %s)",
 		 name ? name : "", bluetooth_type_to_string (type), address);
 
-	/* Load the PIN database and split it in lines */
-	if (!g_file_get_contents(PIN_CODE_DB, &buf, &buf_len, NULL)) {
-		char *filename;
-
-		filename = g_build_filename(PKGDATADIR, PIN_CODE_DB, NULL);
-		if (!g_file_get_contents(filename, &buf, &buf_len, NULL)) {
-			g_warning("Could not load "PIN_CODE_DB);
-			g_free (filename);
-			return NULL;
-		}
-		g_free (filename);
-	}
-
-	data = g_new0 (PinParseData, 1);
-	data->type = type;
-	data->address = address;
-	data->name = name;
-	data->confirm = TRUE;
+	db = pin_database_get ();
+	if (db == NULL)
+		return NULL;
 
-	tmp_vendor = oui_to_vendor (address);
-	if (tmp_vendor)
-		data->vendor = g_ascii_strdown (tmp_vendor, -1);
-	g_free (tmp_vendor);
+	lookup.type = type;
+	lookup.address = address;
+	lookup.name = name;
+	lookup.confirm = TRUE;
 
-	ctx = g_markup_parse_context_new (&parser, 0, data, NULL);
+	rule = pin_database_lookup (db, &lookup);
+	if (rule != NULL) {
+		const char *pin;
 
-	if (!g_markup_parse_context_parse (ctx, buf, buf_len, &err)) {
-		g_warning ("Failed to parse '%s': %s\n", PIN_CODE_DB, err->message);
-		g_error_free (err);
+		g_variant_get_child (rule, 2, "&s", &pin);
+		g_variant_get_child (rule, 3, "u", &ret_max_digits);
+		if (ret_max_digits == 0)
+			ret_pin = g_strdup (pin);
 	}
 
-	g_markup_parse_context_free (ctx);
-	g_free (buf);
-
 	if (max_digits != NULL)
-		*max_digits = data->max_digits;
+		*max_digits = ret_max_digits;
 	if (confirm != NULL)
-		*confirm = data->confirm;
+		*confirm = lookup.confirm;
 
 	g_debug ("Got pin '%s' (max digits: %d, confirm: %d) for device '%s' (type: %s address: %s, vendor: %s)",
-		 data->ret_pin, data->max_digits, data->confirm,
-		 name ? name : "", bluetooth_type_to_string (type), address, data->vendor);
+		 ret_pin, ret_max_digits, lookup.confirm,
+		 name ? name : "", bluetooth_type_to_string (type), address, lookup.vendor);
 
-	g_free (data->vendor);
-	ret_pin = data->ret_pin;
-	g_free (data);
+	g_free (lookup.vendor);
 
 	return ret_pin;
 }
-
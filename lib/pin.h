@@ -28,6 +28,9 @@
 #define PIN_NUM_DIGITS 6
 
 char *oui_to_vendor (const char *oui);
+void oui_to_vendor_get_stats (guint *hits,
+			      guint *misses,
+			      guint *size);
 char *get_pincode_for_device (guint       type,
 			      const char *address,
 			      const char *name,
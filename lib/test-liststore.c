@@ -42,7 +42,7 @@ int main (int argc, char **argv)
 {
 	GtkWidget *window;
 	GtkWidget *listbox;
-	GListStore *model;
+	g_autoptr(GListModel) model = NULL;
 	g_autoptr(BluetoothClient) client = NULL;
 
 	gtk_init();
@@ -56,7 +56,7 @@ int main (int argc, char **argv)
 	client = bluetooth_client_new ();
 	model = bluetooth_client_get_devices (client);
 	listbox = gtk_list_box_new ();
-	gtk_list_box_bind_model (GTK_LIST_BOX (listbox), G_LIST_MODEL (model), create_device_cb, NULL, NULL);
+	gtk_list_box_bind_model (GTK_LIST_BOX (listbox), model, create_device_cb, NULL, NULL);
 	gtk_window_set_child (GTK_WINDOW (window), listbox);
 	gtk_widget_show (window);
 
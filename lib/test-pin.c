@@ -6,6 +6,8 @@ int main (int argc, char **argv)
 	guint max_digits;
 	gboolean confirm;
 	char *pin;
+	char *vendor;
+	guint hits, misses;
 
 	g_setenv ("G_MESSAGES_DEBUG", "all", TRUE);
 
@@ -25,5 +27,13 @@ int main (int argc, char **argv)
 	g_message ("pin: %s max digits: %d confirm: %d",
 		   pin, max_digits, confirm);
 
+	/* The second lookup should be served from the cache */
+	g_free (oui_to_vendor ("0C:77:1A:00:00:00"));
+	vendor = oui_to_vendor ("0C:77:1A:00:00:00");
+	oui_to_vendor_get_stats (&hits, &misses, NULL);
+	g_message ("vendor: %s cache hits: %u misses: %u",
+		   vendor, hits, misses);
+	g_free (vendor);
+
 	return 0;
 }
@@ -36,6 +36,8 @@
 #include <bluetooth-client.h>
 #include <bluetooth-device.h>
 
+#include "bluetooth-trace.h"
+
 #define OBEX_SERVICE	"org.bluez.obex"
 #define OBEX_PATH	"/org/bluez/obex"
 #define TRANSFER_IFACE	"org.bluez.obex.Transfer1"
@@ -70,6 +72,10 @@ static int file_index = 0;
 static gint64 first_update = 0;
 static gint64 last_update = 0;
 
+/* Monotonic times, for tracing */
+static gint64 setup_begin_time = 0;
+static gint64 transfer_begin_time = 0;
+
 static void on_transfer_properties (GVariant *props);
 static void on_transfer_progress (guint64 transferred);
 static void on_transfer_complete (void);
@@ -220,10 +226,16 @@ transfer_created (GDBusProxy *proxy, GAsyncResult *res, gpointer user_data)
 			return;
 		}
 
+		_bluetooth_trace_mark (setup_begin_time, "Transfer setup", "file %d of %d (failure)",
+				       file_index + 1, file_count);
 		handle_error (error);
 		return;
 	}
 
+	_bluetooth_trace_mark (setup_begin_time, "Transfer setup", "file %d of %d",
+			       file_index + 1, file_count);
+	transfer_begin_time = g_get_monotonic_time ();
+
 	gtk_progress_bar_set_text (GTK_PROGRESS_BAR (progress), NULL);
 
 	first_update = get_system_time ();
@@ -322,6 +334,9 @@ send_files (void)
 	GVariant *parameters;
 	GVariantBuilder *builder;
 
+	/* The first transfer includes the session creation */
+	setup_begin_time = g_get_monotonic_time ();
+
 	builder = g_variant_builder_new (G_VARIANT_TYPE_DICTIONARY);
 	g_variant_builder_add (builder, "{sv}", "Target",
 						g_variant_new_string ("opp"));
@@ -518,31 +533,42 @@ static void create_window(void)
 	gtk_window_present(GTK_WINDOW(dialog));
 }
 
+static void
+client_new_cb (GObject      *source_object,
+	       GAsyncResult *res,
+	       gpointer      user_data)
+{
+	GAsyncResult **result = user_data;
+
+	*result = g_object_ref (res);
+}
+
 static char *
 get_device_name (const char *address)
 {
 	g_autoptr(BluetoothClient) client = NULL;
-	g_autoptr(GListStore) model = NULL;
-	guint n_devices, i;
-
-	model = bluetooth_client_get_devices (client);
-	n_devices = g_list_model_get_n_items (G_LIST_MODEL (model));
-	for (i = 0; i < n_devices; i++) {
-		g_autoptr(BluetoothDevice) device = NULL;
-		g_autofree char *name = NULL;
-		g_autofree char *_address = NULL;
-
-		g_object_get (device,
-			      "name", &name,
-			      "address", &_address,
-			      NULL);
-		if (g_strcmp0 (address, _address) != 0)
-			continue;
+	g_autoptr(BluetoothDevice) device = NULL;
+	g_autoptr(GAsyncResult) result = NULL;
+	g_autoptr(GError) error = NULL;
+	char *name = NULL;
+
+	/* The devices are only known once the client is ready */
+	bluetooth_client_new_async (NULL, client_new_cb, &result);
+	while (result == NULL)
+		g_main_context_iteration (NULL, TRUE);
 
-		return g_steal_pointer (&name);
+	client = bluetooth_client_new_finish (result, &error);
+	if (client == NULL) {
+		g_debug ("Could not get the list of devices: %s", error->message);
+		return NULL;
 	}
 
-	return NULL;
+	device = bluetooth_client_get_device_by_address (client, address);
+	if (device == NULL)
+		return NULL;
+
+	g_object_get (device, "name", &name, NULL);
+	return name;
 }
 
 static void
@@ -628,6 +654,9 @@ on_transfer_progress (guint64 transferred)
 static void
 on_transfer_complete (void)
 {
+	_bluetooth_trace_mark (transfer_begin_time, "Transfer", "file %d of %d, %" G_GUINT64_FORMAT " bytes",
+			       file_index + 1, file_count, current_size);
+
 	total_sent += current_size;
 
 	file_index++;
@@ -653,6 +682,7 @@ on_transfer_complete (void)
 		button = gtk_dialog_get_widget_for_response(GTK_DIALOG (dialog), GTK_RESPONSE_CANCEL);
 		gtk_button_set_label (GTK_BUTTON (button), _("_Close"));
 	} else {
+		setup_begin_time = g_get_monotonic_time ();
 		send_next_file ();
 	}
 }
@@ -660,6 +690,9 @@ on_transfer_complete (void)
 static void
 on_transfer_error (void)
 {
+	_bluetooth_trace_mark (transfer_begin_time, "Transfer", "file %d of %d (failure)",
+			       file_index + 1, file_count);
+
 	gtk_widget_show (image_status);
 	gtk_label_set_markup (GTK_LABEL (label_status), _("There was an error"));
 
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2021 Bastien Nocera <hadess@hadess.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Replays the events recorded by a BluetoothClient running with
+ * BLUETOOTH_RECORD_EVENTS set in the environment, through a fake
+ * bluez in the same process, so that the client can be profiled with
+ * the workload of the recording:
+ *
+ *   BLUETOOTH_RECORD_EVENTS=events.txt gnome-control-center bluetooth
+ *   bluetooth-replay [--real-time] events.txt
+ */
+
+#include <locale.h>
+#include <glib.h>
+
+#include "bluetooth-client.h"
+#include "bluetooth-client-private.h"
+#include "fake-bluez.h"
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+	gboolean *done = user_data;
+
+	*done = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+/* Keeps the main loop running until @deadline */
+static void
+wait_until (gint64 deadline)
+{
+	gint64 now = g_get_monotonic_time ();
+	gboolean done = FALSE;
+
+	if (deadline <= now)
+		return;
+
+	g_timeout_add ((deadline - now) / 1000, timeout_cb, &done);
+	while (!done)
+		g_main_context_iteration (NULL, TRUE);
+}
+
+int main (int argc, char **argv)
+{
+	g_autoptr(GOptionContext) context = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) events = NULL;
+	g_autoptr(FakeBluez) bluez = NULL;
+	g_autoptr(BluetoothClient) client = NULL;
+	g_autoptr(GListModel) model = NULL;
+	gboolean real_time = FALSE;
+	gboolean ready = FALSE;
+	guint i, num_coldplug = 0, num_ignored = 0;
+	gint64 start, ready_time;
+	const GOptionEntry options[] = {
+		{ "real-time", 'r', 0, G_OPTION_ARG_NONE, &real_time, "Replay events at the time they were recorded", NULL },
+		{ NULL }
+	};
+
+	setlocale (LC_ALL, "");
+
+	context = g_option_context_new ("FILE - replay BluetoothClient events");
+	g_option_context_add_main_entries (context, options, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return 1;
+	}
+	if (argc != 2) {
+		g_printerr ("Usage: %s [--real-time] FILE\n", argv[0]);
+		return 1;
+	}
+
+	events = fake_bluez_load_events (argv[1], &error);
+	if (events == NULL) {
+		g_printerr ("Could not load events from '%s': %s\n", argv[1], error->message);
+		return 1;
+	}
+
+	/* The objects present before the client was created */
+	bluez = fake_bluez_new ();
+	for (i = 0; i < events->len; i++) {
+		GVariant *event = g_ptr_array_index (events, i);
+		const char *type;
+
+		g_variant_get_child (event, 1, "&s", &type);
+		if (!g_str_equal (type, "coldplug"))
+			break;
+		if (!fake_bluez_replay_event (bluez, event))
+			num_ignored++;
+		num_coldplug++;
+	}
+
+	start = g_get_monotonic_time ();
+	client = bluetooth_client_new_for_connection (fake_bluez_get_connection (bluez));
+	model = bluetooth_client_get_devices (client);
+	while (!ready) {
+		g_main_context_iteration (NULL, TRUE);
+		g_object_get (G_OBJECT (client), "ready", &ready, NULL);
+	}
+	ready_time = g_get_monotonic_time ();
+
+	for (; i < events->len; i++) {
+		GVariant *event = g_ptr_array_index (events, i);
+		gint64 timestamp;
+
+		if (real_time) {
+			g_variant_get_child (event, 0, "x", &timestamp);
+			wait_until (start + timestamp);
+		}
+
+		if (!fake_bluez_replay_event (bluez, event))
+			num_ignored++;
+		while (g_main_context_iteration (NULL, FALSE))
+			;
+	}
+	fake_bluez_sync (bluez);
+
+	g_print ("Replayed %u events (%u coldplug, %u ignored)\n",
+		 events->len, num_coldplug, num_ignored);
+	g_print ("Ready after %.3f ms\n", (ready_time - start) / 1000.0);
+	g_print ("Done after %.3f ms\n", (g_get_monotonic_time () - start) / 1000.0);
+	g_print ("%u devices in the model\n", g_list_model_get_n_items (model));
+
+	return 0;
+}
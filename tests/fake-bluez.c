@@ -0,0 +1,620 @@
+/*
+ * Copyright (C) 2021 Bastien Nocera <hadess@hadess.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "fake-bluez.h"
+
+#define BLUEZ_MANAGER_PATH		"/"
+#define BLUEZ_ADAPTER_INTERFACE		"org.bluez.Adapter1"
+#define BLUEZ_DEVICE_INTERFACE		"org.bluez.Device1"
+
+struct _FakeBluez {
+	GDBusConnection *server;
+	GDBusConnection *client;
+	GDBusObjectManagerServer *manager;
+};
+
+static char *
+adapter_path (const char *name)
+{
+	return g_strdup_printf ("/org/bluez/%s", name);
+}
+
+static char *
+device_path (const char *adapter,
+	     const char *address)
+{
+	g_autofree char *escaped = NULL;
+
+	escaped = g_strdelimit (g_strdup (address), ":", '_');
+	return g_strdup_printf ("/org/bluez/%s/dev_%s", adapter, escaped);
+}
+
+static gboolean
+handle_start_discovery (FakeAdapter1          *adapter,
+			GDBusMethodInvocation *invocation,
+			gpointer               user_data)
+{
+	fake_adapter1_set_discovering (adapter, TRUE);
+	fake_adapter1_complete_start_discovery (adapter, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_stop_discovery (FakeAdapter1          *adapter,
+		       GDBusMethodInvocation *invocation,
+		       gpointer               user_data)
+{
+	fake_adapter1_set_discovering (adapter, FALSE);
+	fake_adapter1_complete_stop_discovery (adapter, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_set_discovery_filter (FakeAdapter1          *adapter,
+			     GDBusMethodInvocation *invocation,
+			     GVariant              *filter,
+			     gpointer               user_data)
+{
+	g_object_set_data_full (G_OBJECT (adapter), "discovery-filter",
+				g_variant_ref (filter), (GDestroyNotify) g_variant_unref);
+	fake_adapter1_complete_set_discovery_filter (adapter, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_remove_device (FakeAdapter1          *adapter,
+		      GDBusMethodInvocation *invocation,
+		      const char            *path,
+		      gpointer               user_data)
+{
+	FakeBluez *bluez = user_data;
+
+	if (!g_dbus_object_manager_server_unexport (bluez->manager, path)) {
+		g_dbus_method_invocation_return_dbus_error (invocation,
+							    "org.bluez.Error.DoesNotExist",
+							    "Does Not Exist");
+		return TRUE;
+	}
+
+	fake_adapter1_complete_remove_device (adapter, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_pair (FakeDevice1           *device,
+	     GDBusMethodInvocation *invocation,
+	     gpointer               user_data)
+{
+	fake_device1_set_paired (device, TRUE);
+	fake_device1_complete_pair (device, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_cancel_pairing (FakeDevice1           *device,
+		       GDBusMethodInvocation *invocation,
+		       gpointer               user_data)
+{
+	fake_device1_complete_cancel_pairing (device, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_connect (FakeDevice1           *device,
+		GDBusMethodInvocation *invocation,
+		gpointer               user_data)
+{
+	fake_device1_set_connected (device, TRUE);
+	fake_device1_complete_connect (device, invocation);
+	return TRUE;
+}
+
+static gboolean
+handle_disconnect (FakeDevice1           *device,
+		   GDBusMethodInvocation *invocation,
+		   gpointer               user_data)
+{
+	fake_device1_set_connected (device, FALSE);
+	fake_device1_complete_disconnect (device, invocation);
+	return TRUE;
+}
+
+static FakeAdapter1 *
+adapter_skeleton_new (FakeBluez *bluez)
+{
+	FakeAdapter1 *adapter;
+
+	adapter = fake_adapter1_skeleton_new ();
+	g_signal_connect (adapter, "handle-start-discovery",
+			  G_CALLBACK (handle_start_discovery), bluez);
+	g_signal_connect (adapter, "handle-stop-discovery",
+			  G_CALLBACK (handle_stop_discovery), bluez);
+	g_signal_connect (adapter, "handle-set-discovery-filter",
+			  G_CALLBACK (handle_set_discovery_filter), bluez);
+	g_signal_connect (adapter, "handle-remove-device",
+			  G_CALLBACK (handle_remove_device), bluez);
+
+	return adapter;
+}
+
+static FakeDevice1 *
+device_skeleton_new (FakeBluez *bluez)
+{
+	FakeDevice1 *device;
+
+	device = fake_device1_skeleton_new ();
+	g_signal_connect (device, "handle-pair",
+			  G_CALLBACK (handle_pair), bluez);
+	g_signal_connect (device, "handle-cancel-pairing",
+			  G_CALLBACK (handle_cancel_pairing), bluez);
+	g_signal_connect (device, "handle-connect",
+			  G_CALLBACK (handle_connect), bluez);
+	g_signal_connect (device, "handle-disconnect",
+			  G_CALLBACK (handle_disconnect), bluez);
+
+	return device;
+}
+
+/**
+ * fake_bluez_add_adapter:
+ * @bluez: a #FakeBluez
+ * @name: the name of the adapter, such as "hci0"
+ * @address: the Bluetooth address of the adapter
+ *
+ * Exports a powered adapter at /org/bluez/@name. The last filter
+ * passed to SetDiscoveryFilter() is kept as its "discovery-filter" data.
+ *
+ * Returns: (transfer none): the adapter's interface skeleton, to
+ * change its properties
+ */
+FakeAdapter1 *
+fake_bluez_add_adapter (FakeBluez  *bluez,
+			const char *name,
+			const char *address)
+{
+	g_autofree char *path = NULL;
+	g_autoptr(GDBusObjectSkeleton) object = NULL;
+	g_autoptr(FakeAdapter1) adapter = NULL;
+	const char *uuids[] = { NULL };
+
+	path = adapter_path (name);
+	object = g_dbus_object_skeleton_new (path);
+	adapter = adapter_skeleton_new (bluez);
+	g_object_set (adapter,
+		      "address", address,
+		      "name", name,
+		      "alias", name,
+		      "powered", TRUE,
+		      "pairable", TRUE,
+		      "uuids", uuids,
+		      "modalias", "",
+		      NULL);
+
+	g_dbus_object_skeleton_add_interface (object, G_DBUS_INTERFACE_SKELETON (adapter));
+	g_dbus_object_manager_server_export (bluez->manager, object);
+
+	return adapter;
+}
+
+/**
+ * fake_bluez_remove_adapter:
+ * @bluez: a #FakeBluez
+ * @name: the name of the adapter, such as "hci0"
+ *
+ * Removes the adapter and its devices, devices first, like bluetoothd.
+ */
+void
+fake_bluez_remove_adapter (FakeBluez  *bluez,
+			   const char *name)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *prefix = NULL;
+	GList *objects, *l;
+
+	path = adapter_path (name);
+	prefix = g_strconcat (path, "/", NULL);
+
+	objects = g_dbus_object_manager_get_objects (G_DBUS_OBJECT_MANAGER (bluez->manager));
+	for (l = objects; l != NULL; l = l->next) {
+		const char *object_path = g_dbus_object_get_object_path (l->data);
+
+		if (g_str_has_prefix (object_path, prefix))
+			g_dbus_object_manager_server_unexport (bluez->manager, object_path);
+	}
+	g_list_free_full (objects, g_object_unref);
+
+	g_dbus_object_manager_server_unexport (bluez->manager, path);
+}
+
+/**
+ * fake_bluez_add_device:
+ * @bluez: a #FakeBluez
+ * @adapter: the name of the adapter, such as "hci0"
+ * @address: the Bluetooth address of the device
+ * @alias: the name of the device
+ *
+ * Exports an unpaired and disconnected device on @adapter.
+ *
+ * Returns: (transfer none): the device's interface skeleton, to
+ * change its properties
+ */
+FakeDevice1 *
+fake_bluez_add_device (FakeBluez  *bluez,
+		       const char *adapter,
+		       const char *address,
+		       const char *alias)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *parent = NULL;
+	g_autoptr(GDBusObjectSkeleton) object = NULL;
+	g_autoptr(FakeDevice1) device = NULL;
+	const char *uuids[] = { NULL };
+
+	path = device_path (adapter, address);
+	parent = adapter_path (adapter);
+	object = g_dbus_object_skeleton_new (path);
+	device = device_skeleton_new (bluez);
+	g_object_set (device,
+		      "address", address,
+		      "name", alias,
+		      "alias", alias,
+		      "icon", "",
+		      "uuids", uuids,
+		      "modalias", "",
+		      "adapter", parent,
+		      NULL);
+
+	g_dbus_object_skeleton_add_interface (object, G_DBUS_INTERFACE_SKELETON (device));
+	g_dbus_object_manager_server_export (bluez->manager, object);
+
+	return device;
+}
+
+void
+fake_bluez_remove_device (FakeBluez  *bluez,
+			  const char *path)
+{
+	g_dbus_object_manager_server_unexport (bluez->manager, path);
+}
+
+/* The GObject property name gdbus-codegen uses for a D-Bus property,
+ * such as "legacy-pairing" for "LegacyPairing", or "uuids" for "UUIDs" */
+static char *
+property_name_from_dbus (const char *name)
+{
+	GString *str;
+	gboolean prev_was_lower = FALSE;
+
+	str = g_string_new (NULL);
+	for (; *name != '\0'; name++) {
+		if (g_ascii_isupper (*name)) {
+			if (prev_was_lower)
+				g_string_append_c (str, '-');
+			prev_was_lower = FALSE;
+		} else {
+			prev_was_lower = TRUE;
+		}
+		g_string_append_c (str, g_ascii_tolower (*name));
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+static void
+set_properties (GDBusInterfaceSkeleton *skeleton,
+		GVariant               *properties)
+{
+	GVariantIter iter;
+	const char *name;
+	GVariant *value;
+
+	g_variant_iter_init (&iter, properties);
+	while (g_variant_iter_loop (&iter, "{&sv}", &name, &value)) {
+		g_autofree char *property = NULL;
+		g_auto(GValue) gvalue = G_VALUE_INIT;
+
+		/* Properties from newer versions of bluez */
+		property = property_name_from_dbus (name);
+		if (g_object_class_find_property (G_OBJECT_GET_CLASS (skeleton), property) == NULL)
+			continue;
+
+		g_dbus_gvariant_to_gvalue (value, &gvalue);
+		g_object_set_property (G_OBJECT (skeleton), property, &gvalue);
+	}
+}
+
+/* Back to their default values, as the proxies on the other end
+ * would see invalidated properties as unset */
+static void
+reset_properties (GDBusInterfaceSkeleton  *skeleton,
+		  const char             **names)
+{
+	guint i;
+
+	for (i = 0; names[i] != NULL; i++) {
+		g_autofree char *property = NULL;
+		g_auto(GValue) gvalue = G_VALUE_INIT;
+		GParamSpec *pspec;
+
+		property = property_name_from_dbus (names[i]);
+		pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (skeleton), property);
+		if (pspec == NULL)
+			continue;
+
+		g_value_init (&gvalue, G_PARAM_SPEC_VALUE_TYPE (pspec));
+		g_param_value_set_default (pspec, &gvalue);
+		g_object_set_property (G_OBJECT (skeleton), property, &gvalue);
+	}
+}
+
+static gboolean
+add_interface (FakeBluez  *bluez,
+	       const char *path,
+	       const char *interface,
+	       GVariant   *properties)
+{
+	g_autoptr(GDBusObject) object = NULL;
+	g_autoptr(GDBusInterface) existing = NULL;
+	g_autoptr(GDBusInterfaceSkeleton) skeleton = NULL;
+
+	existing = g_dbus_object_manager_get_interface (G_DBUS_OBJECT_MANAGER (bluez->manager),
+							path, interface);
+	if (existing != NULL) {
+		set_properties (G_DBUS_INTERFACE_SKELETON (existing), properties);
+		return TRUE;
+	}
+
+	if (g_str_equal (interface, BLUEZ_ADAPTER_INTERFACE))
+		skeleton = G_DBUS_INTERFACE_SKELETON (adapter_skeleton_new (bluez));
+	else if (g_str_equal (interface, BLUEZ_DEVICE_INTERFACE))
+		skeleton = G_DBUS_INTERFACE_SKELETON (device_skeleton_new (bluez));
+	else
+		return FALSE;
+	set_properties (skeleton, properties);
+
+	object = g_dbus_object_manager_get_object (G_DBUS_OBJECT_MANAGER (bluez->manager), path);
+	if (object != NULL) {
+		g_dbus_object_skeleton_add_interface (G_DBUS_OBJECT_SKELETON (object), skeleton);
+	} else {
+		object = G_DBUS_OBJECT (g_dbus_object_skeleton_new (path));
+		g_dbus_object_skeleton_add_interface (G_DBUS_OBJECT_SKELETON (object), skeleton);
+		g_dbus_object_manager_server_export (bluez->manager, G_DBUS_OBJECT_SKELETON (object));
+	}
+
+	return TRUE;
+}
+
+static gboolean
+remove_interface (FakeBluez  *bluez,
+		  const char *path,
+		  const char *interface)
+{
+	g_autoptr(GDBusObject) object = NULL;
+	GList *interfaces;
+	guint num_interfaces;
+
+	object = g_dbus_object_manager_get_object (G_DBUS_OBJECT_MANAGER (bluez->manager), path);
+	if (object == NULL)
+		return FALSE;
+
+	interfaces = g_dbus_object_get_interfaces (object);
+	num_interfaces = g_list_length (interfaces);
+	g_list_free_full (interfaces, g_object_unref);
+
+	if (num_interfaces <= 1)
+		return g_dbus_object_manager_server_unexport (bluez->manager, path);
+
+	g_dbus_object_skeleton_remove_interface_by_name (G_DBUS_OBJECT_SKELETON (object), interface);
+	return TRUE;
+}
+
+/**
+ * fake_bluez_load_events:
+ * @filename: a file recorded with BLUETOOTH_RECORD_EVENTS set
+ * @error: return location for a #GError, or %NULL
+ *
+ * Loads the events recorded by a #BluetoothClient, see
+ * fake_bluez_replay_event().
+ *
+ * Returns: (transfer full) (element-type GVariant): the events, or
+ * %NULL on error
+ */
+GPtrArray *
+fake_bluez_load_events (const char  *filename,
+			GError     **error)
+{
+	g_autoptr(GPtrArray) events = NULL;
+	g_autofree char *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint i;
+
+	if (!g_file_get_contents (filename, &contents, NULL, error))
+		return NULL;
+
+	events = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		GVariant *event;
+
+		if (*lines[i] == '\0')
+			continue;
+
+		event = g_variant_parse (G_VARIANT_TYPE (FAKE_BLUEZ_EVENT_TYPE), lines[i],
+					 NULL, NULL, error);
+		if (event == NULL) {
+			g_prefix_error (error, "Line %u: ", i + 1);
+			return NULL;
+		}
+		g_ptr_array_add (events, g_variant_ref_sink (event));
+	}
+
+	return g_steal_pointer (&events);
+}
+
+/**
+ * fake_bluez_replay_event:
+ * @bluez: a #FakeBluez
+ * @event: a #GVariant of type %FAKE_BLUEZ_EVENT_TYPE
+ *
+ * Adds, changes or removes the adapter or device interface in @event,
+ * whatever its time stamp. Invalidated properties are reset to their
+ * default values.
+ *
+ * Returns: %TRUE if the event could be applied
+ */
+gboolean
+fake_bluez_replay_event (FakeBluez *bluez,
+			 GVariant  *event)
+{
+	g_autoptr(GVariant) properties = NULL;
+	g_autofree const char **invalidated = NULL;
+	const char *type, *path, *interface;
+
+	g_variant_get (event, "(x&s&s&s@a{sv}^a&s)", NULL, &type, &path, &interface,
+		       &properties, &invalidated);
+
+	if (g_str_equal (type, "coldplug") ||
+	    g_str_equal (type, "added"))
+		return add_interface (bluez, path, interface, properties);
+	if (g_str_equal (type, "changed")) {
+		g_autoptr(GDBusInterface) skeleton = NULL;
+
+		skeleton = g_dbus_object_manager_get_interface (G_DBUS_OBJECT_MANAGER (bluez->manager),
+								path, interface);
+		if (skeleton == NULL)
+			return FALSE;
+		set_properties (G_DBUS_INTERFACE_SKELETON (skeleton), properties);
+		reset_properties (G_DBUS_INTERFACE_SKELETON (skeleton), invalidated);
+		return TRUE;
+	}
+	if (g_str_equal (type, "removed"))
+		return remove_interface (bluez, path, interface);
+
+	return FALSE;
+}
+
+/**
+ * fake_bluez_sync:
+ * @bluez: a #FakeBluez
+ *
+ * Sends pending signals, and waits for the other end of the
+ * connection to have processed them.
+ */
+void
+fake_bluez_sync (FakeBluez *bluez)
+{
+	g_autoptr(GVariant) ret = NULL;
+
+	/* Property changes are emitted from an idle */
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+
+	/* The reply comes after the signals sent before it... */
+	ret = g_dbus_connection_call_sync (bluez->client, NULL, "/",
+					   "org.freedesktop.DBus.Peer", "Ping",
+					   NULL, NULL, G_DBUS_CALL_FLAGS_NONE,
+					   -1, NULL, NULL);
+
+	/* ...which are now ready to be dispatched */
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+}
+
+static void
+connection_new_cb (GObject      *source_object,
+		   GAsyncResult *res,
+		   gpointer      user_data)
+{
+	GDBusConnection **connection = user_data;
+	g_autoptr(GError) error = NULL;
+
+	*connection = g_dbus_connection_new_finish (res, &error);
+	g_assert_no_error (error);
+}
+
+static GIOStream *
+stream_new_from_fd (int fd)
+{
+	g_autoptr(GSocket) socket = NULL;
+	g_autoptr(GError) error = NULL;
+
+	socket = g_socket_new_from_fd (fd, &error);
+	g_assert_no_error (error);
+
+	return G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+}
+
+/**
+ * fake_bluez_new:
+ *
+ * Creates a fake bluetoothd without any adapters, running in the
+ * thread-default main context. Its objects are available to the
+ * connection returned by fake_bluez_get_connection().
+ *
+ * Returns: (transfer full): a new #FakeBluez
+ */
+FakeBluez *
+fake_bluez_new (void)
+{
+	FakeBluez *bluez;
+	g_autoptr(GIOStream) server_stream = NULL;
+	g_autoptr(GIOStream) client_stream = NULL;
+	g_autofree char *guid = NULL;
+	int fds[2];
+
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		g_error ("Could not create socket pair: %s", g_strerror (errno));
+
+	server_stream = stream_new_from_fd (fds[0]);
+	client_stream = stream_new_from_fd (fds[1]);
+
+	bluez = g_new0 (FakeBluez, 1);
+
+	/* Both ends need to authenticate at the same time */
+	guid = g_dbus_generate_guid ();
+	g_dbus_connection_new (server_stream, guid,
+			       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+			       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_ALLOW_ANONYMOUS,
+			       NULL, NULL, connection_new_cb, &bluez->server);
+	g_dbus_connection_new (client_stream, NULL,
+			       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+			       NULL, NULL, connection_new_cb, &bluez->client);
+	while (bluez->server == NULL || bluez->client == NULL)
+		g_main_context_iteration (NULL, TRUE);
+
+	bluez->manager = g_dbus_object_manager_server_new (BLUEZ_MANAGER_PATH);
+	g_dbus_object_manager_server_set_connection (bluez->manager, bluez->server);
+
+	return bluez;
+}
+
+void
+fake_bluez_free (FakeBluez *bluez)
+{
+	g_dbus_object_manager_server_set_connection (bluez->manager, NULL);
+	g_clear_object (&bluez->manager);
+	g_dbus_connection_close_sync (bluez->client, NULL, NULL);
+	g_clear_object (&bluez->client);
+	g_dbus_connection_close_sync (bluez->server, NULL, NULL);
+	g_clear_object (&bluez->server);
+	g_free (bluez);
+}
+
+/**
+ * fake_bluez_get_connection:
+ * @bluez: a #FakeBluez
+ *
+ * Returns: (transfer none): the connection to pass to
+ * bluetooth_client_new_for_connection()
+ */
+GDBusConnection *
+fake_bluez_get_connection (FakeBluez *bluez)
+{
+	return bluez->client;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2021 Bastien Nocera <hadess@hadess.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "fake-bluez-glue.h"
+
+/* A minimal in-process bluetoothd, exporting org.bluez adapters and
+ * devices on one end of a peer-to-peer D-Bus connection */
+typedef struct _FakeBluez FakeBluez;
+
+FakeBluez       *fake_bluez_new            (void);
+void             fake_bluez_free           (FakeBluez  *bluez);
+GDBusConnection *fake_bluez_get_connection (FakeBluez  *bluez);
+
+FakeAdapter1    *fake_bluez_add_adapter    (FakeBluez  *bluez,
+					    const char *name,
+					    const char *address);
+void             fake_bluez_remove_adapter (FakeBluez  *bluez,
+					    const char *name);
+FakeDevice1     *fake_bluez_add_device     (FakeBluez  *bluez,
+					    const char *adapter,
+					    const char *address,
+					    const char *alias);
+void             fake_bluez_remove_device  (FakeBluez  *bluez,
+					    const char *path);
+void             fake_bluez_sync           (FakeBluez  *bluez);
+
+/* Events recorded by BluetoothClient, see record_event() */
+#define FAKE_BLUEZ_EVENT_TYPE "(xsssa{sv}as)"
+
+GPtrArray       *fake_bluez_load_events    (const char  *filename,
+					    GError     **error);
+gboolean         fake_bluez_replay_event   (FakeBluez   *bluez,
+					    GVariant    *event);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FakeBluez, fake_bluez_free)
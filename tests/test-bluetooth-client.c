@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2021 Bastien Nocera <hadess@hadess.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "bluetooth-client.h"
+#include "bluetooth-client-private.h"
+#include "bluetooth-device.h"
+#include "fake-bluez.h"
+
+#define NUM_PERF_DEVICES 10000
+
+#define wait_for_condition(condition)			\
+	G_STMT_START {					\
+		while (!(condition))			\
+			g_main_context_iteration (NULL, TRUE);	\
+	} G_STMT_END
+
+typedef struct {
+	FakeBluez *bluez;
+	FakeAdapter1 *adapter;
+	BluetoothClient *client;
+	GListModel *model;
+} Fixture;
+
+static void
+fixture_setup (Fixture       *fixture,
+	       gconstpointer  user_data)
+{
+	fixture->bluez = fake_bluez_new ();
+	fixture->adapter = fake_bluez_add_adapter (fixture->bluez, "hci0", "00:01:02:03:04:05");
+}
+
+static void
+fixture_teardown (Fixture       *fixture,
+		  gconstpointer  user_data)
+{
+	g_clear_object (&fixture->model);
+	g_clear_object (&fixture->client);
+	g_clear_pointer (&fixture->bluez, fake_bluez_free);
+}
+
+static gboolean
+client_is_ready (BluetoothClient *client)
+{
+	gboolean ready;
+
+	g_object_get (G_OBJECT (client), "ready", &ready, NULL);
+	return ready;
+}
+
+static void
+start_client (Fixture *fixture)
+{
+	fixture->client = bluetooth_client_new_for_connection (fake_bluez_get_connection (fixture->bluez));
+	fixture->model = bluetooth_client_get_devices (fixture->client);
+	wait_for_condition (client_is_ready (fixture->client));
+}
+
+static void
+test_client_coldplug (Fixture       *fixture,
+		      gconstpointer  user_data)
+{
+	g_autoptr(BluetoothDevice) device = NULL;
+	g_autofree char *address = NULL;
+	guint num_adapters;
+
+	fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	fake_bluez_add_device (fixture->bluez, "hci0", "22:33:44:55:66:77", "My Mouse");
+	start_client (fixture);
+
+	g_object_get (G_OBJECT (fixture->client),
+		      "num-adapters", &num_adapters,
+		      "default-adapter-address", &address,
+		      NULL);
+	g_assert_cmpuint (num_adapters, ==, 1);
+	g_assert_cmpstr (address, ==, "00:01:02:03:04:05");
+	g_assert_cmpuint (g_list_model_get_n_items (fixture->model), ==, 2);
+
+	device = bluetooth_client_get_device_by_address (fixture->client, "22:33:44:55:66:77");
+	g_assert_nonnull (device);
+	g_assert_cmpstr (bluetooth_device_get_alias (device), ==, "My Mouse");
+	g_assert_cmpstr (bluetooth_device_get_object_path (device), ==, "/org/bluez/hci0/dev_22_33_44_55_66_77");
+}
+
+static void
+test_client_hotplug (Fixture       *fixture,
+		     gconstpointer  user_data)
+{
+	g_autoptr(BluetoothDevice) device = NULL;
+
+	start_client (fixture);
+	g_assert_cmpuint (g_list_model_get_n_items (fixture->model), ==, 0);
+
+	fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	wait_for_condition (g_list_model_get_n_items (fixture->model) == 1);
+	device = g_list_model_get_item (fixture->model, 0);
+	g_assert_cmpstr (bluetooth_device_get_address (device), ==, "11:22:33:44:55:66");
+
+	fake_bluez_remove_device (fixture->bluez, "/org/bluez/hci0/dev_11_22_33_44_55_66");
+	wait_for_condition (g_list_model_get_n_items (fixture->model) == 0);
+}
+
+static void
+test_client_property_change (Fixture       *fixture,
+			     gconstpointer  user_data)
+{
+	g_autoptr(BluetoothDevice) device = NULL;
+	FakeDevice1 *fake_device;
+
+	fake_device = fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	start_client (fixture);
+
+	device = g_list_model_get_item (fixture->model, 0);
+	fake_device1_set_alias (fake_device, "My Other Phone");
+	wait_for_condition (g_strcmp0 (bluetooth_device_get_alias (device), "My Other Phone") == 0);
+
+	fake_device1_set_paired (fake_device, TRUE);
+	wait_for_condition (bluetooth_device_get_paired (device));
+}
+
+static void
+test_client_adapter_removal (Fixture       *fixture,
+			     gconstpointer  user_data)
+{
+	guint num_adapters;
+
+	fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	start_client (fixture);
+	g_assert_cmpuint (g_list_model_get_n_items (fixture->model), ==, 1);
+
+	fake_bluez_remove_adapter (fixture->bluez, "hci0");
+	wait_for_condition (g_list_model_get_n_items (fixture->model) == 0);
+	g_object_get (G_OBJECT (fixture->client), "num-adapters", &num_adapters, NULL);
+	g_assert_cmpuint (num_adapters, ==, 0);
+}
+
+static void
+init_cb (GObject      *source_object,
+	 GAsyncResult *res,
+	 gpointer      user_data)
+{
+	GAsyncResult **result = user_data;
+
+	*result = g_object_ref (res);
+}
+
+static void
+test_client_init_cancelled (Fixture       *fixture,
+			    gconstpointer  user_data)
+{
+	g_autoptr(GCancellable) cancellable = NULL;
+	g_autoptr(GAsyncResult) result = NULL;
+	g_autoptr(GError) error = NULL;
+
+	fixture->client = bluetooth_client_new_for_connection (fake_bluez_get_connection (fixture->bluez));
+	cancellable = g_cancellable_new ();
+	g_async_initable_init_async (G_ASYNC_INITABLE (fixture->client), G_PRIORITY_DEFAULT,
+				     cancellable, init_cb, &result);
+	g_cancellable_cancel (cancellable);
+
+	/* Returns without waiting for the client to be ready */
+	wait_for_condition (result != NULL);
+	g_assert_false (g_async_initable_init_finish (G_ASYNC_INITABLE (fixture->client), result, &error));
+	g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+	g_assert_false (client_is_ready (fixture->client));
+
+	wait_for_condition (client_is_ready (fixture->client));
+}
+
+static GVariant *
+wait_for_discovery_filter (Fixture *fixture)
+{
+	GVariant *filter;
+
+	g_object_set_data (G_OBJECT (fixture->adapter), "discovery-filter", NULL);
+	g_object_set (G_OBJECT (fixture->client), "default-adapter-setup-mode", TRUE, NULL);
+	wait_for_condition (g_object_get_data (G_OBJECT (fixture->adapter), "discovery-filter") != NULL);
+	filter = g_object_get_data (G_OBJECT (fixture->adapter), "discovery-filter");
+	g_object_set (G_OBJECT (fixture->client), "default-adapter-setup-mode", FALSE, NULL);
+
+	return g_variant_ref (filter);
+}
+
+static void
+test_client_discovery_filter (Fixture       *fixture,
+			      gconstpointer  user_data)
+{
+	g_autoptr(GVariant) filter = NULL;
+	gboolean value;
+
+	start_client (fixture);
+
+	/* Same as before the filter could be changed */
+	filter = wait_for_discovery_filter (fixture);
+	g_assert_true (g_variant_lookup (filter, "Discoverable", "b", &value));
+	g_assert_true (value);
+	g_assert_cmpuint (g_variant_n_children (filter), ==, 1);
+	g_clear_pointer (&filter, g_variant_unref);
+
+	bluetooth_client_set_discovery_filter (fixture->client, NULL, -70, 0, "le", FALSE,
+					       NULL, NULL, NULL);
+	filter = wait_for_discovery_filter (fixture);
+	g_assert_true (g_variant_lookup (filter, "DuplicateData", "b", &value));
+	g_assert_false (value);
+	g_assert_cmpuint (g_variant_n_children (filter), ==, 4);
+}
+
+static guint64
+get_counter (GVariant   *metrics,
+	     const char *name)
+{
+	guint64 value = 0;
+
+	g_assert_true (g_variant_lookup (metrics, name, "t", &value));
+	return value;
+}
+
+static void
+test_client_metrics (Fixture       *fixture,
+		     gconstpointer  user_data)
+{
+	g_autoptr(GVariant) metrics = NULL;
+	g_autoptr(GVariant) buckets = NULL;
+	g_autoptr(BluetoothDevice) device = NULL;
+	FakeDevice1 *fake_device;
+	guint64 count, total, max, oui_hits;
+	guint32 live_devices, oui_size;
+
+	fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	start_client (fixture);
+
+	fake_device = fake_bluez_add_device (fixture->bluez, "hci0", "22:33:44:55:66:77", "My Mouse");
+	fake_bluez_sync (fixture->bluez);
+	device = g_list_model_get_item (fixture->model, 1);
+	fake_device1_set_alias (fake_device, "My Other Mouse");
+	wait_for_condition (g_strcmp0 (bluetooth_device_get_alias (device), "My Other Mouse") == 0);
+
+	metrics = bluetooth_client_get_metrics (fixture->client);
+	/* The device present on startup doesn't come from a signal */
+	g_assert_cmpuint (get_counter (metrics, "devices-added"), ==, 1);
+	g_assert_cmpuint (get_counter (metrics, "device-properties-changed"), ==, 1);
+	g_assert_cmpuint (get_counter (metrics, "model-inserts"), ==, 2);
+	g_assert_cmpuint (get_counter (metrics, "model-removals"), ==, 0);
+	g_assert_cmpuint (get_counter (metrics, "model-updates"), ==, 1);
+
+	g_assert_true (g_variant_lookup (metrics, "device-added-time", "(ttt@at)",
+					 &count, &total, &max, &buckets));
+	g_assert_cmpuint (count, ==, 2);
+	g_assert_cmpuint (max, <=, total);
+	g_assert_cmpuint (g_variant_n_children (buckets), ==, 16);
+
+	g_assert_true (g_variant_lookup (metrics, "live-devices", "u", &live_devices));
+	g_assert_cmpuint (live_devices, ==, 1);
+
+	/* Entries are only added to the OUI cache on misses */
+	g_assert_true (g_variant_lookup (metrics, "oui-cache-hits", "t", &oui_hits));
+	g_assert_true (g_variant_lookup (metrics, "oui-cache-size", "u", &oui_size));
+	g_assert_cmpuint (oui_size, <=, get_counter (metrics, "oui-cache-misses"));
+
+	bluetooth_client_reset_metrics (fixture->client);
+	g_clear_pointer (&metrics, g_variant_unref);
+	metrics = bluetooth_client_get_metrics (fixture->client);
+	g_assert_cmpuint (get_counter (metrics, "devices-added"), ==, 0);
+	g_assert_cmpuint (get_counter (metrics, "model-inserts"), ==, 0);
+}
+
+static void
+test_client_record_replay (Fixture       *fixture,
+			   gconstpointer  user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) events = NULL;
+	g_autoptr(BluetoothDevice) device = NULL;
+	g_autofree char *filename = NULL;
+	FakeDevice1 *fake_device;
+	const char *type;
+	guint i;
+	int fd;
+
+	fd = g_file_open_tmp ("bluetooth-events-XXXXXX.txt", &filename, &error);
+	g_assert_no_error (error);
+	g_close (fd, NULL);
+
+	/* Record */
+	g_setenv ("BLUETOOTH_RECORD_EVENTS", filename, TRUE);
+	fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	start_client (fixture);
+	g_unsetenv ("BLUETOOTH_RECORD_EVENTS");
+
+	fake_device = fake_bluez_add_device (fixture->bluez, "hci0", "22:33:44:55:66:77", "My Mouse");
+	fake_bluez_sync (fixture->bluez);
+	fake_device1_set_alias (fake_device, "My Other Mouse");
+	fake_bluez_sync (fixture->bluez);
+	fake_bluez_remove_device (fixture->bluez, "/org/bluez/hci0/dev_11_22_33_44_55_66");
+	fake_bluez_sync (fixture->bluez);
+	g_clear_object (&fixture->model);
+	g_clear_object (&fixture->client);
+
+	events = fake_bluez_load_events (filename, &error);
+	g_assert_no_error (error);
+	g_assert_cmpuint (events->len, ==, 5);
+	g_variant_get_child (g_ptr_array_index (events, 0), 1, "&s", &type);
+	g_assert_cmpstr (type, ==, "coldplug");
+	g_variant_get_child (g_ptr_array_index (events, 2), 1, "&s", &type);
+	g_assert_cmpstr (type, ==, "added");
+	g_variant_get_child (g_ptr_array_index (events, 3), 1, "&s", &type);
+	g_assert_cmpstr (type, ==, "changed");
+	g_variant_get_child (g_ptr_array_index (events, 4), 1, "&s", &type);
+	g_assert_cmpstr (type, ==, "removed");
+
+	/* And replay against a new bluez */
+	g_clear_pointer (&fixture->bluez, fake_bluez_free);
+	fixture->bluez = fake_bluez_new ();
+	for (i = 0; i < events->len; i++)
+		g_assert_true (fake_bluez_replay_event (fixture->bluez, g_ptr_array_index (events, i)));
+	start_client (fixture);
+
+	g_assert_cmpuint (g_list_model_get_n_items (fixture->model), ==, 1);
+	device = g_list_model_get_item (fixture->model, 0);
+	g_assert_cmpstr (bluetooth_device_get_address (device), ==, "22:33:44:55:66:77");
+	g_assert_cmpstr (bluetooth_device_get_alias (device), ==, "My Other Mouse");
+
+	g_unlink (filename);
+}
+
+static void
+test_client_replay_invalidated (Fixture       *fixture,
+				gconstpointer  user_data)
+{
+	g_autoptr(GVariant) event = NULL;
+	g_autoptr(GError) error = NULL;
+	FakeDevice1 *fake_device;
+
+	fake_device = fake_bluez_add_device (fixture->bluez, "hci0", "11:22:33:44:55:66", "My Phone");
+	fake_device1_set_rssi (fake_device, -60);
+
+	/* As recorded when the device goes out of range */
+	event = g_variant_parse (G_VARIANT_TYPE (FAKE_BLUEZ_EVENT_TYPE),
+				 "(int64 1000, 'changed', '/org/bluez/hci0/dev_11_22_33_44_55_66', "
+				 "'org.bluez.Device1', @a{sv} {}, ['RSSI'])",
+				 NULL, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_true (fake_bluez_replay_event (fixture->bluez, event));
+	g_assert_cmpint (fake_device1_get_rssi (fake_device), ==, 0);
+}
+
+static void
+test_client_coldplug_perf (Fixture       *fixture,
+			   gconstpointer  user_data)
+{
+	guint i;
+
+	if (!g_test_perf ()) {
+		g_test_skip ("Performance tests are only run with -m perf");
+		return;
+	}
+
+	for (i = 0; i < NUM_PERF_DEVICES; i++) {
+		g_autofree char *address = NULL;
+
+		address = g_strdup_printf ("00:11:22:%02X:%02X:%02X",
+					   (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		fake_bluez_add_device (fixture->bluez, "hci0", address, "Device");
+	}
+
+	g_test_timer_start ();
+	start_client (fixture);
+	g_test_minimized_result (g_test_timer_elapsed (),
+				 "Coldplug of %u devices: %.3f s",
+				 NUM_PERF_DEVICES, g_test_timer_last ());
+	g_assert_cmpuint (g_list_model_get_n_items (fixture->model), ==, NUM_PERF_DEVICES);
+}
+
+#define add_test(path, func) \
+	g_test_add (path, Fixture, NULL, fixture_setup, func, fixture_teardown)
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+	add_test ("/bluetooth/client/coldplug", test_client_coldplug);
+	add_test ("/bluetooth/client/hotplug", test_client_hotplug);
+	add_test ("/bluetooth/client/property-change", test_client_property_change);
+	add_test ("/bluetooth/client/adapter-removal", test_client_adapter_removal);
+	add_test ("/bluetooth/client/init-cancelled", test_client_init_cancelled);
+	add_test ("/bluetooth/client/discovery-filter", test_client_discovery_filter);
+	add_test ("/bluetooth/client/metrics", test_client_metrics);
+	add_test ("/bluetooth/client/record-replay", test_client_record_replay);
+	add_test ("/bluetooth/client/replay-invalidated", test_client_replay_invalidated);
+	add_test ("/bluetooth/client/coldplug-perf", test_client_coldplug_perf);
+
+	return g_test_run ();
+}
@@ -8,6 +8,7 @@
 #include <glib/gi18n.h>
 
 #include "bluetooth-device.h"
+#include "bluetooth-utils.h"
 
 static void
 test_device (void)
@@ -44,10 +45,148 @@ test_device (void)
 	g_object_unref (device);
 }
 
+static void
+test_device_strings (void)
+{
+	BluetoothDevice *device, *other;
+
+	device = g_object_new (BLUETOOTH_TYPE_DEVICE,
+			       "address", "00:11:22:33:44:55",
+			       "alias", "Fake Name",
+			       "name", "Fake Name",
+			       "icon", "input-keyboard",
+			       NULL);
+	other = g_object_new (BLUETOOTH_TYPE_DEVICE,
+			      "address", "00:11:22:33:44:55",
+			      "icon", "input-keyboard",
+			      NULL);
+
+	g_assert_cmpstr (bluetooth_device_get_address (device), ==, "00:11:22:33:44:55");
+	g_assert_cmpstr (bluetooth_device_get_alias (device), ==, "Fake Name");
+	g_assert_cmpstr (bluetooth_device_get_name (device), ==, "Fake Name");
+	g_assert_cmpstr (bluetooth_device_get_icon (device), ==, "input-keyboard");
+	g_assert_null (bluetooth_device_get_name (other));
+
+	/* Equal strings are shared */
+	g_assert_true (bluetooth_device_get_address (device) == bluetooth_device_get_address (other));
+	g_assert_true (bluetooth_device_get_icon (device) == bluetooth_device_get_icon (other));
+	g_assert_true (bluetooth_device_get_alias (device) == bluetooth_device_get_name (device));
+
+	g_object_set (G_OBJECT (device), "alias", "New Name", NULL);
+	g_assert_cmpstr (bluetooth_device_get_alias (device), ==, "New Name");
+	g_object_set (G_OBJECT (device), "alias", NULL, NULL);
+	g_assert_null (bluetooth_device_get_alias (device));
+
+	g_object_unref (other);
+	g_object_unref (device);
+}
+
+static void
+test_device_services (void)
+{
+	BluetoothDevice *device;
+	BluetoothServiceFlags services;
+	g_auto(GStrv) uuids = NULL;
+	const char *names[] = {
+		"OBEXObjectPush",
+		"AudioSink",
+		NULL
+	};
+	const char *raw_uuids[] = {
+		"0000110b-0000-1000-8000-00805f9b34fb",
+		"00001105-0000-1000-8000-00805F9B34FB",
+		"00001124-0000-1000-8000-00805f9b34fb",
+		"00001812-0000-1000-8000-00805f9b34fb",
+		"00001200-0000-1000-8000-00805f9b34fb",
+		"00000002-0000-1000-8000-0002ee000002",
+		"12345678-1234-1234-1234-123456789abc",
+		NULL
+	};
+
+	g_assert_cmpuint (bluetooth_uuids_to_service_flags (NULL), ==, BLUETOOTH_SERVICE_NONE);
+	g_assert_cmpuint (bluetooth_uuids_to_service_flags (raw_uuids), ==,
+			  BLUETOOTH_SERVICE_AUDIO_SINK | BLUETOOTH_SERVICE_OBEX_OBJECT_PUSH |
+			  BLUETOOTH_SERVICE_HID | BLUETOOTH_SERVICE_SYNCML_CLIENT);
+
+	/* Setting the names updates the services */
+	device = g_object_new (BLUETOOTH_TYPE_DEVICE,
+			       "uuids", names,
+			       NULL);
+	g_object_get (G_OBJECT (device), "services", &services, NULL);
+	g_assert_cmpuint (services, ==, BLUETOOTH_SERVICE_OBEX_OBJECT_PUSH | BLUETOOTH_SERVICE_AUDIO_SINK);
+	g_assert_true (services & BLUETOOTH_SERVICE_CONNECTABLE);
+	g_assert_true (services & BLUETOOTH_SERVICE_AUDIO);
+	g_assert_true (services & BLUETOOTH_SERVICE_OBEX);
+	g_assert_false (services & BLUETOOTH_SERVICE_INPUT);
+
+	/* And the names are derived from the services, in UUID order */
+	g_object_set (G_OBJECT (device),
+		      "services", bluetooth_uuids_to_service_flags (raw_uuids),
+		      NULL);
+	g_object_get (G_OBJECT (device), "uuids", &uuids, NULL);
+	g_assert_cmpuint (g_strv_length (uuids), ==, 4);
+	g_assert_cmpstr (uuids[0], ==, "OBEXObjectPush");
+	g_assert_cmpstr (uuids[1], ==, "AudioSink");
+	g_assert_cmpstr (uuids[2], ==, "HumanInterfaceDeviceService");
+	g_assert_cmpstr (uuids[3], ==, "SyncMLClient");
+	g_clear_pointer (&uuids, g_strfreev);
+
+	g_object_set (G_OBJECT (device),
+		      "services", BLUETOOTH_SERVICE_NONE,
+		      NULL);
+	g_object_get (G_OBJECT (device), "uuids", &uuids, NULL);
+	g_assert_null (uuids);
+
+	g_object_unref (device);
+}
+
+static void
+test_uuid_to_string (void)
+{
+	/* Bluetooth base UUID, in either case */
+	g_assert_cmpstr (bluetooth_uuid_to_string ("00001101-0000-1000-8000-00805f9b34fb"), ==, "SerialPort");
+	g_assert_cmpstr (bluetooth_uuid_to_string ("0000110A-0000-1000-8000-00805F9B34FB"), ==, "AudioSource");
+	g_assert_null (bluetooth_uuid_to_string ("00001000-0000-1000-8000-00805f9b34fb"));
+	g_assert_null (bluetooth_uuid_to_string ("0000ffff-0000-1000-8000-00805f9b34fb"));
+
+	/* SyncML base */
+	g_assert_cmpstr (bluetooth_uuid_to_string ("00000002-0000-1000-8000-0002ee000002"), ==, "SyncMLClient");
+	g_assert_cmpstr (bluetooth_uuid_to_string ("00005601-0000-1000-8000-0002EE000002"), ==, "Nokia SyncML Server");
+	g_assert_null (bluetooth_uuid_to_string ("00001101-0000-1000-8000-0002ee000002"));
+
+	/* Vendor UUIDs only match on all 128 bits */
+	g_assert_cmpstr (bluetooth_uuid_to_string ("8e771301-8da5-11df-8d6f-0002a5d5c51b"), ==, "SEMC HLA");
+	g_assert_cmpstr (bluetooth_uuid_to_string ("8E771401-8DA5-11DF-8D6F-0002A5D5C51B"), ==, "SEMC Watch Phone");
+	g_assert_null (bluetooth_uuid_to_string ("8e771301-0000-1000-8000-00805f9b34fb"));
+	g_assert_null (bluetooth_uuid_to_string ("8e771301-1234-1234-1234-123456789abc"));
+	g_assert_null (bluetooth_uuid_to_string ("00001101-1234-1234-1234-123456789abc"));
+
+	/* Short UUIDs */
+	g_assert_cmpstr (bluetooth_uuid_to_string ("1101"), ==, "SerialPort");
+	g_assert_cmpstr (bluetooth_uuid_to_string ("1812"), ==, "HumanInterfaceDeviceService");
+	g_assert_null (bluetooth_uuid_to_string ("0"));
+
+	/* Malformed */
+	g_assert_null (bluetooth_uuid_to_string (""));
+	g_assert_null (bluetooth_uuid_to_string ("SerialPort"));
+	g_assert_null (bluetooth_uuid_to_string ("00001101_0000_1000_8000_00805f9b34fb"));
+	g_assert_null (bluetooth_uuid_to_string ("0000110g-0000-1000-8000-00805f9b34fb"));
+
+	g_assert_cmpuint (bluetooth_uuids_to_service_flags ((const char *[]) {
+		"8e771303-8da5-11df-8d6f-0002a5d5c51b",
+		"8e771303-1234-1234-1234-123456789abc",
+		"not-a-uuid",
+		NULL
+	}), ==, BLUETOOTH_SERVICE_SEMC_HLA);
+}
+
 int main (int argc, char **argv)
 {
 	g_test_init (&argc, &argv, NULL);
 	g_test_add_func ("/bluetooth/device", test_device);
+	g_test_add_func ("/bluetooth/device/strings", test_device_strings);
+	g_test_add_func ("/bluetooth/device/services", test_device_services);
+	g_test_add_func ("/bluetooth/uuid-to-string", test_uuid_to_string);
 
 	return g_test_run ();
 }